@@ -0,0 +1,309 @@
+// Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+#pragma once
+
+#include <coreplat.h>
+
+//
+// Platform-neutral power core, see core.c. The core owns the power
+// state machine and the life cycle of P-state transitions, and reaches
+// the platform (PoFx and WDF in the driver, a fake PEP off-target) only
+// through a TOUCH_POWER_CORE_BACKEND.
+//
+
+//
+// Number of P-state transitions that can be outstanding at the PEP at
+// the same time. Their bookkeeping is carved out of the core so that
+// the toggle path does not have to go to pool.
+//
+#define TOUCH_POWER_MAX_TRANSITIONS     4
+
+//
+// A transition is Requested once its slot is claimed, InProgress while
+// the PEP works on it and Settled once the PEP confirmed it, failed it,
+// or the watchdog gave up on it.
+//
+typedef enum _TOUCH_POWER_TRANSITION_PHASE
+{
+    TransitionPhaseRequested = 0,
+    TransitionPhaseInProgress,
+    TransitionPhaseSettled
+} TOUCH_POWER_TRANSITION_PHASE;
+
+//
+// The phase of a slot shares its word with a sequence number that is
+// bumped for every transition the slot carries, so that settling a
+// transition can tell it apart from an earlier one that used the same
+// slot. The PEP is handed the slot index and the sequence as pUserData
+// (the slot's UserData), which lets TchCoreConfirm drop confirmations
+// that arrive after the watchdog gave up on their transition.
+//
+#define TOUCH_POWER_PHASE(p)                ((LONG)((p) & 0x3))
+#define TOUCH_POWER_PHASE_SEQUENCE(p)       (((ULONG)(p) >> 2) & 0xFFFFFFF)
+#define TOUCH_POWER_PHASE_PACK(q, p)        \
+    ((LONG)((((ULONG)(q) & 0xFFFFFFF) << 2) | ((ULONG)(p) & 0x3)))
+#define TOUCH_POWER_SLOT_TAG(i, q)          \
+    ((PVOID)(ULONG_PTR)((((ULONG_PTR)(q) & 0xFFFFFFF) << 4) | ((ULONG_PTR)(i) & 0xF)))
+#define TOUCH_POWER_SLOT_TAG_INDEX(t)       ((ULONG)((ULONG_PTR)(t) & 0xF))
+#define TOUCH_POWER_SLOT_TAG_SEQUENCE(t)    ((ULONG)(((ULONG_PTR)(t) >> 4) & 0xFFFFFFF))
+
+//
+// Number of P-state sets a single PEP request can address. Set 0 is the
+// digitizer power gate, P-state 0 in it is on and P-state 1 off; other
+// P-states and sets are panel specific (scan rates, for instance).
+//
+#define TOUCH_POWER_MAX_PSTATE_SETS     4
+#define TOUCH_POWER_PSTATE_ON           0
+#define TOUCH_POWER_PSTATE_OFF          1
+
+//
+// Target P-state per set, TOUCH_POWER_NO_TARGET leaves a set alone
+//
+#define TOUCH_POWER_NO_TARGET           (-1)
+
+typedef struct _TOUCH_POWER_PSTATE_VECTOR
+{
+    LONG PStates[TOUCH_POWER_MAX_PSTATE_SETS];
+} TOUCH_POWER_PSTATE_VECTOR, *PTOUCH_POWER_PSTATE_VECTOR;
+
+//
+// One set of a P-state request, as handed to the backend
+//
+typedef struct _TOUCH_POWER_PSTATE_ENTRY
+{
+    ULONG SetIndex;
+    ULONG PStateIndex;
+} TOUCH_POWER_PSTATE_ENTRY, *PTOUCH_POWER_PSTATE_ENTRY;
+
+//
+// Sizes of the statistics and votes the driver keeps and reports
+// through power.h, here so that power.h can be used without the
+// driver's own headers. Transitions are split by what they do to set 0:
+// power on, power off, or leave it alone. Queued requests are split by
+// the priority class the transition engine serves them in: power-on
+// first, everything else after it.
+//
+#define TOUCH_POWER_LATENCY_BUCKETS         24
+#define TOUCH_POWER_MAX_FAILURE_STATUSES    8
+#define TOUCH_POWER_RESIDENCY_STATES        8
+#define TOUCH_POWER_VOTE_PRIORITIES         4
+
+typedef enum _TOUCH_POWER_DIRECTION
+{
+    TouchPowerDirectionOn = 0,
+    TouchPowerDirectionOff,
+    TouchPowerDirectionOther,
+    TouchPowerDirectionCount
+} TOUCH_POWER_DIRECTION;
+
+typedef enum _TOUCH_POWER_QUEUE_CLASS
+{
+    TouchPowerQueueWake = 0,
+    TouchPowerQueueNormal,
+    TouchPowerQueueClassCount
+} TOUCH_POWER_QUEUE_CLASS;
+
+typedef struct _TOUCH_POWER_TRANSITION_SLOT
+{
+    ULONG Index;
+
+    //
+    // Tracking of transitions the PEP answered with STATUS_WAIT_1 or
+    // STATUS_WAIT_3. Whoever drops the last reference finishes the
+    // transition and completes PendingRequest. Phase is packed with the
+    // sequence number, see TOUCH_POWER_PHASE_PACK; UserData is what the
+    // backend hands the PEP to have it passed back with the confirmation.
+    // PepStatus is the last result the PEP reported, STATUS_PENDING if
+    // it never answered, SettledStatus the outcome of the transition.
+    //
+    volatile LONG Phase;
+    PVOID UserData;
+    volatile LONG References;
+    NTSTATUS SettledStatus;
+    NTSTATUS PepStatus;
+    TOUCH_POWER_PSTATE_VECTOR Target;
+    BOOLEAN ChangesState;
+    ULONG Generation;
+    ULONG Cause;
+    ULONG CallerPid;
+    LONGLONG StartTicks;
+    LONGLONG SettledTicks;
+    PVOID PendingRequest;
+    ULONGLONG Deadline;
+} TOUCH_POWER_TRANSITION_SLOT, *PTOUCH_POWER_TRANSITION_SLOT;
+
+//
+// The digitizer power state is kept in a single interlocked word so
+// that it can be updated with compare-and-swap and read without any
+// lock. The low nibble is the current state, the next three bits the
+// state being transitioned to, bit 7 is set while a transition owns the
+// state machine and the rest is a generation counter that is bumped for
+// every transition started. Transitions to the current state claim the
+// state machine as well, so they cannot overlap one that changes it.
+// The current state is TOUCH_POWER_STATE_UNKNOWN until a transition of
+// set 0 reached its target.
+//
+#define TOUCH_POWER_STATE_UNKNOWN           0xF
+#define TOUCH_POWER_STATE_CLAIMED           0x80
+#define TOUCH_POWER_STATE_CURRENT(s)        ((DWORD)((s) & 0xF))
+#define TOUCH_POWER_STATE_TARGET(s)         ((DWORD)(((s) >> 4) & 0x7))
+#define TOUCH_POWER_STATE_GENERATION(s)     ((ULONG)(s) >> 8)
+#define TOUCH_POWER_STATE_BUSY(s)           (((s) & TOUCH_POWER_STATE_CLAIMED) != 0)
+#define TOUCH_POWER_STATE_PACK(c, t, g)     \
+    ((LONG)(((ULONG)(g) << 8) | (((ULONG)(t) & 0x7) << 4) | ((ULONG)(c) & 0xF)))
+
+//
+// Platform the core runs on. Context is passed back as is.
+//
+typedef struct _TOUCH_POWER_CORE_BACKEND
+{
+    //
+    // Registers the device with the power framework
+    //
+    NTSTATUS (*RegisterDevice)(
+        IN PVOID Context);
+
+    //
+    // Sends a P-state request to the PEP. Returns the status of the
+    // call itself; PepStatus receives the PEP's answer, STATUS_WAIT_1
+    // or STATUS_WAIT_3 if it will confirm later through
+    // TchCoreConfirm, with Slot->UserData.
+    //
+    NTSTATUS (*PowerControl)(
+        IN PVOID Context,
+        IN PTOUCH_POWER_TRANSITION_SLOT Slot,
+        IN const TOUCH_POWER_PSTATE_ENTRY* Entries,
+        IN ULONG Count,
+        OUT NTSTATUS* PepStatus);
+
+    //
+    // Arms and disarms the timer that calls TchCoreOnWatchdog for a
+    // pending transition
+    //
+    VOID (*StartWatchdog)(
+        IN PVOID Context,
+        IN PTOUCH_POWER_TRANSITION_SLOT Slot,
+        IN ULONG TimeoutMs);
+
+    VOID (*StopWatchdog)(
+        IN PVOID Context,
+        IN PTOUCH_POWER_TRANSITION_SLOT Slot);
+
+    //
+    // Called once the outcome of a transition has been published
+    //
+    VOID (*TransitionCommitted)(
+        IN PVOID Context,
+        IN PTOUCH_POWER_TRANSITION_SLOT Slot,
+        IN NTSTATUS Status,
+        IN BOOLEAN StateChanged);
+
+    //
+    // Completes the request of a transition that was left pending
+    //
+    VOID (*CompleteRequest)(
+        IN PVOID Context,
+        IN PVOID Request,
+        IN NTSTATUS Status);
+} TOUCH_POWER_CORE_BACKEND, *PTOUCH_POWER_CORE_BACKEND;
+
+typedef struct _TOUCH_POWER_CORE
+{
+    const TOUCH_POWER_CORE_BACKEND* Backend;
+    PVOID Context;
+
+    //
+    // How long the PEP may take to confirm a pending transition, 0
+    // waits forever
+    //
+    ULONG TransitionTimeoutMs;
+
+    volatile LONG PowerState;
+
+    //
+    // Last P-state the PEP confirmed for each set, TOUCH_POWER_NO_TARGET
+    // if unknown. A bit set in SetMask means a transition owns the set
+    // until its outcome is published; set 0 is owned through PowerState
+    // instead.
+    //
+    volatile LONG PStateCache[TOUCH_POWER_MAX_PSTATE_SETS];
+    volatile LONG SetMask;
+
+    //
+    // Transition bookkeeping, a bit set in SlotMask means the matching
+    // slot is owned by an in-flight transition
+    //
+    TOUCH_POWER_TRANSITION_SLOT Slots[TOUCH_POWER_MAX_TRANSITIONS];
+    volatile LONG SlotMask;
+    volatile LONG SlotExhausted;
+
+    //
+    // Confirmations for transitions that had been settled already,
+    // usually by the watchdog
+    //
+    volatile LONG LateConfirmations;
+} TOUCH_POWER_CORE, *PTOUCH_POWER_CORE;
+
+VOID
+TchCoreInitialize(
+    OUT PTOUCH_POWER_CORE Core,
+    IN const TOUCH_POWER_CORE_BACKEND* Backend,
+    IN PVOID Context,
+    IN ULONG TransitionTimeoutMs
+);
+
+NTSTATUS
+TchCoreRegisterDevice(
+    IN PTOUCH_POWER_CORE Core
+);
+
+DWORD
+TchCoreGetState(
+    IN PTOUCH_POWER_CORE Core
+);
+
+NTSTATUS
+TchCoreVectorFromState(
+    IN DWORD State,
+    OUT PTOUCH_POWER_PSTATE_VECTOR Vector
+);
+
+ULONG
+TchCoreBuildRequest(
+    IN const TOUCH_POWER_PSTATE_VECTOR* Target,
+    OUT PTOUCH_POWER_PSTATE_ENTRY Entries
+);
+
+VOID
+TchCoreMerge(
+    IN OUT PTOUCH_POWER_PSTATE_VECTOR Target,
+    IN const TOUCH_POWER_PSTATE_VECTOR* Later
+);
+
+BOOLEAN
+TchCoreElide(
+    IN PTOUCH_POWER_CORE Core,
+    IN OUT PTOUCH_POWER_PSTATE_VECTOR Target
+);
+
+NTSTATUS
+TchCoreSetPStates(
+    IN PTOUCH_POWER_CORE Core,
+    IN const TOUCH_POWER_PSTATE_VECTOR* Target,
+    IN PVOID Request,
+    IN ULONG Cause,
+    IN ULONG CallerPid
+);
+
+NTSTATUS
+TchCoreConfirm(
+    IN PTOUCH_POWER_CORE Core,
+    IN PVOID UserData,
+    IN NTSTATUS PepStatus
+);
+
+BOOLEAN
+TchCoreOnWatchdog(
+    IN PTOUCH_POWER_CORE Core,
+    IN PTOUCH_POWER_TRANSITION_SLOT Slot
+);
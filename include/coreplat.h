@@ -0,0 +1,235 @@
+// Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+#pragma once
+
+//
+// Platform layer of the power core (core.c). In the driver it maps to
+// the kernel; everywhere else it supplies the handful of NT types,
+// status codes and interlocked primitives the core uses, so that the
+// core can be built and exercised off-target.
+//
+
+#ifdef _KERNEL_MODE
+
+#include <wdm.h>
+
+#define TCH_ASSERT(e)                       NT_ASSERT(e)
+
+//
+// Performance counter ticks and their frequency, for latencies
+//
+#define TchPlatQueryTicks()                 (KeQueryPerformanceCounter(NULL).QuadPart)
+
+//
+// Interrupt time in 100ns units, for deadlines and timestamps
+//
+#define TchPlatQueryTime()                  KeQueryInterruptTime()
+
+FORCEINLINE
+LONGLONG
+TchPlatQueryTicksFrequency(
+    VOID
+)
+{
+    LARGE_INTEGER frequency;
+
+    KeQueryPerformanceCounter(&frequency);
+
+    return frequency.QuadPart;
+}
+
+#else
+
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <time.h>
+
+#define IN
+#define OUT
+#define VOID                                void
+#define FORCEINLINE                         static inline
+#define TRUE                                1
+#define FALSE                               0
+#define ANYSIZE_ARRAY                       1
+#define MAXLONG                             0x7FFFFFFF
+
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef uint32_t DWORD;
+typedef int64_t LONGLONG, LONG64;
+typedef uint64_t ULONGLONG, *PULONGLONG;
+typedef uint8_t UCHAR, BOOLEAN;
+typedef uint16_t USHORT;
+typedef size_t SIZE_T;
+typedef uintptr_t ULONG_PTR;
+typedef void *PVOID;
+typedef LONG NTSTATUS;
+
+#define FIELD_OFFSET(type, field)           ((LONG)offsetof(type, field))
+#define C_ASSERT(e)                         _Static_assert(e, #e)
+
+#ifndef min
+#define min(a, b)                           (((a) < (b)) ? (a) : (b))
+#define max(a, b)                           (((a) > (b)) ? (a) : (b))
+#endif
+
+#define NT_SUCCESS(s)                       (((NTSTATUS)(s)) >= 0)
+#define UNREFERENCED_PARAMETER(p)           ((void)(p))
+
+#define STATUS_SUCCESS                      ((NTSTATUS)0x00000000L)
+#define STATUS_WAIT_1                       ((NTSTATUS)0x00000001L)
+#define STATUS_WAIT_3                       ((NTSTATUS)0x00000003L)
+#define STATUS_PENDING                      ((NTSTATUS)0x00000103L)
+#define STATUS_UNSUCCESSFUL                 ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED              ((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_PARAMETER            ((NTSTATUS)0xC000000DL)
+#define STATUS_INSUFFICIENT_RESOURCES       ((NTSTATUS)0xC000009AL)
+#define STATUS_NOT_SUPPORTED                ((NTSTATUS)0xC00000BBL)
+#define STATUS_NOT_FOUND                    ((NTSTATUS)0xC0000225L)
+#define STATUS_CANCELLED                    ((NTSTATUS)0xC0000120L)
+#define STATUS_DEVICE_NOT_READY             ((NTSTATUS)0xC00000A3L)
+#define STATUS_IO_TIMEOUT                   ((NTSTATUS)0xC00000B5L)
+#define STATUS_DEVICE_BUSY                  ((NTSTATUS)0x80000011L)
+
+#define TCH_ASSERT(e)                       assert(e)
+
+//
+// Enough of GUIDs and I/O control codes for the driver's interface
+// headers, power.h and private\pep.h, to be used off-target as well.
+// DEFINE_GUID instantiates the GUID where INITGUID is defined.
+//
+typedef struct _GUID
+{
+    ULONG Data1;
+    USHORT Data2;
+    USHORT Data3;
+    UCHAR Data4[8];
+} GUID, *LPGUID;
+
+typedef const GUID* LPCGUID;
+
+#undef DEFINE_GUID
+#ifdef INITGUID
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    const GUID name = { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
+#else
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    extern const GUID name
+#endif
+
+#define METHOD_BUFFERED                     0
+#define FILE_ANY_ACCESS                     0
+#define CTL_CODE(type, function, method, access) \
+    (((type) << 16) | ((access) << 14) | ((function) << 2) | (method))
+
+FORCEINLINE LONG
+InterlockedCompareExchange(volatile LONG* Target, LONG Exchange, LONG Comparand)
+{
+    __atomic_compare_exchange_n(Target, &Comparand, Exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE LONG64
+InterlockedCompareExchange64(volatile LONG64* Target, LONG64 Exchange, LONG64 Comparand)
+{
+    __atomic_compare_exchange_n(Target, &Comparand, Exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE LONG
+InterlockedExchange(volatile LONG* Target, LONG Value)
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG64
+InterlockedExchange64(volatile LONG64* Target, LONG64 Value)
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG
+InterlockedIncrement(volatile LONG* Target)
+{
+    return __atomic_add_fetch(Target, 1, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG
+InterlockedDecrement(volatile LONG* Target)
+{
+    return __atomic_sub_fetch(Target, 1, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG64
+InterlockedAdd64(volatile LONG64* Target, LONG64 Value)
+{
+    return __atomic_add_fetch(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE BOOLEAN
+InterlockedBitTestAndSet(volatile LONG* Base, LONG Bit)
+{
+    return (__atomic_fetch_or(Base, (LONG)(1u << Bit), __ATOMIC_SEQ_CST) >> Bit) & 1;
+}
+
+FORCEINLINE BOOLEAN
+InterlockedBitTestAndReset(volatile LONG* Base, LONG Bit)
+{
+    return (__atomic_fetch_and(Base, (LONG)~(1u << Bit), __ATOMIC_SEQ_CST) >> Bit) & 1;
+}
+
+FORCEINLINE LONG
+ReadNoFence(const volatile LONG* Source)
+{
+    return __atomic_load_n(Source, __ATOMIC_RELAXED);
+}
+
+FORCEINLINE LONG
+ReadAcquire(const volatile LONG* Source)
+{
+    return __atomic_load_n(Source, __ATOMIC_ACQUIRE);
+}
+
+FORCEINLINE LONG64
+ReadNoFence64(const volatile LONG64* Source)
+{
+    return __atomic_load_n(Source, __ATOMIC_RELAXED);
+}
+
+#ifdef TOUCH_CORE_VIRTUAL_CLOCK
+
+//
+// Nanoseconds of a clock the host drives itself, for deterministic
+// simulation (see tools/replay.c)
+//
+LONGLONG
+TchPlatQueryTicks(VOID);
+
+#else
+
+FORCEINLINE LONGLONG
+TchPlatQueryTicks(VOID)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (LONGLONG)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#endif
+
+FORCEINLINE LONGLONG
+TchPlatQueryTicksFrequency(VOID)
+{
+    return 1000000000;
+}
+
+FORCEINLINE ULONGLONG
+TchPlatQueryTime(VOID)
+{
+    return (ULONGLONG)TchPlatQueryTicks() / 100;
+}
+
+#endif
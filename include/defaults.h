@@ -0,0 +1,17 @@
+// Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+#pragma once
+
+//
+// Defaults of the registry values read by registry.c. The off-target
+// tools model the driver with the same values, so that what they
+// evaluate is the driver as it ships.
+//
+#define TOUCH_POWER_DEFAULT_TRANSITION_TIMEOUT_MS   1000
+#define TOUCH_POWER_DEFAULT_COALESCE_WINDOW_MS      0
+#define TOUCH_POWER_DEFAULT_IDLE_TIMEOUT_MS         0
+#define TOUCH_POWER_DEFAULT_MIN_ON_MS               0
+#define TOUCH_POWER_DEFAULT_MIN_OFF_MS              0
+#define TOUCH_POWER_DEFAULT_OFF_DELAY_MS            0
+#define TOUCH_POWER_DEFAULT_DISPLAY_GATING          0
+#define TOUCH_POWER_DEFAULT_DISPLAY_OFF_DELAY_MS    1000
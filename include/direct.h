@@ -0,0 +1,98 @@
+/*++
+    Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+    Module Name:
+
+        direct.h
+
+    Abstract:
+
+        Direct interface for sibling kernel drivers, such as the touch
+        controller driver, to gate digitizer power without going through
+        I/O requests
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#pragma once
+
+//
+// Queried with IRP_MN_QUERY_INTERFACE sent to the device stack of the
+// test PDO, e.g. with WdfIoTargetQueryForInterface on an I/O target
+// opened on an instance of GUID_TOUCH_POWER_INTERFACE. Unlike a handle
+// opened from user mode, a target opened from kernel mode is no test
+// session and does not keep the digitizer component active.
+//
+DEFINE_GUID(GUID_TOUCH_POWER_DIRECT_INTERFACE,
+   0x2A1B1462, 0xB0F0, 0x47F3, 0xAA, 0xAC, 0x07, 0x6C, 0x2E, 0x7B, 0x96, 0x29);
+// {2A1B1462-B0F0-47F3-AAAC-076C2E7B9629}
+
+#define TOUCH_POWER_DIRECT_INTERFACE_VERSION    1
+
+//
+// Every driver that queried the interface holds a power vote of its
+// own, the same way a handle to the test device does (see
+// IOCTL_TOUCH_POWER_VOTE). AcquirePower votes for the digitizer to stay
+// on at Priority, ReleasePower withdraws it so that the digitizer is
+// left to the votes of the other clients; a release never powers the
+// digitizer off by itself. The vote is also withdrawn once the last
+// reference to the interface is dropped through InterfaceDereference.
+// Both return once the vote is counted, not once the digitizer got
+// there.
+//
+// GetState returns 1 if the digitizer is on, 0 if it is off and
+// TOUCH_POWER_PSTATE_UNKNOWN (see power.h) if the driver does not know,
+// as IOCTL_TOUCH_POWER_STATE does.
+//
+// All three may be called at IRQL <= DISPATCH_LEVEL.
+//
+typedef
+NTSTATUS
+TOUCH_POWER_ACQUIRE_POWER(
+    IN PVOID Context,
+    IN ULONG Priority
+);
+
+typedef TOUCH_POWER_ACQUIRE_POWER *PTOUCH_POWER_ACQUIRE_POWER;
+
+typedef
+VOID
+TOUCH_POWER_RELEASE_POWER(
+    IN PVOID Context
+);
+
+typedef TOUCH_POWER_RELEASE_POWER *PTOUCH_POWER_RELEASE_POWER;
+
+typedef
+ULONG
+TOUCH_POWER_GET_STATE(
+    IN PVOID Context
+);
+
+typedef TOUCH_POWER_GET_STATE *PTOUCH_POWER_GET_STATE;
+
+typedef struct _TOUCH_POWER_DIRECT_INTERFACE
+{
+    INTERFACE InterfaceHeader;
+    PTOUCH_POWER_ACQUIRE_POWER AcquirePower;
+    PTOUCH_POWER_RELEASE_POWER ReleasePower;
+    PTOUCH_POWER_GET_STATE GetState;
+} TOUCH_POWER_DIRECT_INTERFACE, *PTOUCH_POWER_DIRECT_INTERFACE;
+
+//
+// Everything below is the driver's own, the definitions above are shared
+// with the drivers using the interface
+//
+
+EVT_WDF_DEVICE_PROCESS_QUERY_INTERFACE_REQUEST TchDirectOnQueryInterface;
+
+NTSTATUS
+TchDirectInitialize(
+    IN WDFDEVICE Device,
+    IN WDFDEVICE ChildDevice
+);
@@ -0,0 +1,120 @@
+// Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+#pragma once
+
+#include <core.h>
+
+//
+// Display gate, see display.c. The gate follows the display state the
+// power setting notifications report and decides when the digitizer
+// is powered off because the display went off, and when it comes back.
+//
+
+//
+// Display states as reported by GUID_CONSOLE_DISPLAY_STATE.
+// GUID_MONITOR_POWER_ON only reports off and on.
+//
+#define TOUCH_POWER_DISPLAY_OFF             0
+#define TOUCH_POWER_DISPLAY_ON              1
+#define TOUCH_POWER_DISPLAY_DIMMED          2
+#define TOUCH_POWER_DISPLAY_UNKNOWN         ((ULONG)-1)
+
+typedef enum _TOUCH_POWER_DISPLAY_SOURCE
+{
+    TouchPowerDisplayConsole = 0,
+    TouchPowerDisplayMonitor,
+    TouchPowerDisplaySourceCount
+} TOUCH_POWER_DISPLAY_SOURCE;
+
+//
+// What whoever drives the gate has to do after telling it about a
+// notification
+//
+typedef enum _TOUCH_POWER_DISPLAY_ACTION
+{
+    TouchPowerDisplayNone = 0,
+
+    //
+    // Ask the gate again with TchDisplayExpire once the returned
+    // interrupt time (100ns units) has passed
+    //
+    TouchPowerDisplayArm,
+
+    //
+    // The display came back before the delay was up, the timer armed
+    // for it can be stopped
+    //
+    TouchPowerDisplayDisarm,
+
+    //
+    // Power the digitizer off, after checking with TchDisplayGate, or
+    // back on
+    //
+    TouchPowerDisplayPowerOff,
+    TouchPowerDisplayPowerOn
+} TOUCH_POWER_DISPLAY_ACTION;
+
+//
+// Enabled turns gating on, the digitizer is powered off OffDelayMs
+// after the display went off and back on with the display
+//
+typedef struct _TOUCH_POWER_DISPLAY_CONFIG
+{
+    ULONG Enabled;
+    ULONG OffDelayMs;
+} TOUCH_POWER_DISPLAY_CONFIG, *PTOUCH_POWER_DISPLAY_CONFIG;
+
+typedef struct _TOUCH_POWER_DISPLAY
+{
+    TOUCH_POWER_DISPLAY_CONFIG Config;
+
+    //
+    // Last state each source reported, TOUCH_POWER_DISPLAY_UNKNOWN
+    // until it reported one, and whether the display counts as on.
+    // OffDue is the interrupt time the pending power-off, if
+    // OffPending, is due at. Gated is set while the digitizer is off
+    // because of the display, RestoreOn if it is to be powered back on
+    // with the display.
+    //
+    ULONG State[TouchPowerDisplaySourceCount];
+    BOOLEAN On;
+    BOOLEAN OffPending;
+    BOOLEAN Gated;
+    BOOLEAN RestoreOn;
+    ULONGLONG OffDue;
+
+    //
+    // Times the display went off, times the digitizer was powered off
+    // because of it, and power-offs dropped because the display came
+    // back before the delay was up
+    //
+    volatile LONG DisplayOffs;
+    volatile LONG PowerOffs;
+    volatile LONG OffsCancelled;
+} TOUCH_POWER_DISPLAY, *PTOUCH_POWER_DISPLAY;
+
+VOID
+TchDisplayInitialize(
+    OUT PTOUCH_POWER_DISPLAY Display,
+    IN const TOUCH_POWER_DISPLAY_CONFIG* Config
+);
+
+TOUCH_POWER_DISPLAY_ACTION
+TchDisplayNotify(
+    IN PTOUCH_POWER_DISPLAY Display,
+    IN TOUCH_POWER_DISPLAY_SOURCE Source,
+    IN ULONG State,
+    OUT PULONGLONG Due
+);
+
+BOOLEAN
+TchDisplayExpire(
+    IN PTOUCH_POWER_DISPLAY Display
+);
+
+BOOLEAN
+TchDisplayGate(
+    IN PTOUCH_POWER_DISPLAY Display,
+    IN ULONG DigitizerState,
+    IN BOOLEAN KeptOn
+);
@@ -28,3 +28,5 @@ EVT_WDF_DEVICE_CONTEXT_CLEANUP OnContextCleanup;
 EVT_WDF_DRIVER_DEVICE_ADD OnDeviceAdd;
 
 EVT_WDF_DEVICE_SELF_MANAGED_IO_INIT OnDeviceSelfManagedIoStart;
+
+EVT_WDF_DEVICE_SELF_MANAGED_IO_CLEANUP OnDeviceSelfManagedIoCleanup;
@@ -0,0 +1,70 @@
+/*++
+    Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+    Module Name:
+
+        idle.h
+
+    Abstract:
+
+        Declarations for the PoFx component idle handling, which powers
+        the digitizer down once nobody has needed it for a while
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#pragma once
+
+PO_FX_COMPONENT_ACTIVE_CONDITION_CALLBACK TchIdleOnComponentActive;
+
+PO_FX_COMPONENT_IDLE_CONDITION_CALLBACK TchIdleOnComponentIdle;
+
+PO_FX_COMPONENT_IDLE_STATE_CALLBACK TchIdleOnComponentIdleState;
+
+PO_FX_DEVICE_POWER_REQUIRED_CALLBACK TchIdleOnDevicePowerRequired;
+
+PO_FX_DEVICE_POWER_NOT_REQUIRED_CALLBACK TchIdleOnDevicePowerNotRequired;
+
+EVT_WDF_TIMER TchIdleOnTimeout;
+
+NTSTATUS
+TchIdleInitialize(
+    IN WDFDEVICE Device
+);
+
+VOID
+TchIdleFillStates(
+    IN PTOUCH_POWER Context,
+    OUT PPO_FX_COMPONENT_IDLE_STATE IdleStates
+);
+
+VOID
+TchIdleStart(
+    IN PTOUCH_POWER Context
+);
+
+VOID
+TchIdleStop(
+    IN PTOUCH_POWER Context
+);
+
+VOID
+TchIdleAcquire(
+    IN PTOUCH_POWER Context
+);
+
+VOID
+TchIdleRelease(
+    IN PTOUCH_POWER Context
+);
+
+VOID
+TchIdleTransitionDone(
+    IN PTOUCH_POWER Context,
+    IN ULONG Cause
+);
@@ -9,12 +9,145 @@
 #define RESHUB_USE_HELPER_ROUTINES
 #include <reshub.h>
 #include "trace.h"
+#include <private\pep.h>
+#include <core.h>
+#include <policy.h>
+#include <display.h>
 
 //
 // Memory tags
 //
 #define TOUCH_POOL_TAG                  (ULONG)'RwPT'
 
+//
+// PEP_PSTATE_RESOURCE_NODE_V2 is declared with a single PStateData
+// entry; the PEP works out how many follow from the buffer size
+//
+typedef struct _TOUCH_POWER_PEP_REQUEST
+{
+    PEP_PSTATE_RESOURCE_NODE_V2 Node;
+    PStateSetRequestSt MorePStateData[TOUCH_POWER_MAX_PSTATE_SETS - 1];
+} TOUCH_POWER_PEP_REQUEST, *PTOUCH_POWER_PEP_REQUEST;
+
+C_ASSERT(FIELD_OFFSET(TOUCH_POWER_PEP_REQUEST, MorePStateData) ==
+    FIELD_OFFSET(PEP_PSTATE_RESOURCE_NODE_V2, PStateData) + sizeof(PStateSetRequestSt));
+
+//
+// PoFx side of a transition slot of the power core, the request and
+// result buffers are carved out of the device context so that the
+// toggle path does not have to go to pool
+//
+typedef struct _TOUCH_POWER_PEP_SLOT
+{
+    TOUCH_POWER_PEP_REQUEST Request;
+    STATE_RESULT_TYPE_V2 Result;
+    WDFTIMER Watchdog;
+} TOUCH_POWER_PEP_SLOT, *PTOUCH_POWER_PEP_SLOT;
+
+//
+// Idle states (F-states) registered for the digitizer component. F1
+// has the digitizer powered off.
+//
+typedef enum _TOUCH_POWER_FSTATE
+{
+    TouchPowerF0Active = 0,
+    TouchPowerF1Off,
+    TouchPowerFStateCount
+} TOUCH_POWER_FSTATE;
+
+//
+// Transition latency and queue wait histograms, see stats.c. Their
+// sizes and the TOUCH_POWER_DIRECTION and TOUCH_POWER_QUEUE_CLASS
+// splits are in core.h.
+//
+typedef struct _TOUCH_POWER_LATENCY_COUNTERS
+{
+    volatile LONG Count;
+    volatile LONG MinUs;
+    volatile LONG MaxUs;
+    volatile LONG64 TotalUs;
+    volatile LONG Buckets[TOUCH_POWER_LATENCY_BUCKETS];
+} TOUCH_POWER_LATENCY_COUNTERS, *PTOUCH_POWER_LATENCY_COUNTERS;
+
+//
+// Residency accounting, see stats.c. P-states are those of set 0,
+// indices past the last tracked one are accounted to it. Times are
+// interrupt times in 100ns units.
+//
+typedef enum _TOUCH_POWER_RESIDENCY_DOMAIN
+{
+    TouchPowerResidencyPState = 0,
+    TouchPowerResidencyFState,
+    TouchPowerResidencyDomainCount
+} TOUCH_POWER_RESIDENCY_DOMAIN;
+
+C_ASSERT(TouchPowerFStateCount <= TOUCH_POWER_RESIDENCY_STATES);
+
+typedef struct _TOUCH_POWER_RESIDENCY_COUNTERS
+{
+    volatile LONG Current;
+    volatile LONG64 EnterTime;
+    volatile LONG64 Time[TOUCH_POWER_RESIDENCY_STATES];
+    volatile LONG Entries[TOUCH_POWER_RESIDENCY_STATES];
+} TOUCH_POWER_RESIDENCY_COUNTERS, *PTOUCH_POWER_RESIDENCY_COUNTERS;
+
+//
+// Driver tunables, see registry.c for names and defaults
+//
+typedef struct _TOUCH_POWER_CONFIG
+{
+    //
+    // How long the PEP may take to confirm a pending transition
+    // before it is failed with STATUS_IO_TIMEOUT, 0 waits forever
+    //
+    ULONG TransitionTimeoutMs;
+
+    //
+    // How long the first toggle of a burst is held back so that the
+    // ones following it can be collapsed into it, 0 disables the window
+    //
+    ULONG CoalesceWindowMs;
+
+    //
+    // How long the digitizer component has to stay idle before the
+    // digitizer is powered down, 0 keeps the component active forever
+    //
+    ULONG IdleTimeoutMs;
+
+    //
+    // Hysteresis of the power policy stage, see policy.c
+    //
+    TOUCH_POWER_POLICY_CONFIG Policy;
+
+    //
+    // Powering the digitizer off after the display, see display.c
+    //
+    TOUCH_POWER_DISPLAY_CONFIG Display;
+
+    //
+    // Per F-state nominal power (microwatts), transition latency and
+    // residency requirement (microseconds) reported to PoFx. Entries for
+    // F0 other than the nominal power are ignored.
+    //
+    ULONG FStateNominalPowerUw[TouchPowerFStateCount];
+    ULONG FStateTransitionLatencyUs[TouchPowerFStateCount];
+    ULONG FStateResidencyUs[TouchPowerFStateCount];
+} TOUCH_POWER_CONFIG, *PTOUCH_POWER_CONFIG;
+
+//
+// A transition the driver asks for on its own is published as a single
+// word, the target state in the low byte (0xFF for none) and its
+// TOUCH_POWER_CAUSE above it, so the engine never takes a target with
+// the cause of another
+//
+#define TOUCH_POWER_INTERNAL_PACK(t, c)     \
+    ((LONG)(((ULONG)(c) << 8) | ((ULONG)(t) & 0xFF)))
+#define TOUCH_POWER_INTERNAL_TARGET(i)      \
+    ((((i) & 0xFF) == 0xFF) ? TOUCH_POWER_NO_TARGET : (LONG)((i) & 0xFF))
+#define TOUCH_POWER_INTERNAL_CAUSE(i)       ((ULONG)(i) >> 8)
+#define TOUCH_POWER_INTERNAL_NONE           \
+    TOUCH_POWER_INTERNAL_PACK(TOUCH_POWER_NO_TARGET, 0)
+
 //
 // Device context
 //
@@ -26,6 +159,7 @@ typedef struct _TOUCH_POWER
     //
     WDFDEVICE FxDevice;
     PDEVICE_OBJECT PhysicalDevice;
+    TOUCH_POWER_CONFIG Config;
 
     //
     // Test related
@@ -33,11 +167,222 @@ typedef struct _TOUCH_POWER
     WDFQUEUE TestQueue;
     volatile LONG TestSessionRefCnt;
 
+    //
+    // Transition engine, toggle requests are parked in TransitionQueue,
+    // or TransitionWakeQueue if they power the digitizer on, and carried
+    // out by TransitionWorkItem. Requests collapsed into a later one wait
+    // in TransitionWaitQueue. TransitionSequence numbers requests in
+    // arrival order across both queues. TransitionCause is the cause of
+    // the transition in flight. TransitionInternal holds the
+    // transition the driver asked for on its own, packed with its cause
+    // (see TOUCH_POWER_INTERNAL_PACK); the latest one replaces any still
+    // pending, see TchTransitionSubmitInternal.
+    //
+    WDFQUEUE TransitionQueue;
+    WDFQUEUE TransitionWakeQueue;
+    WDFQUEUE TransitionWaitQueue;
+    WDFWORKITEM TransitionWorkItem;
+    WDFTIMER TransitionWindowTimer;
+    volatile LONG TransitionPumpActive;
+    volatile LONG TransitionPumpKick;
+    volatile LONG TransitionInFlight;
+    ULONG TransitionCause;
+    volatile LONG TransitionWindowArmed;
+    volatile LONG TransitionWindowExpired;
+    volatile LONG TransitionInternal;
+    volatile LONG TransitionSequence;
+
+    //
+    // Power policy stage, see policy.c. A power-off the stage holds
+    // back is kept in PolicyHeldTarget until PolicyTimer has the engine
+    // ask again; the requests it came with, if any, wait in
+    // PolicyHeldQueue until it goes out or is overtaken.
+    //
+    TOUCH_POWER_POLICY Policy;
+    WDFQUEUE PolicyHeldQueue;
+    WDFTIMER PolicyTimer;
+    volatile LONG PolicyTimerExpired;
+    BOOLEAN PolicyHeld;
+    TOUCH_POWER_PSTATE_VECTOR PolicyHeldTarget;
+    ULONG PolicyHeldCause;
+
+    //
+    // Batch currently owning the transition engine, the entry it is at
+    // and the interrupt times its delays and deadlines count from.
+    // BatchCancelled is set by the cancel routine of the active batch.
+    //
+    WDFQUEUE TransitionBatchQueue;
+    WDFTIMER TransitionBatchTimer;
+    volatile LONG BatchTimerArmed;
+    volatile LONG BatchCancelled;
+    WDFREQUEST ActiveBatch;
+    ULONG BatchIndex;
+    ULONGLONG BatchStart;
+    ULONGLONG BatchLastEnd;
+
+    //
+    // Transition engine counters
+    //
+    volatile LONG TransitionsRequested;
+    volatile LONG TransitionsIssued;
+    volatile LONG TransitionsElided;
+    volatile LONG TransitionsCoalesced;
+    volatile LONG TransitionsPreempted;
+    volatile LONG TransitionsInternalReplaced;
+
+    //
+    // State change notifications, see notify.c. NotifySequence is odd
+    // while the record of the last change is being written.
+    //
+    WDFQUEUE NotifyQueue;
+    volatile LONG NotifySequence;
+    LONG NotifyState;
+    LONG NotifyCause;
+    ULONGLONG NotifyTimestamp;
+
+    //
+    // Transition statistics, see stats.c. A FailureStatus of 0 marks a
+    // free entry.
+    //
+    LONGLONG PerformanceFrequency;
+    TOUCH_POWER_LATENCY_COUNTERS Latency[TouchPowerDirectionCount];
+    TOUCH_POWER_LATENCY_COUNTERS QueueWait[TouchPowerQueueClassCount];
+    volatile LONG FailureStatus[TOUCH_POWER_MAX_FAILURE_STATUSES];
+    volatile LONG FailureCounts[TOUCH_POWER_MAX_FAILURE_STATUSES];
+    volatile LONG OtherFailures;
+    volatile LONG Wait1Results;
+    volatile LONG Wait3Results;
+
+    //
+    // Residency per P-state and F-state since the driver started, and
+    // the totals as of the last snapshot taken with a reset. Queries
+    // are serialized by ResidencyLock.
+    //
+    TOUCH_POWER_RESIDENCY_COUNTERS Residency[TouchPowerResidencyDomainCount];
+    TOUCH_POWER_RESIDENCY_COUNTERS ResidencyBaseline[TouchPowerResidencyDomainCount];
+    WDFWAITLOCK ResidencyLock;
+
+    //
+    // Flight recorder, see recorder.c
+    //
+    struct _TOUCH_POWER_RECORD *Recorder;
+    volatile LONG RecorderNext;
+    KBUGCHECK_REASON_CALLBACK_RECORD RecorderBugCheckRecord;
+    BOOLEAN RecorderBugCheckRegistered;
+
+    //
+    // Component idle handling, see idle.c. IdlePoweredDown is set while
+    // the digitizer is off because the idle timeout powered it down.
+    // FStateCompletePending is set while an F-state change waits for
+    // its transition before it is completed to PoFx.
+    //
+    WDFTIMER IdleTimer;
+    volatile LONG ActiveReferences;
+    volatile LONG IdlePowerDowns;
+    volatile LONG IdlePoweredDown;
+    volatile LONG FState;
+    volatile LONG FStateRestoreState;
+    volatile LONG FStateCompletePending;
+
+    //
+    // Client votes, see vote.c. Number of handles voting to keep the
+    // digitizer on and to allow it off at each priority, and the
+    // outcome the transition engine last carried out. VoteChanged is
+    // set by each vote cast and cleared when the engine collects them.
+    //
+    volatile LONG VoteNeedOn[TOUCH_POWER_VOTE_PRIORITIES];
+    volatile LONG VoteAllowOff[TOUCH_POWER_VOTE_PRIORITIES];
+    LONG VoteOutcome;
+    volatile LONG VoteChanged;
+    volatile LONG VotesCast;
+    volatile LONG VoteOutcomeChanges;
+
+    //
+    // Scheduled transition, see schedule.c. ScheduleTimer is created
+    // for each schedule so that it carries the tolerance asked for,
+    // ScheduleLock serializes replacing it. ScheduledState is the state
+    // the pending schedule moves to, TOUCH_POWER_NO_TARGET if none.
+    //
+    WDFWAITLOCK ScheduleLock;
+    WDFTIMER ScheduleTimer;
+    volatile LONG ScheduledState;
+
+    //
+    // Display gate fed by the power setting notifications, see
+    // setting.c. DisplayLock serializes the notifications and
+    // DisplayTimer, which carries out the delayed power-off.
+    //
+    TOUCH_POWER_DISPLAY Display;
+    WDFSPINLOCK DisplayLock;
+    WDFTIMER DisplayTimer;
+    PVOID DisplayConsoleHandle;
+    PVOID DisplayMonitorHandle;
+
     // 
     // Power related
     //
     POHANDLE PepHandle;
-    DWORD    State;
+
+    //
+    // Power state machine, see core.c, and the PoFx buffers and
+    // watchdog of each of its transition slots
+    //
+    TOUCH_POWER_CORE Core;
+    TOUCH_POWER_PEP_SLOT PepSlots[TOUCH_POWER_MAX_TRANSITIONS];
 } TOUCH_POWER, *PTOUCH_POWER;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(TOUCH_POWER, GetDeviceContext)
+
+//
+// Request context, filled in when a request is handed to the
+// transition engine
+//
+
+typedef struct _TOUCH_POWER_REQUEST
+{
+    TOUCH_POWER_PSTATE_VECTOR Target;
+    struct _TOUCH_POWER_BATCH *Batch;
+    LONG Sequence;
+    ULONGLONG QueuedTime;
+} TOUCH_POWER_REQUEST, *PTOUCH_POWER_REQUEST;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(TOUCH_POWER_REQUEST, GetRequestContext)
+
+//
+// File object context, the vote of the handle with its priority
+// packed in so that it can be swapped in one go, see vote.c. Session
+// is set for handles opened from user mode, which keep the digitizer
+// component active.
+//
+
+typedef struct _TOUCH_POWER_FILE
+{
+    volatile LONG Vote;
+    BOOLEAN Session;
+} TOUCH_POWER_FILE, *PTOUCH_POWER_FILE;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(TOUCH_POWER_FILE, GetFileContext)
+
+//
+// State of a driver holding the direct interface, see direct.c. Each
+// one holds a vote of its own, just like a handle.
+//
+
+typedef struct _TOUCH_POWER_DIRECT_CLIENT
+{
+    PTOUCH_POWER Device;
+    volatile LONG References;
+    TOUCH_POWER_FILE Voter;
+} TOUCH_POWER_DIRECT_CLIENT, *PTOUCH_POWER_DIRECT_CLIENT;
+
+//
+// Watchdog timer context, each transition slot of the core owns one
+// timer
+//
+
+typedef struct _TOUCH_POWER_WATCHDOG
+{
+    PTOUCH_POWER_TRANSITION_SLOT Slot;
+} TOUCH_POWER_WATCHDOG, *PTOUCH_POWER_WATCHDOG;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(TOUCH_POWER_WATCHDOG, GetWatchdogContext)
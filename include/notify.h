@@ -0,0 +1,40 @@
+/*++
+    Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+    Module Name:
+
+        notify.h
+
+    Abstract:
+
+        Declarations for digitizer state change notifications
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#pragma once
+
+NTSTATUS
+TchNotifyInitialize(
+    IN WDFDEVICE Device,
+    IN WDFDEVICE ChildDevice
+);
+
+NTSTATUS
+TchNotifySubmit(
+    IN PTOUCH_POWER Context,
+    IN WDFREQUEST Request,
+    IN PULONG KnownSequence
+);
+
+VOID
+TchNotifyStateChange(
+    IN PTOUCH_POWER Context,
+    IN DWORD State,
+    IN ULONG Cause
+);
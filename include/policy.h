@@ -0,0 +1,105 @@
+// Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+#pragma once
+
+#include <core.h>
+
+//
+// Power policy stage, see policy.c. The stage sits between the
+// requests for the digitizer power gate and the transitions carried
+// out for them, and decides when a transition may go out. Power-on
+// always may go out at once; a power-off may be held back until the
+// stage allows it.
+//
+
+typedef struct _TOUCH_POWER_POLICY TOUCH_POWER_POLICY, *PTOUCH_POWER_POLICY;
+
+//
+// Returns 0 if a transition to On may go out now, otherwise the
+// interrupt time (100ns units) to ask again at
+//
+typedef ULONGLONG
+TOUCH_POWER_POLICY_ADMIT(
+    IN PTOUCH_POWER_POLICY Policy,
+    IN BOOLEAN On
+);
+
+//
+// The digitizer was powered on or off
+//
+typedef VOID
+TOUCH_POWER_POLICY_COMMITTED(
+    IN PTOUCH_POWER_POLICY Policy,
+    IN BOOLEAN On
+);
+
+typedef struct _TOUCH_POWER_POLICY_STAGE
+{
+    TOUCH_POWER_POLICY_ADMIT* Admit;
+    TOUCH_POWER_POLICY_COMMITTED* Committed;
+} TOUCH_POWER_POLICY_STAGE, *PTOUCH_POWER_POLICY_STAGE;
+
+//
+// Hysteresis settings, in milliseconds, 0 disables. A power-off waits
+// for OffDelayMs from when it was first asked for, and until the
+// digitizer has been on for MinOnMs. A power-on coming in less than
+// MinOffMs after a power-off is carried out all the same, but counts
+// as thrash.
+//
+typedef struct _TOUCH_POWER_POLICY_CONFIG
+{
+    ULONG MinOnMs;
+    ULONG MinOffMs;
+    ULONG OffDelayMs;
+} TOUCH_POWER_POLICY_CONFIG, *PTOUCH_POWER_POLICY_CONFIG;
+
+struct _TOUCH_POWER_POLICY
+{
+    const TOUCH_POWER_POLICY_STAGE* Stage;
+    TOUCH_POWER_POLICY_CONFIG Config;
+
+    //
+    // Last state the digitizer was powered to, TOUCH_POWER_NO_TARGET
+    // before the first transition, and the interrupt times it was last
+    // powered on and off at. OffWantedSince is the interrupt time the
+    // power-off being held back, if OffWanted, was first asked for.
+    //
+    LONG State;
+    ULONGLONG OnSince;
+    ULONGLONG OffSince;
+    BOOLEAN OffWanted;
+    ULONGLONG OffWantedSince;
+
+    //
+    // Power-offs held back, power-offs dropped because a power-on came
+    // in while they were held back, and transitions that undid the one
+    // before within MinOnMs or MinOffMs
+    //
+    volatile LONG OffsHeld;
+    volatile LONG OffsSuppressed;
+    volatile LONG Thrashes;
+};
+
+//
+// The hysteresis stage described by TOUCH_POWER_POLICY_CONFIG
+//
+extern const TOUCH_POWER_POLICY_STAGE TchPolicyHysteresis;
+
+VOID
+TchPolicyInitialize(
+    OUT PTOUCH_POWER_POLICY Policy,
+    IN const TOUCH_POWER_POLICY_STAGE* Stage,
+    IN const TOUCH_POWER_POLICY_CONFIG* Config
+);
+
+ULONGLONG
+TchPolicyAdmit(
+    IN PTOUCH_POWER_POLICY Policy,
+    IN BOOLEAN On
+);
+
+VOID
+TchPolicyCommitted(
+    IN PTOUCH_POWER_POLICY Policy,
+    IN BOOLEAN On
+);
@@ -30,12 +30,374 @@ DEFINE_GUID(GUID_TOUCH_POWER_INTERFACE,
    0x9AE45E76, 0x6EF0, 0x4ED7, 0x85, 0xA2, 0x97, 0x71, 0x2A, 0x20, 0x78, 0x6A);
 // {9AE45E76-6EF0-4ED7-85A2-97712A20786A}
 
+//
+// Tags the flight recorder ring in crash dump secondary data, an array
+// of TOUCH_POWER_RECORDER_ENTRIES TOUCH_POWER_RECORD
+//
+DEFINE_GUID(GUID_TOUCH_POWER_RECORDER,
+   0x6CAFFB9F, 0x89D1, 0x4833, 0xAE, 0x66, 0x52, 0xC9, 0xA5, 0xFE, 0xC5, 0xAC);
+// {6CAFFB9F-89D1-4833-AE66-52C9A5FEC5AC}
+
 #define TOUCH_TEST_BUFFER_CTL_CODE(id)  \
     CTL_CODE(0x8323, (id), METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 #define IOCTL_TOUCH_POWER_RESET           TOUCH_TEST_BUFFER_CTL_CODE(0x801)
 #define IOCTL_TOUCH_POWER_TOGGLE          TOUCH_TEST_BUFFER_CTL_CODE(0x802)
 #define IOCTL_TOUCH_POWER_STATE           TOUCH_TEST_BUFFER_CTL_CODE(0x803)
+#define IOCTL_TOUCH_POWER_COUNTERS        TOUCH_TEST_BUFFER_CTL_CODE(0x804)
+#define IOCTL_TOUCH_POWER_SET_PSTATES     TOUCH_TEST_BUFFER_CTL_CODE(0x805)
+#define IOCTL_TOUCH_POWER_GET_PSTATES     TOUCH_TEST_BUFFER_CTL_CODE(0x806)
+#define IOCTL_TOUCH_POWER_BATCH           TOUCH_TEST_BUFFER_CTL_CODE(0x807)
+#define IOCTL_TOUCH_POWER_NOTIFY          TOUCH_TEST_BUFFER_CTL_CODE(0x808)
+#define IOCTL_TOUCH_POWER_STATS           TOUCH_TEST_BUFFER_CTL_CODE(0x809)
+#define IOCTL_TOUCH_POWER_RESIDENCY       TOUCH_TEST_BUFFER_CTL_CODE(0x80A)
+#define IOCTL_TOUCH_POWER_RECORDER        TOUCH_TEST_BUFFER_CTL_CODE(0x80B)
+#define IOCTL_TOUCH_POWER_VOTE            TOUCH_TEST_BUFFER_CTL_CODE(0x80C)
+#define IOCTL_TOUCH_POWER_SCHEDULE        TOUCH_TEST_BUFFER_CTL_CODE(0x80D)
+
+//
+// Output of IOCTL_TOUCH_POWER_STATE, a DWORD: 1 if the digitizer is on,
+// 0 if it is off and TOUCH_POWER_PSTATE_UNKNOWN until the driver first
+// moved it, or after the PEP failed to confirm a transition in time.
+//
+
+//
+// Input of IOCTL_TOUCH_POWER_SET_PSTATES and output of
+// IOCTL_TOUCH_POWER_GET_PSTATES. All entries are sent to the PEP in a
+// single request, each set may appear at most once. The output has one
+// entry per set, TOUCH_POWER_PSTATE_UNKNOWN for sets that were never
+// changed through this driver. TOUCH_POWER_PSTATE_ENTRY is shared with
+// the power core, see core.h.
+//
+#define TOUCH_POWER_PSTATE_UNKNOWN        ((ULONG)-1)
+
+typedef struct _TOUCH_POWER_PSTATES
+{
+    ULONG Count;
+    TOUCH_POWER_PSTATE_ENTRY Entries[TOUCH_POWER_MAX_PSTATE_SETS];
+} TOUCH_POWER_PSTATES, *PTOUCH_POWER_PSTATES;
+
+//
+// Input and output of IOCTL_TOUCH_POWER_BATCH, the same buffer has to
+// be passed for both. Entries are carried out in order by the driver,
+// each one moving a single P-state set. An entry starts once TimeUs has
+// passed since the end of the previous entry (TOUCH_POWER_BATCH_DELAY,
+// the default) or since the batch started (TOUCH_POWER_BATCH_DEADLINE).
+// TimeUs is at most TOUCH_POWER_MAX_BATCH_TIME_US. A failing entry does
+// not stop the batch, Status, StartTime and EndTime are filled in for
+// every entry; entries a cancelled batch never got to are failed with
+// STATUS_CANCELLED. Times are interrupt times in 100ns units.
+//
+#define TOUCH_POWER_MAX_BATCH_ENTRIES     256
+#define TOUCH_POWER_MAX_BATCH_TIME_US     10000000
+
+#define TOUCH_POWER_BATCH_DELAY           0x00000000
+#define TOUCH_POWER_BATCH_DEADLINE        0x00000001
+
+typedef struct _TOUCH_POWER_BATCH_ENTRY
+{
+    ULONG SetIndex;
+    ULONG PStateIndex;
+    ULONG Flags;
+    ULONG TimeUs;
+
+    NTSTATUS Status;
+    ULONG Reserved;
+    ULONGLONG StartTime;
+    ULONGLONG EndTime;
+} TOUCH_POWER_BATCH_ENTRY, *PTOUCH_POWER_BATCH_ENTRY;
+
+typedef struct _TOUCH_POWER_BATCH
+{
+    ULONG Count;
+    ULONG Reserved;
+    TOUCH_POWER_BATCH_ENTRY Entries[ANYSIZE_ARRAY];
+} TOUCH_POWER_BATCH, *PTOUCH_POWER_BATCH;
+
+//
+// Input of IOCTL_TOUCH_POWER_VOTE. Every handle holds one vote; casting
+// another replaces it, TouchPowerVoteNone withdraws it and closing the
+// handle does too. The highest Priority any vote is held at decides:
+// the digitizer is kept on if a vote at that priority needs it on and
+// allowed off otherwise. The digitizer is only moved when that outcome
+// changes, and left as it is once the last vote is withdrawn. The
+// request completes once the vote is counted, not once the digitizer
+// got there; IOCTL_TOUCH_POWER_NOTIFY reports that. Priority is below
+// TOUCH_POWER_VOTE_PRIORITIES, see core.h.
+//
+typedef enum _TOUCH_POWER_VOTE_TYPE
+{
+    TouchPowerVoteNone = 0,
+    TouchPowerVoteAllowOff,
+    TouchPowerVoteNeedOn,
+    TouchPowerVoteTypeCount
+} TOUCH_POWER_VOTE_TYPE;
+
+typedef struct _TOUCH_POWER_VOTE
+{
+    ULONG Vote;
+    ULONG Priority;
+} TOUCH_POWER_VOTE, *PTOUCH_POWER_VOTE;
+
+//
+// Input of IOCTL_TOUCH_POWER_SCHEDULE, which has the driver move the
+// digitizer to State (1 for on, 0 for off) later on, so that the caller
+// does not have to be awake at that point. The transition is due DelayMs
+// from now (TOUCH_POWER_SCHEDULE_DELAY, the default) or at Deadline, an
+// interrupt time in 100ns units (TOUCH_POWER_SCHEDULE_DEADLINE); a
+// deadline that already passed is carried out right away. It may be
+// held back by up to ToleranceMs so that the timer can expire together
+// with other wakeups. The device has a single scheduled transition: a
+// new one replaces it, whichever handle it came from, and
+// TOUCH_POWER_SCHEDULE_CANCEL cancels it. The optional output is 1 if a
+// scheduled transition was still pending and got replaced or cancelled,
+// 0 otherwise.
+//
+#define TOUCH_POWER_SCHEDULE_DELAY        0x00000000
+#define TOUCH_POWER_SCHEDULE_DEADLINE     0x00000001
+#define TOUCH_POWER_SCHEDULE_CANCEL       0x00000002
+
+typedef struct _TOUCH_POWER_SCHEDULE
+{
+    ULONG Flags;
+    ULONG State;
+    ULONG DelayMs;
+    ULONG ToleranceMs;
+    ULONGLONG Deadline;
+} TOUCH_POWER_SCHEDULE, *PTOUCH_POWER_SCHEDULE;
+
+//
+// What made the digitizer power state change
+//
+typedef enum _TOUCH_POWER_CAUSE
+{
+    TouchPowerCauseNone = 0,
+    TouchPowerCauseRequest,
+    TouchPowerCauseBatch,
+    TouchPowerCauseIdleTimeout,
+    TouchPowerCauseComponentIdle,
+    TouchPowerCauseComponentActive,
+    TouchPowerCauseVote,
+    TouchPowerCauseSchedule,
+    TouchPowerCauseDisplay,
+} TOUCH_POWER_CAUSE;
+
+//
+// Output of IOCTL_TOUCH_POWER_NOTIFY, which stays pending until the
+// digitizer power state changes. The optional input is the Sequence of
+// the last notification the caller saw; if the state changed since,
+// the request completes right away with the latest change. Timestamp
+// is an interrupt time in 100ns units.
+//
+typedef struct _TOUCH_POWER_NOTIFICATION
+{
+    ULONG State;
+    ULONG Cause;
+    ULONG Sequence;
+    ULONG Reserved;
+    ULONGLONG Timestamp;
+} TOUCH_POWER_NOTIFICATION, *PTOUCH_POWER_NOTIFICATION;
+
+//
+// Output of IOCTL_TOUCH_POWER_STATS, indexed by TOUCH_POWER_DIRECTION.
+// Latencies run from the PoFxPowerControl call until the PEP confirmed
+// the transition and only cover transitions that succeeded. Bucket 0
+// counts latencies under 1us, bucket n latencies in [2^(n-1), 2^n) us,
+// the last bucket everything above. Failed transitions are counted by
+// status in Failures, unused entries have Status 0; statuses that did
+// not fit are counted in OtherFailures.
+//
+typedef struct _TOUCH_POWER_LATENCY
+{
+    ULONG Count;
+    ULONG MinUs;
+    ULONG MaxUs;
+    ULONG MeanUs;
+    ULONGLONG TotalUs;
+    ULONG Buckets[TOUCH_POWER_LATENCY_BUCKETS];
+} TOUCH_POWER_LATENCY, *PTOUCH_POWER_LATENCY;
+
+typedef struct _TOUCH_POWER_FAILURE
+{
+    NTSTATUS Status;
+    ULONG Count;
+} TOUCH_POWER_FAILURE, *PTOUCH_POWER_FAILURE;
+
+typedef struct _TOUCH_POWER_STATS
+{
+    ULONG Size;
+    ULONG Wait1Results;
+    ULONG Wait3Results;
+    ULONG OtherFailures;
+    TOUCH_POWER_LATENCY Latency[TouchPowerDirectionCount];
+    TOUCH_POWER_FAILURE Failures[TOUCH_POWER_MAX_FAILURE_STATUSES];
+
+    //
+    // Time requests spent queued before the transition engine picked
+    // them up, indexed by TOUCH_POWER_QUEUE_CLASS. Requests the engine
+    // cancelled are not counted.
+    //
+    TOUCH_POWER_LATENCY QueueWait[TouchPowerQueueClassCount];
+} TOUCH_POWER_STATS, *PTOUCH_POWER_STATS;
+
+//
+// Output of IOCTL_TOUCH_POWER_RESIDENCY. PStates are indexed by the
+// P-state of set 0 and FStates by TOUCH_POWER_FSTATE; Time is how long
+// the digitizer spent in the state, in 100ns units, Entries how often
+// it entered it. Totals count since the driver started, the Snapshot
+// fields since the last request that passed TOUCH_POWER_RESIDENCY_RESET
+// as its optional ULONG input. Such a request starts a new snapshot
+// period at SnapshotTime. Times are interrupt times.
+//
+#define TOUCH_POWER_RESIDENCY_RESET       0x00000001
+
+typedef struct _TOUCH_POWER_RESIDENCY_ENTRY
+{
+    ULONGLONG Time;
+    ULONG Entries;
+    ULONG Reserved;
+} TOUCH_POWER_RESIDENCY_ENTRY, *PTOUCH_POWER_RESIDENCY_ENTRY;
+
+typedef struct _TOUCH_POWER_RESIDENCY
+{
+    ULONG Size;
+    ULONG CurrentPState;
+    ULONG CurrentFState;
+    ULONG Reserved;
+    ULONGLONG Now;
+    ULONGLONG SnapshotTime;
+    TOUCH_POWER_RESIDENCY_ENTRY PStates[TOUCH_POWER_RESIDENCY_STATES];
+    TOUCH_POWER_RESIDENCY_ENTRY FStates[TOUCH_POWER_RESIDENCY_STATES];
+    TOUCH_POWER_RESIDENCY_ENTRY SnapshotPStates[TOUCH_POWER_RESIDENCY_STATES];
+    TOUCH_POWER_RESIDENCY_ENTRY SnapshotFStates[TOUCH_POWER_RESIDENCY_STATES];
+} TOUCH_POWER_RESIDENCY, *PTOUCH_POWER_RESIDENCY;
+
+//
+// Flight recorder record, one per settled transition. Sequence numbers
+// records from 1 and is 0 for a record never or only partly written.
+// Timestamp is the interrupt time the transition settled at, CallerPid
+// the process whose request caused it (0 for the driver itself), Cause
+// a TOUCH_POWER_CAUSE and SetMask the P-state sets it targeted. Status
+// is the outcome of the transition, PepStatus the last result the PEP
+// reported for it (STATUS_WAIT_1 or STATUS_WAIT_3 if it never
+// confirmed, STATUS_PENDING if it was never reached). P-states are
+// those of set 0, TOUCH_POWER_RECORD_NO_PSTATE if not targeted or
+// unknown.
+//
+#define TOUCH_POWER_RECORDER_ENTRIES      4096
+#define TOUCH_POWER_RECORD_NO_PSTATE      0xFF
+
+typedef struct _TOUCH_POWER_RECORD
+{
+    ULONGLONG Timestamp;
+    ULONG Sequence;
+    ULONG CallerPid;
+    NTSTATUS Status;
+    ULONG LatencyUs;
+    UCHAR RequestedPState;
+    UCHAR ResultPState;
+    UCHAR Cause;
+    UCHAR SetMask;
+    NTSTATUS PepStatus;
+} TOUCH_POWER_RECORD, *PTOUCH_POWER_RECORD;
+
+C_ASSERT(sizeof(TOUCH_POWER_RECORD) == 32);
+
+//
+// Output of IOCTL_TOUCH_POWER_RECORDER, the most recent records that
+// fit into the buffer, oldest first. Recorded is the number of records
+// written since the driver started.
+//
+typedef struct _TOUCH_POWER_RECORDER_DUMP
+{
+    ULONG Size;
+    ULONG Count;
+    ULONG Capacity;
+    ULONG Recorded;
+    TOUCH_POWER_RECORD Records[ANYSIZE_ARRAY];
+} TOUCH_POWER_RECORDER_DUMP, *PTOUCH_POWER_RECORDER_DUMP;
+
+//
+// Output of IOCTL_TOUCH_POWER_COUNTERS. Size is set to the number of
+// bytes the driver filled in, new counters are only ever appended.
+//
+typedef struct _TOUCH_POWER_COUNTERS
+{
+    ULONG Size;
+
+    //
+    // Number of transitions rejected because every preallocated
+    // transition buffer was in use
+    //
+    ULONG TransitionSlotExhausted;
+
+    //
+    // Toggle requests received, and how many of them actually reached
+    // the PEP. The difference is split between requests for the state
+    // the digitizer was already in and requests collapsed into a later
+    // one of the same burst.
+    //
+    ULONG TransitionsRequested;
+    ULONG TransitionsIssued;
+    ULONG TransitionsElided;
+    ULONG TransitionsCoalesced;
+
+    //
+    // Times the digitizer was powered down after the idle timeout
+    //
+    ULONG IdlePowerDowns;
+
+    //
+    // Votes cast, and how often the outcome of all votes changed and
+    // was carried out
+    //
+    ULONG VotesCast;
+    ULONG VoteOutcomeChanges;
+
+    //
+    // Power-offs the policy stage held back, power-offs it dropped
+    // because a power-on came in while they were held back, and
+    // transitions that undid the previous one within the configured
+    // minimum on-time or off-time
+    //
+    ULONG PowerOffsHeld;
+    ULONG PowerOffsSuppressed;
+    ULONG ThrashEvents;
+
+    //
+    // Power-off requests cancelled because a power-on came in after
+    // them, they complete with STATUS_CANCELLED
+    //
+    ULONG PowerOffsPreempted;
+
+    //
+    // Times the display went off, times the digitizer was powered off
+    // because of it, and power-offs dropped because the display came
+    // back within DisplayOffDelayMs
+    //
+    ULONG DisplayOffs;
+    ULONG DisplayPowerOffs;
+    ULONG DisplayOffsCancelled;
+
+    //
+    // PEP confirmations that arrived after their transition was settled,
+    // usually failed by the watchdog, and were dropped
+    //
+    ULONG LateConfirmations;
+
+    //
+    // Transitions the driver asked for on its own (idle, F-state,
+    // display, schedule) that a later one of them replaced before the
+    // engine got to them
+    //
+    ULONG InternalTargetsReplaced;
+} TOUCH_POWER_COUNTERS, *PTOUCH_POWER_COUNTERS;
+
+//
+// Everything below is the driver's own, the definitions above are shared
+// with user mode
+//
+#ifdef _KERNEL_MODE
 
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL TchPowerOnDeviceControl;
 
@@ -43,12 +405,36 @@ EVT_WDF_DEVICE_FILE_CREATE TchPowerOnCreate;
 
 EVT_WDF_FILE_CLOSE TchPowerOnClose;
 
+EVT_WDF_TIMER TchPowerOnWatchdog;
+
+PO_FX_POWER_CONTROL_CALLBACK TchPowerControlCallback;
+
 NTSTATUS
 TchPowerInitialize(
     IN WDFDEVICE Device
 );
 
+NTSTATUS
+TchPowerSetPStates(
+    IN PTOUCH_POWER Context,
+    IN PTOUCH_POWER_PSTATE_VECTOR Target,
+    IN WDFREQUEST Request,
+    IN ULONG Cause
+);
+
+DWORD
+TchPowerGetState(
+    IN PTOUCH_POWER Context
+);
+
 NTSTATUS
 TchPowerSelfManagedIoStart(
     IN PTOUCH_POWER Context
-);
\ No newline at end of file
+);
+
+VOID
+TchPowerSelfManagedIoCleanup(
+    IN PTOUCH_POWER Context
+);
+
+#endif
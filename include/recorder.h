@@ -0,0 +1,43 @@
+/*++
+    Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+    Module Name:
+
+        recorder.h
+
+    Abstract:
+
+        Declarations for the transition flight recorder
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#pragma once
+
+KBUGCHECK_REASON_CALLBACK_ROUTINE TchRecorderOnBugCheck;
+
+EVT_WDF_OBJECT_CONTEXT_CLEANUP TchRecorderOnCleanup;
+
+NTSTATUS
+TchRecorderInitialize(
+    IN WDFDEVICE Device
+);
+
+VOID
+TchRecorderLog(
+    IN PTOUCH_POWER Context,
+    IN PTOUCH_POWER_TRANSITION_SLOT Slot,
+    IN NTSTATUS Status
+);
+
+ULONG
+TchRecorderDump(
+    IN PTOUCH_POWER Context,
+    OUT PTOUCH_POWER_RECORDER_DUMP Dump,
+    IN size_t Length
+);
@@ -0,0 +1,26 @@
+/*++
+    Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+    Module Name:
+
+        registry.h
+
+    Abstract:
+
+        Declarations for reading driver tunables from the registry
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#pragma once
+
+NTSTATUS
+TchPowerReadConfiguration(
+    IN WDFDEVICE Device,
+    OUT PTOUCH_POWER_CONFIG Config
+);
@@ -0,0 +1,34 @@
+/*++
+    Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+    Module Name:
+
+        schedule.h
+
+    Abstract:
+
+        Declarations for transitions scheduled ahead of time
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#pragma once
+
+EVT_WDF_TIMER TchScheduleOnTimer;
+
+NTSTATUS
+TchScheduleInitialize(
+    IN WDFDEVICE Device
+);
+
+NTSTATUS
+TchScheduleSet(
+    IN PTOUCH_POWER Context,
+    IN PTOUCH_POWER_SCHEDULE Schedule,
+    OUT PBOOLEAN Replaced
+);
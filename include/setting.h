@@ -0,0 +1,40 @@
+/*++
+    Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+    Module Name:
+
+        setting.h
+
+    Abstract:
+
+        Declarations for powering the digitizer off after the display,
+        driven by power setting notifications
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#pragma once
+
+POWER_SETTING_CALLBACK TchSettingOnChange;
+
+EVT_WDF_TIMER TchSettingOnTimer;
+
+NTSTATUS
+TchSettingInitialize(
+    IN WDFDEVICE Device
+);
+
+VOID
+TchSettingRegister(
+    IN PTOUCH_POWER Context
+);
+
+VOID
+TchSettingUnregister(
+    IN PTOUCH_POWER Context
+);
@@ -0,0 +1,71 @@
+/*++
+    Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+    Module Name:
+
+        stats.h
+
+    Abstract:
+
+        Declarations for P-state transition statistics
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#pragma once
+
+NTSTATUS
+TchStatsInitialize(
+    IN WDFDEVICE Device
+);
+
+ULONG
+TchStatsTransitionLatencyUs(
+    IN PTOUCH_POWER Context,
+    IN PTOUCH_POWER_TRANSITION_SLOT Slot
+);
+
+VOID
+TchStatsRecordTransition(
+    IN PTOUCH_POWER Context,
+    IN PTOUCH_POWER_TRANSITION_SLOT Slot,
+    IN NTSTATUS Status
+);
+
+VOID
+TchStatsRecordQueueWait(
+    IN PTOUCH_POWER Context,
+    IN TOUCH_POWER_QUEUE_CLASS Class,
+    IN PTOUCH_POWER_REQUEST RequestContext
+);
+
+VOID
+TchStatsRecordWait(
+    IN PTOUCH_POWER Context,
+    IN NTSTATUS PepStatus
+);
+
+VOID
+TchStatsEnterState(
+    IN PTOUCH_POWER Context,
+    IN TOUCH_POWER_RESIDENCY_DOMAIN Domain,
+    IN ULONG State
+);
+
+NTSTATUS
+TchStatsQueryResidency(
+    IN PTOUCH_POWER Context,
+    IN BOOLEAN Reset,
+    OUT PTOUCH_POWER_RESIDENCY Residency
+);
+
+VOID
+TchStatsQuery(
+    IN PTOUCH_POWER Context,
+    OUT PTOUCH_POWER_STATS Stats
+);
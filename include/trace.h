@@ -27,18 +27,35 @@
 		WPP_DEFINE_BIT(TRACE_DRIVER)		\
         )
 
+//
+// Least severe trace level compiled in. Traces above it are removed at
+// compile time, including from the in-flight recorder. Release builds
+// drop TRACE_LEVEL_VERBOSE unless the build overrides it.
+//
+#ifndef TOUCH_TRACE_MIN_LEVEL
+#if DBG
+#define TOUCH_TRACE_MIN_LEVEL               TRACE_LEVEL_VERBOSE
+#else
+#define TOUCH_TRACE_MIN_LEVEL               TRACE_LEVEL_INFORMATION
+#endif
+#endif
+
+#define TOUCH_TRACE_COMPILED(lvl)           ((lvl) <= TOUCH_TRACE_MIN_LEVEL)
+
 #define WPP_FLAG_LEVEL_LOGGER(flag, level)                                  \
     WPP_LEVEL_LOGGER(flag)
 
 #define WPP_FLAG_LEVEL_ENABLED(flag, level)                                 \
-    (WPP_LEVEL_ENABLED(flag) &&                                             \
+    (TOUCH_TRACE_COMPILED(level) &&                                         \
+     WPP_LEVEL_ENABLED(flag) &&                                             \
      WPP_CONTROL(WPP_BIT_ ## flag).Level >= level)
 
 #define WPP_LEVEL_FLAGS_LOGGER(lvl,flags) \
            WPP_LEVEL_LOGGER(flags)
 
 #define WPP_LEVEL_FLAGS_ENABLED(lvl, flags) \
-           (WPP_LEVEL_ENABLED(flags) && WPP_CONTROL(WPP_BIT_ ## flags).Level >= lvl)
+           (TOUCH_TRACE_COMPILED(lvl) && \
+            WPP_LEVEL_ENABLED(flags) && WPP_CONTROL(WPP_BIT_ ## flags).Level >= lvl)
 
 //           
 // WPP orders static parameters before dynamic parameters. To support the Trace function
@@ -46,7 +63,54 @@
 // reorder the arguments to what the .tpl configuration file expects.
 //
 #define WPP_RECORDER_FLAGS_LEVEL_ARGS(flags, lvl) WPP_RECORDER_LEVEL_FLAGS_ARGS(lvl, flags)
-#define WPP_RECORDER_FLAGS_LEVEL_FILTER(flags, lvl) WPP_RECORDER_LEVEL_FLAGS_FILTER(lvl, flags)
+#define WPP_RECORDER_FLAGS_LEVEL_FILTER(flags, lvl) \
+           (TOUCH_TRACE_COMPILED(lvl) && WPP_RECORDER_LEVEL_FLAGS_FILTER(lvl, flags))
+
+//
+// Rate limiting for traces on hot paths. Each call site keeps its own
+// TOUCH_TRACE_LIMIT and lets through at most TOUCH_TRACE_BURST traces
+// per second:
+//
+//     static TOUCH_TRACE_LIMIT limit;
+//
+//     if (TraceAllowed(TRACE_LEVEL_INFORMATION, TRACE_POWER, &limit))
+//     {
+//         Trace(TRACE_LEVEL_INFORMATION, TRACE_POWER, ...);
+//     }
+//
+// The limit is only consulted when the trace is enabled at all.
+//
+#define TOUCH_TRACE_BURST                   10
+#define TOUCH_TRACE_WINDOW                  (10 * 1000 * 1000)
+
+typedef struct _TOUCH_TRACE_LIMIT
+{
+    volatile LONG64 WindowEnd;
+    volatile LONG Count;
+} TOUCH_TRACE_LIMIT, *PTOUCH_TRACE_LIMIT;
+
+FORCEINLINE
+BOOLEAN
+TchTraceRateLimit(
+    IN PTOUCH_TRACE_LIMIT Limit
+)
+{
+    LONG64 now = (LONG64)KeQueryInterruptTime();
+    LONG64 windowEnd = ReadNoFence64(&Limit->WindowEnd);
+
+    if (now >= windowEnd &&
+        InterlockedCompareExchange64(&Limit->WindowEnd, now + TOUCH_TRACE_WINDOW, windowEnd) == windowEnd)
+    {
+        InterlockedExchange(&Limit->Count, 0);
+    }
+
+    return InterlockedIncrement(&Limit->Count) <= TOUCH_TRACE_BURST;
+}
+
+#define TraceAllowed(lvl, flags, limit)                                     \
+    ((WPP_LEVEL_FLAGS_ENABLED(lvl, flags) ||                                \
+      WPP_RECORDER_FLAGS_LEVEL_FILTER(flags, lvl)) &&                       \
+     TchTraceRateLimit(limit))
 
 //
 // This comment block is scanned by the trace preprocessor to define our
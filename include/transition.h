@@ -0,0 +1,70 @@
+/*++
+    Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+    Module Name:
+
+        transition.h
+
+    Abstract:
+
+        Declarations for the P-state transition engine, which carries out
+        toggle requests outside of the caller's dispatch thread
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#pragma once
+
+EVT_WDF_WORKITEM TchTransitionWorkItem;
+
+EVT_WDF_TIMER TchTransitionOnWindowExpired;
+
+EVT_WDF_TIMER TchTransitionOnBatchTimer;
+
+EVT_WDF_REQUEST_CANCEL TchTransitionOnBatchCancel;
+
+EVT_WDF_TIMER TchTransitionOnPolicyTimer;
+
+NTSTATUS
+TchTransitionInitialize(
+    IN WDFDEVICE Device,
+    IN WDFDEVICE ChildDevice
+);
+
+NTSTATUS
+TchTransitionSubmit(
+    IN PTOUCH_POWER Context,
+    IN WDFREQUEST Request,
+    IN PTOUCH_POWER_PSTATE_VECTOR Target
+);
+
+VOID
+TchTransitionComplete(
+    IN PTOUCH_POWER Context,
+    IN WDFREQUEST Request,
+    IN NTSTATUS Status
+);
+
+VOID
+TchTransitionKick(
+    IN PTOUCH_POWER Context
+);
+
+VOID
+TchTransitionSubmitInternal(
+    IN PTOUCH_POWER Context,
+    IN DWORD TargetState,
+    IN ULONG Cause
+);
+
+NTSTATUS
+TchTransitionSubmitBatch(
+    IN PTOUCH_POWER Context,
+    IN WDFREQUEST Request,
+    IN PTOUCH_POWER_BATCH Batch
+);
@@ -0,0 +1,49 @@
+/*++
+    Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+    Module Name:
+
+        vote.h
+
+    Abstract:
+
+        Declarations for arbitrating the power votes of several clients
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#pragma once
+
+VOID
+TchVoteInitialize(
+    IN PTOUCH_POWER Context
+);
+
+NTSTATUS
+TchVoteCast(
+    IN PTOUCH_POWER Context,
+    IN PTOUCH_POWER_FILE Voter,
+    IN PTOUCH_POWER_VOTE Vote
+);
+
+VOID
+TchVoteRelease(
+    IN PTOUCH_POWER Context,
+    IN PTOUCH_POWER_FILE Voter
+);
+
+LONG
+TchVoteOutcome(
+    IN PTOUCH_POWER Context
+);
+
+LONG
+TchVoteCollect(
+    IN PTOUCH_POWER Context,
+    IN BOOLEAN PowerOnOnly
+);
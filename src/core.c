@@ -0,0 +1,938 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		core.c
+
+	Abstract:
+
+		Platform-neutral core of the power gating logic: the digitizer
+		power state machine, construction of P-state requests and the
+		life cycle of a transition from the PEP request to its
+		confirmation.
+
+		The core has no knowledge of WDF or PoFx. Everything it needs
+		from the platform goes through the TOUCH_POWER_CORE_BACKEND it
+		was initialized with, and its only other dependencies are the
+		interlocked primitives and clocks in coreplat.h. This lets the
+		same code run in the driver and in off-target builds against a
+		fake PEP.
+
+	Environment:
+
+		Kernel mode, or user mode off-target
+
+	Revision History:
+
+--*/
+
+#include <core.h>
+
+static PTOUCH_POWER_TRANSITION_SLOT
+TchCoreAcquireSlot(
+	IN PTOUCH_POWER_CORE Core
+)
+{
+	LONG i;
+
+	for (i = 0; i < TOUCH_POWER_MAX_TRANSITIONS; i++)
+	{
+		if (!InterlockedBitTestAndSet(&Core->SlotMask, i))
+		{
+			return &Core->Slots[i];
+		}
+	}
+
+	InterlockedIncrement(&Core->SlotExhausted);
+
+	return NULL;
+}
+
+static VOID
+TchCoreReleaseSlot(
+	IN PTOUCH_POWER_CORE Core,
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot
+)
+{
+	InterlockedBitTestAndReset(&Core->SlotMask, (LONG)Slot->Index);
+}
+
+static LONG
+TchCoreSetsOf(
+	IN const TOUCH_POWER_PSTATE_VECTOR* Target
+)
+{
+	LONG mask = 0;
+	ULONG i;
+
+	for (i = 1; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+	{
+		if (Target->PStates[i] != TOUCH_POWER_NO_TARGET)
+		{
+			mask |= (1 << i);
+		}
+	}
+
+	return mask;
+}
+
+static BOOLEAN
+TchCoreClaimSets(
+	IN PTOUCH_POWER_CORE Core,
+	IN LONG Mask
+)
+/*++
+
+Routine Description:
+
+	Claims the P-state sets in Mask for a transition, all or none. Two
+	transitions of the same set could otherwise reach the PEP in one
+	order and publish their outcome in the other.
+
+Arguments:
+
+	Core - Power core
+	Mask - Sets to claim, set 0 excluded
+
+Return Value:
+
+	FALSE if another transition owns one of the sets
+
+--*/
+{
+	LONG oldMask;
+
+	do
+	{
+		oldMask = ReadNoFence(&Core->SetMask);
+
+		if ((oldMask & Mask) != 0)
+		{
+			return FALSE;
+		}
+
+	} while (InterlockedCompareExchange(
+		&Core->SetMask,
+		oldMask | Mask,
+		oldMask) != oldMask);
+
+	return TRUE;
+}
+
+static VOID
+TchCoreReleaseSets(
+	IN PTOUCH_POWER_CORE Core,
+	IN LONG Mask
+)
+{
+	LONG i;
+
+	for (i = 1; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+	{
+		if ((Mask & (1 << i)) != 0)
+		{
+			InterlockedBitTestAndReset(&Core->SetMask, i);
+		}
+	}
+}
+
+static NTSTATUS
+TchCoreBeginTransition(
+	IN PTOUCH_POWER_CORE Core,
+	IN DWORD Target,
+	OUT PULONG Generation
+)
+/*++
+
+Routine Description:
+
+	Claims the power state machine for a transition to Target. Fails
+	if another transition is already in flight, so concurrent callers
+	are ordered by whoever wins the compare-and-swap.
+
+Arguments:
+
+	Core - Power core
+	Target - State the digitizer is being moved to
+	Generation - Receives the generation of the claimed transition
+
+Return Value:
+
+	STATUS_SUCCESS, or STATUS_DEVICE_BUSY if a transition is in flight
+
+--*/
+{
+	LONG oldState;
+	LONG newState;
+	ULONG generation;
+
+	do
+	{
+		oldState = ReadNoFence(&Core->PowerState);
+
+		if (TOUCH_POWER_STATE_BUSY(oldState))
+		{
+			return STATUS_DEVICE_BUSY;
+		}
+
+		generation = (TOUCH_POWER_STATE_GENERATION(oldState) + 1) & 0xFFFFFF;
+		newState = TOUCH_POWER_STATE_PACK(
+			TOUCH_POWER_STATE_CURRENT(oldState),
+			Target,
+			generation) | TOUCH_POWER_STATE_CLAIMED;
+
+	} while (InterlockedCompareExchange(
+		&Core->PowerState,
+		newState,
+		oldState) != oldState);
+
+	*Generation = generation;
+
+	return STATUS_SUCCESS;
+}
+
+static BOOLEAN
+TchCoreEndTransition(
+	IN PTOUCH_POWER_CORE Core,
+	IN ULONG Generation,
+	IN NTSTATUS Status
+)
+/*++
+
+Routine Description:
+
+	Releases the power state machine at the end of a transition. The
+	current state becomes the target if it was reached, and unknown if
+	the watchdog gave up on it, as the PEP may still get there. It is
+	left alone if the transition failed.
+
+Arguments:
+
+	Core - Power core
+	Generation - Generation returned by TchCoreBeginTransition
+	Status - Outcome of the transition
+
+Return Value:
+
+	TRUE if the current state changed to another known state
+
+--*/
+{
+	LONG oldState;
+	LONG newState;
+	DWORD current;
+
+	do
+	{
+		oldState = ReadNoFence(&Core->PowerState);
+
+		TCH_ASSERT(TOUCH_POWER_STATE_GENERATION(oldState) == Generation);
+
+		if (NT_SUCCESS(Status))
+		{
+			current = TOUCH_POWER_STATE_TARGET(oldState);
+		}
+		else if (Status == STATUS_IO_TIMEOUT)
+		{
+			current = TOUCH_POWER_STATE_UNKNOWN;
+		}
+		else
+		{
+			current = TOUCH_POWER_STATE_CURRENT(oldState);
+		}
+
+		newState = TOUCH_POWER_STATE_PACK(current, current, Generation);
+
+	} while (InterlockedCompareExchange(
+		&Core->PowerState,
+		newState,
+		oldState) != oldState);
+
+	return current != TOUCH_POWER_STATE_CURRENT(oldState) &&
+		current != TOUCH_POWER_STATE_UNKNOWN;
+}
+
+DWORD
+TchCoreGetState(
+	IN PTOUCH_POWER_CORE Core
+)
+{
+	return TOUCH_POWER_STATE_CURRENT(ReadNoFence(&Core->PowerState));
+}
+
+static BOOLEAN
+TchCoreSettleTransition(
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot,
+	IN ULONG Sequence,
+	IN NTSTATUS Status
+)
+/*++
+
+Routine Description:
+
+	Moves an in-progress transition to the settled phase. Only the
+	first caller wins, the PEP confirmation and the watchdog can race
+	each other. Nothing happens if the slot has moved on to another
+	transition since Sequence was read.
+
+Arguments:
+
+	Slot - Transition slot
+	Sequence - Sequence number of the transition to settle
+	Status - Outcome of the transition
+
+Return Value:
+
+	TRUE if this call settled the transition
+
+--*/
+{
+	LONG inProgress = TOUCH_POWER_PHASE_PACK(Sequence, TransitionPhaseInProgress);
+
+	if (InterlockedCompareExchange(
+		&Slot->Phase,
+		TOUCH_POWER_PHASE_PACK(Sequence, TransitionPhaseSettled),
+		inProgress) != inProgress)
+	{
+		return FALSE;
+	}
+
+	Slot->SettledStatus = Status;
+	Slot->SettledTicks = TchPlatQueryTicks();
+
+	return TRUE;
+}
+
+static VOID
+TchCoreCommitTransition(
+	IN PTOUCH_POWER_CORE Core,
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot,
+	IN NTSTATUS Status
+)
+/*++
+
+Routine Description:
+
+	Publishes the outcome of a transition: the per-set P-state cache is
+	updated if the PEP reached the target, and the power state machine
+	is released if the transition touched the power gate. A transition
+	the watchdog gave up on may still be carried out by the PEP, so the
+	sets it targeted and the power state are no longer known.
+
+Arguments:
+
+	Core - Power core
+	Slot - Transition slot
+	Status - Outcome of the transition
+
+Return Value:
+
+	None
+
+--*/
+{
+	BOOLEAN stateChanged = FALSE;
+	ULONG i;
+
+	if (NT_SUCCESS(Status))
+	{
+		for (i = 0; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+		{
+			if (Slot->Target.PStates[i] != TOUCH_POWER_NO_TARGET)
+			{
+				InterlockedExchange(
+					&Core->PStateCache[i],
+					Slot->Target.PStates[i]);
+			}
+		}
+	}
+	else if (Status == STATUS_IO_TIMEOUT)
+	{
+		for (i = 0; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+		{
+			if (Slot->Target.PStates[i] != TOUCH_POWER_NO_TARGET)
+			{
+				InterlockedExchange(
+					&Core->PStateCache[i],
+					TOUCH_POWER_NO_TARGET);
+			}
+		}
+	}
+
+	TchCoreReleaseSets(Core, TchCoreSetsOf(&Slot->Target));
+
+	if (Slot->ChangesState)
+	{
+		stateChanged = TchCoreEndTransition(
+			Core,
+			Slot->Generation,
+			Status);
+	}
+
+	Core->Backend->TransitionCommitted(
+		Core->Context,
+		Slot,
+		Status,
+		stateChanged);
+}
+
+static VOID
+TchCoreFinishTransition(
+	IN PTOUCH_POWER_CORE Core,
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot
+)
+/*++
+
+Routine Description:
+
+	Called once both the issuing path and the settling path are done
+	with a pending transition. Publishes the new state, gives the slot
+	back and completes the request that was waiting on the PEP.
+
+Arguments:
+
+	Core - Power core
+	Slot - Settled transition slot
+
+Return Value:
+
+	None
+
+--*/
+{
+	NTSTATUS status = Slot->SettledStatus;
+	PVOID request = Slot->PendingRequest;
+
+	Core->Backend->StopWatchdog(Core->Context, Slot);
+
+	TchCoreCommitTransition(Core, Slot, status);
+
+	Slot->PendingRequest = NULL;
+	TchCoreReleaseSlot(Core, Slot);
+
+	Core->Backend->CompleteRequest(Core->Context, request, status);
+}
+
+static VOID
+TchCoreDereferenceTransition(
+	IN PTOUCH_POWER_CORE Core,
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot
+)
+{
+	if (InterlockedDecrement(&Slot->References) == 0)
+	{
+		TchCoreFinishTransition(Core, Slot);
+	}
+}
+
+BOOLEAN
+TchCoreOnWatchdog(
+	IN PTOUCH_POWER_CORE Core,
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot
+)
+/*++
+
+Routine Description:
+
+	Fails a pending transition the PEP did not confirm in time. The
+	watchdog may fire late for a slot that has been reused since, the
+	deadline check filters that out.
+
+Arguments:
+
+	Core - Power core
+	Slot - Transition slot the watchdog belongs to
+
+Return Value:
+
+	TRUE if the transition was failed with STATUS_IO_TIMEOUT
+
+--*/
+{
+	LONG phase = ReadNoFence(&Slot->Phase);
+
+	if (TOUCH_POWER_PHASE(phase) != TransitionPhaseInProgress ||
+		TchPlatQueryTime() < Slot->Deadline)
+	{
+		return FALSE;
+	}
+
+	if (!TchCoreSettleTransition(Slot, TOUCH_POWER_PHASE_SEQUENCE(phase), STATUS_IO_TIMEOUT))
+	{
+		return FALSE;
+	}
+
+	TchCoreDereferenceTransition(Core, Slot);
+
+	return TRUE;
+}
+
+NTSTATUS
+TchCoreConfirm(
+	IN PTOUCH_POWER_CORE Core,
+	IN PVOID UserData,
+	IN NTSTATUS PepStatus
+)
+/*++
+
+Routine Description:
+
+	Takes the PEP's confirmation for a transition it earlier answered
+	with STATUS_WAIT_1 or STATUS_WAIT_3. UserData is the slot's UserData
+	the request went out with. A confirmation for a transition that was
+	settled already, such as one the watchdog failed, is dropped rather
+	than taken for the transition the slot carries now.
+
+Arguments:
+
+	Core - Power core
+	UserData - Tag of the transition the confirmation is for
+	PepStatus - Result reported by the PEP
+
+Return Value:
+
+	STATUS_INVALID_PARAMETER if UserData is not a transition tag,
+	STATUS_NOT_FOUND if the transition was settled already
+
+--*/
+{
+	PTOUCH_POWER_TRANSITION_SLOT slot;
+	ULONG index = TOUCH_POWER_SLOT_TAG_INDEX(UserData);
+	ULONG sequence = TOUCH_POWER_SLOT_TAG_SEQUENCE(UserData);
+
+	if (index >= TOUCH_POWER_MAX_TRANSITIONS)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	slot = &Core->Slots[index];
+
+	if (PepStatus == STATUS_WAIT_1 || PepStatus == STATUS_WAIT_3)
+	{
+		//
+		// Still not there, keep waiting
+		//
+		return STATUS_SUCCESS;
+	}
+
+	if (!TchCoreSettleTransition(slot, sequence, NT_SUCCESS(PepStatus) ? STATUS_SUCCESS : PepStatus))
+	{
+		InterlockedIncrement(&Core->LateConfirmations);
+
+		return STATUS_NOT_FOUND;
+	}
+
+	InterlockedExchange((volatile LONG*)&slot->PepStatus, PepStatus);
+
+	TchCoreDereferenceTransition(Core, slot);
+
+	return STATUS_SUCCESS;
+}
+
+ULONG
+TchCoreBuildRequest(
+	IN const TOUCH_POWER_PSTATE_VECTOR* Target,
+	OUT PTOUCH_POWER_PSTATE_ENTRY Entries
+)
+/*++
+
+Routine Description:
+
+	Lists the sets Target moves, in set order, as the PEP expects them.
+
+Arguments:
+
+	Target - P-state per set
+	Entries - Receives up to TOUCH_POWER_MAX_PSTATE_SETS entries
+
+Return Value:
+
+	Number of entries filled in
+
+--*/
+{
+	ULONG count = 0;
+	ULONG i;
+
+	for (i = 0; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+	{
+		if (Target->PStates[i] != TOUCH_POWER_NO_TARGET)
+		{
+			Entries[count].SetIndex = i;
+			Entries[count].PStateIndex = (ULONG)Target->PStates[i];
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static NTSTATUS
+TchCoreControl(
+	IN PTOUCH_POWER_CORE Core,
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot
+)
+/*++
+
+Routine Description:
+
+	Asks the PEP to switch the digitizer P-states in Slot->Target, all
+	sets in a single request. A PEP result of STATUS_WAIT_1 or
+	STATUS_WAIT_3 means the states have not been reached yet; the
+	transition then stays in progress until the PEP confirms it through
+	TchCoreConfirm or the watchdog expires.
+
+Arguments:
+
+	Core - Power core
+	Slot - Transition slot owned by the caller
+
+Return Value:
+
+	STATUS_PENDING if the transition will be finished later, in which
+	case the slot no longer belongs to the caller. Any other status is
+	the final outcome.
+
+--*/
+{
+	TOUCH_POWER_PSTATE_ENTRY entries[TOUCH_POWER_MAX_PSTATE_SETS];
+	NTSTATUS pepStatus = STATUS_SUCCESS;
+	NTSTATUS status;
+	ULONG sequence;
+	ULONG count;
+
+	count = TchCoreBuildRequest(&Slot->Target, entries);
+
+	TCH_ASSERT(count != 0);
+
+	//
+	// The PEP may confirm before the backend even returns, so the slot
+	// is set up for the pending case up front: one reference for this
+	// path, one for whoever settles the transition. A new sequence number
+	// keeps confirmations for earlier transitions of the slot out.
+	//
+	sequence = TOUCH_POWER_PHASE_SEQUENCE(Slot->Phase) + 1;
+
+	Slot->SettledStatus = STATUS_PENDING;
+	Slot->PepStatus = STATUS_PENDING;
+	Slot->References = 2;
+	Slot->UserData = TOUCH_POWER_SLOT_TAG(Slot->Index, sequence);
+	InterlockedExchange(&Slot->Phase, TOUCH_POWER_PHASE_PACK(sequence, TransitionPhaseInProgress));
+
+	Slot->StartTicks = TchPlatQueryTicks();
+
+	status = Core->Backend->PowerControl(
+		Core->Context,
+		Slot,
+		entries,
+		count,
+		&pepStatus);
+
+	//
+	// The confirmation may have brought the final result already
+	//
+	if (NT_SUCCESS(status))
+	{
+		InterlockedCompareExchange(
+			(volatile LONG*)&Slot->PepStatus,
+			pepStatus,
+			STATUS_PENDING);
+	}
+
+	if (NT_SUCCESS(status) &&
+		(pepStatus == STATUS_WAIT_1 || pepStatus == STATUS_WAIT_3))
+	{
+		if (Core->TransitionTimeoutMs != 0)
+		{
+			Slot->Deadline = TchPlatQueryTime() + (ULONGLONG)Core->TransitionTimeoutMs * 10000;
+			Core->Backend->StartWatchdog(Core->Context, Slot, Core->TransitionTimeoutMs);
+		}
+
+		TchCoreDereferenceTransition(Core, Slot);
+
+		return STATUS_PENDING;
+	}
+
+	if (!TchCoreSettleTransition(Slot, sequence, status))
+	{
+		//
+		// A confirmation raced in, let the settling path finish it
+		//
+		TchCoreDereferenceTransition(Core, Slot);
+
+		return STATUS_PENDING;
+	}
+
+	return status;
+}
+
+NTSTATUS
+TchCoreSetPStates(
+	IN PTOUCH_POWER_CORE Core,
+	IN const TOUCH_POWER_PSTATE_VECTOR* Target,
+	IN PVOID Request,
+	IN ULONG Cause,
+	IN ULONG CallerPid
+)
+/*++
+
+Routine Description:
+
+	Moves the digitizer to the requested P-states and publishes them
+	once the PEP has confirmed. If set 0 is part of the request the
+	digitizer power state follows it: P-state 1 is off, anything else
+	counts as on.
+
+Arguments:
+
+	Core - Power core
+	Target - P-state per set, at least one set must be targeted
+	Request - Request to complete if the transition ends up pending
+	Cause - Reason for the transition, passed on to the backend
+	CallerPid - Process the request came from, 0 for the driver
+
+Return Value:
+
+	STATUS_PENDING if the PEP has not confirmed the transition yet;
+	Request is then completed through the backend's CompleteRequest.
+	Any other status is the final outcome and Request is left to the
+	caller.
+
+--*/
+{
+	PTOUCH_POWER_TRANSITION_SLOT slot;
+	NTSTATUS status;
+	ULONG generation = 0;
+	BOOLEAN changesState;
+	LONG sets;
+
+	changesState = (Target->PStates[0] != TOUCH_POWER_NO_TARGET);
+	sets = TchCoreSetsOf(Target);
+
+	if (!TchCoreClaimSets(Core, sets))
+	{
+		return STATUS_DEVICE_BUSY;
+	}
+
+	if (changesState)
+	{
+		status = TchCoreBeginTransition(
+			Core,
+			Target->PStates[0] != TOUCH_POWER_PSTATE_OFF,
+			&generation);
+
+		if (!NT_SUCCESS(status))
+		{
+			TchCoreReleaseSets(Core, sets);
+			return status;
+		}
+	}
+
+	slot = TchCoreAcquireSlot(Core);
+
+	if (!slot)
+	{
+		if (changesState)
+		{
+			TchCoreEndTransition(Core, generation, STATUS_INSUFFICIENT_RESOURCES);
+		}
+
+		TchCoreReleaseSets(Core, sets);
+
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	slot->Phase = TOUCH_POWER_PHASE_PACK(
+		TOUCH_POWER_PHASE_SEQUENCE(slot->Phase),
+		TransitionPhaseRequested);
+	slot->Target = *Target;
+	slot->ChangesState = changesState;
+	slot->Generation = generation;
+	slot->Cause = Cause;
+	slot->CallerPid = CallerPid;
+	slot->PendingRequest = Request;
+
+	status = TchCoreControl(Core, slot);
+	if (status == STATUS_PENDING)
+	{
+		return status;
+	}
+
+	TchCoreCommitTransition(Core, slot, status);
+
+	slot->PendingRequest = NULL;
+	TchCoreReleaseSlot(Core, slot);
+
+	return status;
+}
+
+NTSTATUS
+TchCoreVectorFromState(
+	IN DWORD State,
+	OUT PTOUCH_POWER_PSTATE_VECTOR Vector
+)
+/*++
+
+Routine Description:
+
+	Builds the P-state vector for a plain on/off request, which only
+	touches the power gate in set 0.
+
+Arguments:
+
+	State - 1 to power the digitizer on, 0 to power it off
+	Vector - Receives the P-state vector
+
+Return Value:
+
+	STATUS_INVALID_PARAMETER if State is neither 0 nor 1
+
+--*/
+{
+	ULONG i;
+
+	if (State != 0 && State != 1)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	for (i = 0; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+	{
+		Vector->PStates[i] = TOUCH_POWER_NO_TARGET;
+	}
+
+	Vector->PStates[0] = State ? TOUCH_POWER_PSTATE_ON : TOUCH_POWER_PSTATE_OFF;
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+TchCoreMerge(
+	IN OUT PTOUCH_POWER_PSTATE_VECTOR Target,
+	IN const TOUCH_POWER_PSTATE_VECTOR* Later
+)
+{
+	ULONG i;
+
+	for (i = 0; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+	{
+		if (Later->PStates[i] != TOUCH_POWER_NO_TARGET)
+		{
+			Target->PStates[i] = Later->PStates[i];
+		}
+	}
+}
+
+BOOLEAN
+TchCoreElide(
+	IN PTOUCH_POWER_CORE Core,
+	IN OUT PTOUCH_POWER_PSTATE_VECTOR Target
+)
+/*++
+
+Routine Description:
+
+	Drops every set from Target that is already in the requested
+	P-state.
+
+Arguments:
+
+	Core - Power core
+	Target - P-state vector to trim
+
+Return Value:
+
+	TRUE if nothing is left to do
+
+--*/
+{
+	BOOLEAN empty = TRUE;
+	ULONG i;
+
+	for (i = 0; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+	{
+		if (Target->PStates[i] == ReadNoFence(&Core->PStateCache[i]))
+		{
+			Target->PStates[i] = TOUCH_POWER_NO_TARGET;
+		}
+
+		if (Target->PStates[i] != TOUCH_POWER_NO_TARGET)
+		{
+			empty = FALSE;
+		}
+	}
+
+	return empty;
+}
+
+NTSTATUS
+TchCoreRegisterDevice(
+	IN PTOUCH_POWER_CORE Core
+)
+{
+	return Core->Backend->RegisterDevice(Core->Context);
+}
+
+VOID
+TchCoreInitialize(
+	OUT PTOUCH_POWER_CORE Core,
+	IN const TOUCH_POWER_CORE_BACKEND* Backend,
+	IN PVOID Context,
+	IN ULONG TransitionTimeoutMs
+)
+/*++
+
+Routine Description:
+
+	Sets up the core with the state of the digitizer and the P-states
+	of all sets unknown and no transition in flight.
+
+Arguments:
+
+	Core - Power core to initialize
+	Backend - Platform the core runs on
+	Context - Passed back to every backend routine
+	TransitionTimeoutMs - How long the PEP may take to confirm, 0 waits
+		forever
+
+Return Value:
+
+	None
+
+--*/
+{
+	ULONG i;
+
+	Core->Backend = Backend;
+	Core->Context = Context;
+	Core->TransitionTimeoutMs = TransitionTimeoutMs;
+	Core->PowerState = TOUCH_POWER_STATE_PACK(
+		TOUCH_POWER_STATE_UNKNOWN,
+		TOUCH_POWER_STATE_UNKNOWN,
+		0);
+	Core->SetMask = 0;
+	Core->SlotMask = 0;
+	Core->SlotExhausted = 0;
+	Core->LateConfirmations = 0;
+
+	//
+	// Nothing is known about the digitizer before the first transition,
+	// whatever the firmware left it in
+	//
+	for (i = 0; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+	{
+		Core->PStateCache[i] = TOUCH_POWER_NO_TARGET;
+	}
+
+	for (i = 0; i < TOUCH_POWER_MAX_TRANSITIONS; i++)
+	{
+		Core->Slots[i].Index = i;
+		Core->Slots[i].Phase = TOUCH_POWER_PHASE_PACK(0, TransitionPhaseRequested);
+		Core->Slots[i].UserData = NULL;
+		Core->Slots[i].PepStatus = STATUS_PENDING;
+		Core->Slots[i].References = 0;
+		Core->Slots[i].PendingRequest = NULL;
+		Core->Slots[i].Deadline = 0;
+	}
+}
@@ -0,0 +1,248 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		direct.c
+
+	Abstract:
+
+		Implements the direct interface sibling kernel drivers query
+		from the test PDO to gate digitizer power with a plain function
+		call, see direct.h.
+
+		Each query hands out an interface of its own, carrying a vote
+		that goes through the same arbitration (see vote.c) and
+		transition engine as the votes of handles to the test device.
+		The vote lives as long as the interface is referenced, and every
+		reference to the interface holds one on the device as well.
+
+	Environment:
+
+		Kernel mode
+
+	Revision History:
+
+--*/
+
+#include <internal.h>
+#include <power.h>
+#include <vote.h>
+#include <direct.h>
+#include <direct.tmh>
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, TchDirectInitialize)
+#pragma alloc_text(PAGE, TchDirectOnQueryInterface)
+#endif
+
+static VOID
+TchDirectReference(
+	IN PVOID Context
+)
+{
+	PTOUCH_POWER_DIRECT_CLIENT client = (PTOUCH_POWER_DIRECT_CLIENT)Context;
+
+	WdfObjectReference(WdfObjectContextGetObject(client->Device));
+	InterlockedIncrement(&client->References);
+}
+
+static VOID
+TchDirectDereference(
+	IN PVOID Context
+)
+/*++
+
+Routine Description:
+
+	Drops a reference to the interface of a client, withdrawing its
+	vote once the last one is gone, and the reference it held on the
+	device.
+
+Arguments:
+
+	Context - Client the interface was handed out to
+
+Return Value:
+
+	None
+
+--*/
+{
+	PTOUCH_POWER_DIRECT_CLIENT client = (PTOUCH_POWER_DIRECT_CLIENT)Context;
+	WDFOBJECT device = WdfObjectContextGetObject(client->Device);
+
+	if (InterlockedDecrement(&client->References) == 0)
+	{
+		TchVoteRelease(client->Device, &client->Voter);
+
+		ExFreePoolWithTag(client, TOUCH_POOL_TAG);
+	}
+
+	WdfObjectDereference(device);
+}
+
+static NTSTATUS
+TchDirectAcquirePower(
+	IN PVOID Context,
+	IN ULONG Priority
+)
+{
+	PTOUCH_POWER_DIRECT_CLIENT client = (PTOUCH_POWER_DIRECT_CLIENT)Context;
+	TOUCH_POWER_VOTE vote;
+
+	vote.Vote = TouchPowerVoteNeedOn;
+	vote.Priority = Priority;
+
+	return TchVoteCast(client->Device, &client->Voter, &vote);
+}
+
+static VOID
+TchDirectReleasePower(
+	IN PVOID Context
+)
+{
+	PTOUCH_POWER_DIRECT_CLIENT client = (PTOUCH_POWER_DIRECT_CLIENT)Context;
+	TOUCH_POWER_VOTE vote;
+
+	vote.Vote = TouchPowerVoteNone;
+	vote.Priority = 0;
+
+	(VOID)TchVoteCast(client->Device, &client->Voter, &vote);
+}
+
+static ULONG
+TchDirectGetState(
+	IN PVOID Context
+)
+{
+	PTOUCH_POWER_DIRECT_CLIENT client = (PTOUCH_POWER_DIRECT_CLIENT)Context;
+
+	return TchPowerGetState(client->Device);
+}
+
+NTSTATUS
+TchDirectOnQueryInterface(
+	IN WDFDEVICE Device,
+	IN LPGUID InterfaceType,
+	IN OUT PINTERFACE ExposedInterface,
+	IN OUT PVOID ExposedInterfaceSpecificData
+)
+/*++
+
+Routine Description:
+
+	Sets up the client state of a driver querying the direct interface.
+	The framework copied the interface into the querying driver's buffer
+	already, and takes the first reference once this returns.
+
+Arguments:
+
+	Device - Framework device object representing the test PDO
+	InterfaceType - GUID_TOUCH_POWER_DIRECT_INTERFACE
+	ExposedInterface - Interface handed to the querying driver
+	ExposedInterfaceSpecificData - Unused
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	PTOUCH_POWER_DIRECT_CLIENT client;
+
+	PAGED_CODE();
+
+	UNREFERENCED_PARAMETER(InterfaceType);
+	UNREFERENCED_PARAMETER(ExposedInterfaceSpecificData);
+
+	client = (PTOUCH_POWER_DIRECT_CLIENT)ExAllocatePoolWithTag(NonPagedPool, sizeof(TOUCH_POWER_DIRECT_CLIENT), TOUCH_POOL_TAG);
+
+	if (client == NULL)
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_POWER,
+			"Error allocating direct interface client");
+
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlZeroMemory(client, sizeof(TOUCH_POWER_DIRECT_CLIENT));
+	client->Device = GetDeviceContext(WdfPdoGetParent(Device));
+
+	ExposedInterface->Context = client;
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_POWER,
+		"Direct interface handed out");
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+TchDirectInitialize(
+	IN WDFDEVICE Device,
+	IN WDFDEVICE ChildDevice
+)
+/*++
+
+Routine Description:
+
+	Exposes the direct interface on the test PDO, where sibling drivers
+	find it through GUID_TOUCH_POWER_DIRECT_INTERFACE.
+
+Arguments:
+
+	Device - Framework device object representing the actual touch device
+	ChildDevice - Framework device object representing the test PDO
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	NTSTATUS status;
+	TOUCH_POWER_DIRECT_INTERFACE directInterface;
+	WDF_QUERY_INTERFACE_CONFIG queryConfig;
+
+	PAGED_CODE();
+
+	//
+	// Context is replaced with the client state of each querying driver,
+	// the framework keeps a copy of the rest
+	//
+	RtlZeroMemory(&directInterface, sizeof(TOUCH_POWER_DIRECT_INTERFACE));
+
+	directInterface.InterfaceHeader.Size = sizeof(TOUCH_POWER_DIRECT_INTERFACE);
+	directInterface.InterfaceHeader.Version = TOUCH_POWER_DIRECT_INTERFACE_VERSION;
+	directInterface.InterfaceHeader.Context = GetDeviceContext(Device);
+	directInterface.InterfaceHeader.InterfaceReference = TchDirectReference;
+	directInterface.InterfaceHeader.InterfaceDereference = TchDirectDereference;
+	directInterface.AcquirePower = TchDirectAcquirePower;
+	directInterface.ReleasePower = TchDirectReleasePower;
+	directInterface.GetState = TchDirectGetState;
+
+	WDF_QUERY_INTERFACE_CONFIG_INIT(
+		&queryConfig,
+		(PINTERFACE)&directInterface,
+		&GUID_TOUCH_POWER_DIRECT_INTERFACE,
+		TchDirectOnQueryInterface);
+
+	status = WdfDeviceAddQueryInterface(
+		ChildDevice,
+		&queryConfig);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error adding direct interface - %!STATUS!",
+			status);
+	}
+
+	return status;
+}
@@ -0,0 +1,243 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		display.c
+
+	Abstract:
+
+		Platform-neutral display gate. Whoever receives the display
+		power setting notifications (GUID_CONSOLE_DISPLAY_STATE,
+		GUID_MONITOR_POWER_ON) hands them to the gate, which tells it
+		when to power the digitizer off and back on:
+
+		- the display going off arms a power-off OffDelayMs later, so
+		  that a display blanked for a moment does not reach the PEP
+		- the display coming back drops a pending power-off, or powers
+		  the digitizer back on if the gate had it powered off and it
+		  was on, or in a state nobody knew, before
+
+		The driver may still keep the digitizer on when the gate wants
+		it off, TchDisplayGate tells the gate whether it did.
+
+		A dimmed display still counts as on. Once the console display
+		state was reported it takes precedence, the monitor power state
+		is only used on systems that do not report the console's.
+
+		Like the core, the gate only depends on coreplat.h, so the same
+		code runs in the driver and in the off-target tools, which feed
+		it notifications of their own.
+
+	Environment:
+
+		Kernel mode, or user mode off-target
+
+	Revision History:
+
+--*/
+
+#include <display.h>
+
+#define TOUCH_POWER_DISPLAY_MS(ms)              ((ULONGLONG)(ms) * 10000)
+
+static BOOLEAN
+TchDisplayIsOn(
+	IN PTOUCH_POWER_DISPLAY Display
+)
+{
+	ULONG state = Display->State[TouchPowerDisplayConsole];
+
+	if (state == TOUCH_POWER_DISPLAY_UNKNOWN)
+	{
+		state = Display->State[TouchPowerDisplayMonitor];
+	}
+
+	return state != TOUCH_POWER_DISPLAY_OFF;
+}
+
+VOID
+TchDisplayInitialize(
+	OUT PTOUCH_POWER_DISPLAY Display,
+	IN const TOUCH_POWER_DISPLAY_CONFIG* Config
+)
+{
+	ULONG i;
+
+	Display->Config = *Config;
+
+	for (i = 0; i < TouchPowerDisplaySourceCount; i++)
+	{
+		Display->State[i] = TOUCH_POWER_DISPLAY_UNKNOWN;
+	}
+
+	Display->On = TRUE;
+	Display->OffPending = FALSE;
+	Display->Gated = FALSE;
+	Display->RestoreOn = FALSE;
+	Display->OffDue = 0;
+	Display->DisplayOffs = 0;
+	Display->PowerOffs = 0;
+	Display->OffsCancelled = 0;
+}
+
+TOUCH_POWER_DISPLAY_ACTION
+TchDisplayNotify(
+	IN PTOUCH_POWER_DISPLAY Display,
+	IN TOUCH_POWER_DISPLAY_SOURCE Source,
+	IN ULONG State,
+	OUT PULONGLONG Due
+)
+/*++
+
+Routine Description:
+
+	Tells the gate about a display state notification. Calls are
+	serialized by the caller, along with those to TchDisplayExpire.
+
+Arguments:
+
+	Display - Display gate
+	Source - Notification the state comes from
+	State - Reported display state, TOUCH_POWER_DISPLAY_*
+	Due - Receives the interrupt time (100ns units) to call
+		TchDisplayExpire at, for TouchPowerDisplayArm
+
+Return Value:
+
+	What to do about the digitizer
+
+--*/
+{
+	BOOLEAN on;
+
+	*Due = 0;
+
+	if (Source >= TouchPowerDisplaySourceCount)
+	{
+		return TouchPowerDisplayNone;
+	}
+
+	Display->State[Source] = State;
+
+	on = TchDisplayIsOn(Display);
+	if (on == Display->On)
+	{
+		return TouchPowerDisplayNone;
+	}
+
+	Display->On = on;
+
+	if (!on)
+	{
+		InterlockedIncrement(&Display->DisplayOffs);
+	}
+
+	if (!Display->Config.Enabled)
+	{
+		return TouchPowerDisplayNone;
+	}
+
+	if (on)
+	{
+		if (Display->OffPending)
+		{
+			Display->OffPending = FALSE;
+			InterlockedIncrement(&Display->OffsCancelled);
+
+			return TouchPowerDisplayDisarm;
+		}
+
+		if (Display->Gated)
+		{
+			Display->Gated = FALSE;
+
+			return Display->RestoreOn ? TouchPowerDisplayPowerOn : TouchPowerDisplayNone;
+		}
+
+		return TouchPowerDisplayNone;
+	}
+
+	if (Display->Config.OffDelayMs == 0)
+	{
+		return TouchPowerDisplayPowerOff;
+	}
+
+	Display->OffPending = TRUE;
+	Display->OffDue = TchPlatQueryTime() + TOUCH_POWER_DISPLAY_MS(Display->Config.OffDelayMs);
+	*Due = Display->OffDue;
+
+	return TouchPowerDisplayArm;
+}
+
+BOOLEAN
+TchDisplayExpire(
+	IN PTOUCH_POWER_DISPLAY Display
+)
+/*++
+
+Routine Description:
+
+	Asks the gate whether the power-off it armed is due, once the time
+	TchDisplayNotify returned has passed.
+
+Arguments:
+
+	Display - Display gate
+
+Return Value:
+
+	TRUE if the digitizer is to be powered off now, see TchDisplayGate
+
+--*/
+{
+	if (!Display->OffPending || TchPlatQueryTime() < Display->OffDue)
+	{
+		return FALSE;
+	}
+
+	Display->OffPending = FALSE;
+
+	return TRUE;
+}
+
+BOOLEAN
+TchDisplayGate(
+	IN PTOUCH_POWER_DISPLAY Display,
+	IN ULONG DigitizerState,
+	IN BOOLEAN KeptOn
+)
+/*++
+
+Routine Description:
+
+	Carries out a power-off the gate decided on, with
+	TouchPowerDisplayPowerOff or TchDisplayExpire. The gate only counts
+	the digitizer as gated, and powers it back on with the display, if
+	the power-off actually goes out.
+
+Arguments:
+
+	Display - Display gate
+	DigitizerState - State the digitizer is in, 0 for off; on and
+		unknown alike are restored when the display comes back
+	KeptOn - The driver keeps the digitizer on regardless, because a
+		client votes it on
+
+Return Value:
+
+	TRUE if the digitizer is to be powered off
+
+--*/
+{
+	if (KeptOn)
+	{
+		return FALSE;
+	}
+
+	Display->Gated = TRUE;
+	Display->RestoreOn = DigitizerState != 0;
+	InterlockedIncrement(&Display->PowerOffs);
+
+	return TRUE;
+}
@@ -22,6 +22,7 @@
 #include <driver.h>
 #include <device.h>
 #include <power.h>
+#include <registry.h>
 #include <driver.h>
 #include <driver.tmh>
 
@@ -130,6 +131,18 @@ exit:
     return status;
 }
 
+VOID
+OnDeviceSelfManagedIoCleanup(
+    WDFDEVICE Device
+)
+{
+    PTOUCH_POWER devContext;
+
+    devContext = GetDeviceContext(Device);
+
+    TchPowerSelfManagedIoCleanup(devContext);
+}
+
 NTSTATUS
 OnDeviceAdd(
     IN WDFDRIVER Driver,
@@ -180,6 +193,7 @@ Return Value:
     pnpPowerCallbacks.EvtDevicePrepareHardware = OnPrepareHardware;
     pnpPowerCallbacks.EvtDeviceReleaseHardware = OnReleaseHardware;
     pnpPowerCallbacks.EvtDeviceSelfManagedIoInit = OnDeviceSelfManagedIoStart;
+    pnpPowerCallbacks.EvtDeviceSelfManagedIoCleanup = OnDeviceSelfManagedIoCleanup;
 
     WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &pnpPowerCallbacks);
 
@@ -207,6 +221,19 @@ Return Value:
     devContext->FxDevice = fxDevice;
     devContext->PhysicalDevice = WdfDeviceWdmGetPhysicalDevice(fxDevice);
 
+    status = TchPowerReadConfiguration(fxDevice, &devContext->Config);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_ERROR,
+            TRACE_INIT,
+            "Error reading configuration - %!STATUS!",
+            status);
+
+        goto exit;
+    }
+
     //
     // Initialize driver path for self-test
     //
@@ -0,0 +1,486 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		idle.c
+
+	Abstract:
+
+		Implements the PoFx component callbacks for the digitizer.
+
+		Everyone who needs the digitizer (an open session on the test
+		PDO, for instance) holds an active reference on the component.
+		Once the last reference is dropped PoFx reports the idle
+		condition, and if the component stays idle for IdleTimeoutMs the
+		digitizer is moved to the off P-state without any help from
+		user mode. It is powered back on as soon as the component
+		becomes active again.
+
+		The component exposes F0 (active) and F1 (off). When the PEP
+		moves the component to F1 the digitizer is powered off, and
+		powered back on when the component returns to F0. The F-state
+		change is only completed to PoFx once that transition is done.
+
+	Environment:
+
+		Kernel mode
+
+	Revision History:
+
+--*/
+
+#include <internal.h>
+#include <power.h>
+#include <transition.h>
+#include <idle.h>
+#include <stats.h>
+#include <idle.tmh>
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, TchIdleInitialize)
+#pragma alloc_text(PAGE, TchIdleStop)
+#endif
+
+VOID
+TchIdleFillStates(
+	IN PTOUCH_POWER pDeviceContext,
+	OUT PPO_FX_COMPONENT_IDLE_STATE IdleStates
+)
+/*++
+
+Routine Description:
+
+	Fills in the F-state table registered with PoFx. Latencies and
+	residencies are configured in microseconds, PoFx wants them in
+	100ns units.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	IdleStates - Array of TouchPowerFStateCount idle states
+
+Return Value:
+
+	None
+
+--*/
+{
+	PTOUCH_POWER_CONFIG config = &pDeviceContext->Config;
+	ULONG i;
+
+	RtlZeroMemory(IdleStates, sizeof(PO_FX_COMPONENT_IDLE_STATE) * TouchPowerFStateCount);
+
+	for (i = 0; i < TouchPowerFStateCount; i++)
+	{
+		IdleStates[i].NominalPower = config->FStateNominalPowerUw[i];
+
+		if (i != TouchPowerF0Active)
+		{
+			IdleStates[i].TransitionLatency = (ULONGLONG)config->FStateTransitionLatencyUs[i] * 10;
+			IdleStates[i].ResidencyRequirement = (ULONGLONG)config->FStateResidencyUs[i] * 10;
+		}
+	}
+}
+
+VOID
+TchIdleAcquire(
+	IN PTOUCH_POWER pDeviceContext
+)
+/*++
+
+Routine Description:
+
+	Takes an active reference on the digitizer component. Must be
+	called at PASSIVE_LEVEL since it waits for the component to become
+	active.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+
+Return Value:
+
+	None
+
+--*/
+{
+	if (pDeviceContext->PepHandle == NULL)
+	{
+		return;
+	}
+
+	InterlockedIncrement(&pDeviceContext->ActiveReferences);
+
+	PoFxActivateComponent(
+		pDeviceContext->PepHandle,
+		0,
+		PO_FX_FLAG_BLOCKING);
+}
+
+VOID
+TchIdleRelease(
+	IN PTOUCH_POWER pDeviceContext
+)
+{
+	if (pDeviceContext->PepHandle == NULL)
+	{
+		return;
+	}
+
+	InterlockedDecrement(&pDeviceContext->ActiveReferences);
+
+	PoFxIdleComponent(
+		pDeviceContext->PepHandle,
+		0,
+		0);
+}
+
+VOID
+TchIdleStart(
+	IN PTOUCH_POWER pDeviceContext
+)
+/*++
+
+Routine Description:
+
+	Called once the device is registered with PoFx. The component is
+	activated on behalf of the driver; that reference is dropped right
+	away when an idle timeout is configured so that the component can
+	go idle as soon as nobody else needs it.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+
+Return Value:
+
+	None
+
+--*/
+{
+	TchIdleAcquire(pDeviceContext);
+
+	if (pDeviceContext->Config.IdleTimeoutMs != 0)
+	{
+		TchIdleRelease(pDeviceContext);
+	}
+}
+
+VOID
+TchIdleStop(
+	IN PTOUCH_POWER pDeviceContext
+)
+/*++
+
+Routine Description:
+
+	Called when the device is going away. Stops the idle timer and
+	unregisters the device from PoFx, after which PoFx no longer calls
+	into the driver with this context. Taking and dropping references
+	on the component does nothing from then on, until the device is
+	registered again on the next start.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+
+Return Value:
+
+	None
+
+--*/
+{
+	PAGED_CODE();
+
+	WdfTimerStop(pDeviceContext->IdleTimer, TRUE);
+
+	if (pDeviceContext->PepHandle == NULL)
+	{
+		return;
+	}
+
+	PoFxUnregisterDevice(pDeviceContext->PepHandle);
+
+	pDeviceContext->PepHandle = NULL;
+	InterlockedExchange(&pDeviceContext->ActiveReferences, 0);
+}
+
+VOID
+TchIdleOnComponentActive(
+	IN PVOID Context,
+	IN ULONG Component
+)
+/*++
+
+Routine Description:
+
+	Called by PoFx when someone needs the digitizer again. Stops a
+	pending idle timeout, and powers the digitizer back on if the idle
+	timeout powered it down.
+
+Arguments:
+
+	Context - Touch power device context
+	Component - Component index, always 0
+
+Return Value:
+
+	None
+
+--*/
+{
+	PTOUCH_POWER devContext = (PTOUCH_POWER)Context;
+
+	UNREFERENCED_PARAMETER(Component);
+
+	Trace(
+		TRACE_LEVEL_VERBOSE,
+		TRACE_IDLE,
+		"Digitizer component active");
+
+	WdfTimerStop(devContext->IdleTimer, FALSE);
+
+	if (InterlockedExchange(&devContext->IdlePoweredDown, FALSE))
+	{
+		Trace(
+			TRACE_LEVEL_INFORMATION,
+			TRACE_IDLE,
+			"Powering digitizer back up after idle timeout");
+
+		TchTransitionSubmitInternal(devContext, 1, TouchPowerCauseComponentActive);
+	}
+}
+
+VOID
+TchIdleOnComponentIdle(
+	IN PVOID Context,
+	IN ULONG Component
+)
+{
+	PTOUCH_POWER devContext = (PTOUCH_POWER)Context;
+
+	if (devContext->Config.IdleTimeoutMs != 0)
+	{
+		Trace(
+			TRACE_LEVEL_VERBOSE,
+			TRACE_IDLE,
+			"Digitizer component idle, powering down in %lu ms",
+			devContext->Config.IdleTimeoutMs);
+
+		WdfTimerStart(
+			devContext->IdleTimer,
+			WDF_REL_TIMEOUT_IN_MS(devContext->Config.IdleTimeoutMs));
+	}
+
+	PoFxCompleteIdleCondition(devContext->PepHandle, Component);
+}
+
+VOID
+TchIdleOnComponentIdleState(
+	IN PVOID Context,
+	IN ULONG Component,
+	IN ULONG State
+)
+/*++
+
+Routine Description:
+
+	Called by PoFx when the component changes F-state. Entering F1 powers
+	the digitizer off if it was on, and coming back to F0 restores it.
+	When a transition is submitted the change is completed by
+	TchIdleTransitionDone, otherwise right away.
+
+Arguments:
+
+	Context - Touch power device context
+	Component - Component index, always 0
+	State - F-state being entered
+
+Return Value:
+
+	None
+
+--*/
+{
+	PTOUCH_POWER devContext = (PTOUCH_POWER)Context;
+	LONG restoreState;
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_IDLE,
+		"Digitizer component entering F%lu",
+		State);
+
+	InterlockedExchange(&devContext->FState, (LONG)State);
+	TchStatsEnterState(devContext, TouchPowerResidencyFState, State);
+
+	if (State == TouchPowerF1Off)
+	{
+		if (TchPowerGetState(devContext) != 0)
+		{
+			InterlockedExchange(&devContext->FStateRestoreState, 1);
+			InterlockedExchange(&devContext->FStateCompletePending, TRUE);
+			TchTransitionSubmitInternal(devContext, 0, TouchPowerCauseComponentIdle);
+			return;
+		}
+	}
+	else if (State == TouchPowerF0Active)
+	{
+		restoreState = InterlockedExchange(
+			&devContext->FStateRestoreState,
+			TOUCH_POWER_NO_TARGET);
+
+		if (restoreState != TOUCH_POWER_NO_TARGET)
+		{
+			InterlockedExchange(&devContext->FStateCompletePending, TRUE);
+			TchTransitionSubmitInternal(
+				devContext,
+				(DWORD)restoreState,
+				TouchPowerCauseComponentActive);
+			return;
+		}
+	}
+
+	PoFxCompleteIdleState(devContext->PepHandle, Component);
+}
+
+VOID
+TchIdleTransitionDone(
+	IN PTOUCH_POWER Context,
+	IN ULONG Cause
+)
+/*++
+
+Routine Description:
+
+	Called by the transition engine when a transition finished, was
+	elided or was superseded before it went out. Completes a pending
+	F-state change if the transition was submitted for one.
+
+Arguments:
+
+	Context - Touch power device context
+	Cause - Cause the transition was submitted with
+
+Return Value:
+
+	None
+
+--*/
+{
+	if (Cause != TouchPowerCauseComponentIdle &&
+		Cause != TouchPowerCauseComponentActive)
+	{
+		return;
+	}
+
+	if (InterlockedExchange(&Context->FStateCompletePending, FALSE))
+	{
+		PoFxCompleteIdleState(Context->PepHandle, 0);
+	}
+}
+
+VOID
+TchIdleOnDevicePowerRequired(
+	IN PVOID Context
+)
+{
+	PTOUCH_POWER devContext = (PTOUCH_POWER)Context;
+
+	PoFxReportDevicePoweredOn(devContext->PepHandle);
+}
+
+VOID
+TchIdleOnDevicePowerNotRequired(
+	IN PVOID Context
+)
+{
+	PTOUCH_POWER devContext = (PTOUCH_POWER)Context;
+
+	PoFxCompleteDevicePowerNotRequired(devContext->PepHandle);
+}
+
+VOID
+TchIdleOnTimeout(
+	IN WDFTIMER Timer
+)
+/*++
+
+Routine Description:
+
+	The component stayed idle for the whole timeout, power the
+	digitizer down if it is on. An active condition in the meantime
+	stops the timer, the reference count check covers the race with it.
+	TchIdleOnComponentActive powers the digitizer back on.
+
+Arguments:
+
+	Timer - Idle timer
+
+Return Value:
+
+	None
+
+--*/
+{
+	PTOUCH_POWER devContext;
+
+	devContext = GetDeviceContext(WdfTimerGetParentObject(Timer));
+
+	if (ReadNoFence(&devContext->ActiveReferences) != 0 ||
+		TchPowerGetState(devContext) == 0)
+	{
+		return;
+	}
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_IDLE,
+		"Idle timeout expired, powering digitizer down");
+
+	InterlockedIncrement(&devContext->IdlePowerDowns);
+	InterlockedExchange(&devContext->IdlePoweredDown, TRUE);
+
+	TchTransitionSubmitInternal(devContext, 0, TouchPowerCauseIdleTimeout);
+}
+
+NTSTATUS
+TchIdleInitialize(
+	IN WDFDEVICE Device
+)
+{
+	NTSTATUS status;
+	PTOUCH_POWER devContext;
+	WDF_TIMER_CONFIG timerConfig;
+	WDF_OBJECT_ATTRIBUTES timerAttributes;
+
+	PAGED_CODE();
+
+	devContext = GetDeviceContext(Device);
+	devContext->FState = TouchPowerF0Active;
+	devContext->FStateRestoreState = TOUCH_POWER_NO_TARGET;
+	devContext->FStateCompletePending = FALSE;
+	devContext->IdlePoweredDown = FALSE;
+
+	WDF_TIMER_CONFIG_INIT(&timerConfig, TchIdleOnTimeout);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
+	timerAttributes.ParentObject = Device;
+
+	status = WdfTimerCreate(
+		&timerConfig,
+		&timerAttributes,
+		&devContext->IdleTimer);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating idle timer - %!STATUS!",
+			status);
+	}
+
+	return status;
+}
@@ -0,0 +1,305 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		notify.c
+
+	Abstract:
+
+		Implements state change notifications for user mode.
+
+		IOCTL_TOUCH_POWER_NOTIFY requests are parked in a manual queue
+		on the test PDO and completed all at once whenever the digitizer
+		power state changes, so a client can wait for a change instead
+		of polling IOCTL_TOUCH_POWER_STATE.
+
+		The last change is kept as a record guarded by a sequence
+		count: the count is odd while the record is being written.
+		Changes are serialized by the transition engine, so there is
+		only ever one writer.
+
+	Environment:
+
+		Kernel mode
+
+	Revision History:
+
+--*/
+
+#include <internal.h>
+#include <power.h>
+#include <notify.h>
+#include <notify.tmh>
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, TchNotifyInitialize)
+#endif
+
+static VOID
+TchNotifyRead(
+	IN PTOUCH_POWER pDeviceContext,
+	OUT PTOUCH_POWER_NOTIFICATION Notification
+)
+{
+	LONG sequence;
+
+	for (;;)
+	{
+		sequence = ReadAcquire(&pDeviceContext->NotifySequence);
+
+		if ((sequence & 1) == 0)
+		{
+			Notification->State = (ULONG)pDeviceContext->NotifyState;
+			Notification->Cause = (ULONG)pDeviceContext->NotifyCause;
+			Notification->Timestamp = pDeviceContext->NotifyTimestamp;
+
+			KeMemoryBarrier();
+
+			if (ReadNoFence(&pDeviceContext->NotifySequence) == sequence)
+			{
+				break;
+			}
+		}
+
+		YieldProcessor();
+	}
+
+	Notification->Sequence = (ULONG)sequence / 2;
+	Notification->Reserved = 0;
+}
+
+static VOID
+TchNotifyDrain(
+	IN PTOUCH_POWER pDeviceContext
+)
+/*++
+
+Routine Description:
+
+	Completes every waiting notification request with the last state
+	change. May be called at DISPATCH_LEVEL.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+
+Return Value:
+
+	None
+
+--*/
+{
+	TOUCH_POWER_NOTIFICATION notification;
+	PTOUCH_POWER_NOTIFICATION pOutputBuffer;
+	WDFREQUEST request;
+	NTSTATUS status;
+
+	TchNotifyRead(pDeviceContext, &notification);
+
+	while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(
+		pDeviceContext->NotifyQueue,
+		&request)))
+	{
+		status = WdfRequestRetrieveOutputBuffer(
+			request,
+			sizeof(TOUCH_POWER_NOTIFICATION),
+			(PVOID*)&pOutputBuffer,
+			NULL);
+
+		if (!NT_SUCCESS(status))
+		{
+			WdfRequestComplete(request, status);
+			continue;
+		}
+
+		*pOutputBuffer = notification;
+
+		WdfRequestCompleteWithInformation(
+			request,
+			STATUS_SUCCESS,
+			sizeof(TOUCH_POWER_NOTIFICATION));
+	}
+}
+
+VOID
+TchNotifyStateChange(
+	IN PTOUCH_POWER pDeviceContext,
+	IN DWORD State,
+	IN ULONG Cause
+)
+/*++
+
+Routine Description:
+
+	Records a digitizer power state change and wakes up everyone
+	waiting for one. Called by the transition that made the change,
+	possibly at DISPATCH_LEVEL.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	State - New digitizer state, 1 for on, 0 for off
+	Cause - TOUCH_POWER_CAUSE of the change
+
+Return Value:
+
+	None
+
+--*/
+{
+	static TOUCH_TRACE_LIMIT traceLimit;
+
+	InterlockedIncrement(&pDeviceContext->NotifySequence);
+
+	pDeviceContext->NotifyState = (LONG)State;
+	pDeviceContext->NotifyCause = (LONG)Cause;
+	pDeviceContext->NotifyTimestamp = KeQueryInterruptTime();
+
+	InterlockedIncrement(&pDeviceContext->NotifySequence);
+
+	if (TraceAllowed(TRACE_LEVEL_INFORMATION, TRACE_POWER, &traceLimit))
+	{
+		Trace(
+			TRACE_LEVEL_INFORMATION,
+			TRACE_POWER,
+			"Digitizer state now %lu, cause %lu",
+			State,
+			Cause);
+	}
+
+	TchNotifyDrain(pDeviceContext);
+}
+
+NTSTATUS
+TchNotifySubmit(
+	IN PTOUCH_POWER pDeviceContext,
+	IN WDFREQUEST Request,
+	IN PULONG KnownSequence
+)
+/*++
+
+Routine Description:
+
+	Parks a notification request until the next state change. If the
+	client passed the sequence of the last change it saw and another
+	change happened since, the request is completed right away so
+	nothing is lost between two requests.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Request - Framework request object handle
+	KnownSequence - Sequence of the last change the client saw, or NULL
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	NTSTATUS status;
+	LONG sequence;
+	ULONG knownSequence = 0;
+
+	//
+	// The input shares the buffered I/O buffer with the output, and the
+	// request may be completed as soon as it is queued
+	//
+	if (KnownSequence != NULL)
+	{
+		knownSequence = *KnownSequence;
+	}
+
+	status = WdfRequestForwardToIoQueue(
+		Request,
+		pDeviceContext->NotifyQueue);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_POWER,
+			"Error forwarding request to notification queue - %!STATUS!",
+			status);
+
+		return status;
+	}
+
+	//
+	// Checked only once the request is queued, a change racing with us
+	// then either sees the request or is seen here
+	//
+	if (KnownSequence != NULL)
+	{
+		sequence = ReadAcquire(&pDeviceContext->NotifySequence);
+
+		if ((ULONG)sequence / 2 != knownSequence)
+		{
+			TchNotifyDrain(pDeviceContext);
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+TchNotifyInitialize(
+	IN WDFDEVICE Device,
+	IN WDFDEVICE ChildDevice
+)
+/*++
+
+Routine Description:
+
+	Creates the manual queue notification requests wait in. The queue
+	lives on the test PDO since requests are forwarded to it from the
+	PDO's default queue.
+
+Arguments:
+
+	Device - Framework device object representing the actual touch device
+	ChildDevice - Framework device object representing the test PDO
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	NTSTATUS status;
+	PTOUCH_POWER devContext;
+	WDF_IO_QUEUE_CONFIG queueConfig;
+
+	PAGED_CODE();
+
+	devContext = GetDeviceContext(Device);
+
+	devContext->NotifySequence = 0;
+	devContext->NotifyState = 0;
+	devContext->NotifyCause = TouchPowerCauseNone;
+	devContext->NotifyTimestamp = KeQueryInterruptTime();
+
+	WDF_IO_QUEUE_CONFIG_INIT(
+		&queueConfig,
+		WdfIoQueueDispatchManual);
+
+	queueConfig.PowerManaged = WdfFalse;
+
+	status = WdfIoQueueCreate(
+		ChildDevice,
+		&queueConfig,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&devContext->NotifyQueue);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating notification queue - %!STATUS!",
+			status);
+	}
+
+	return status;
+}
@@ -0,0 +1,198 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		policy.c
+
+	Abstract:
+
+		Platform-neutral power policy stage. Whoever carries out
+		transitions of the digitizer power gate asks the stage before
+		each one, and tells it once the digitizer actually was powered
+		on or off. The stage a policy uses is chosen when it is
+		initialized; the hysteresis stage here keeps a flickering
+		request (a power button tapped repeatedly, a proximity sensor
+		bouncing) from reaching the PEP as a string of on/off
+		transitions:
+
+		- a power-off is held back for OffDelayMs, and until the
+		  digitizer has been on for MinOnMs; a power-on in the meantime
+		  drops it
+		- a power-on is never held back, as someone is waiting for
+		  touch. One that comes in within MinOffMs of a power-off is
+		  counted as thrash.
+
+		Like the core, the stage only depends on coreplat.h, so the
+		same code runs in the driver and in the off-target tools.
+
+	Environment:
+
+		Kernel mode, or user mode off-target
+
+	Revision History:
+
+--*/
+
+#include <policy.h>
+
+#define TOUCH_POWER_POLICY_MS(ms)               ((ULONGLONG)(ms) * 10000)
+
+static ULONGLONG
+TchPolicyHysteresisAdmit(
+	IN PTOUCH_POWER_POLICY Policy,
+	IN BOOLEAN On
+)
+{
+	ULONGLONG now;
+	ULONGLONG due;
+	BOOLEAN first = FALSE;
+
+	if (On)
+	{
+		if (Policy->OffWanted)
+		{
+			Policy->OffWanted = FALSE;
+			InterlockedIncrement(&Policy->OffsSuppressed);
+		}
+
+		return 0;
+	}
+
+	if (Policy->State == FALSE)
+	{
+		return 0;
+	}
+
+	now = TchPlatQueryTime();
+
+	if (!Policy->OffWanted)
+	{
+		Policy->OffWanted = TRUE;
+		Policy->OffWantedSince = now;
+		first = TRUE;
+	}
+
+	due = Policy->OffWantedSince + TOUCH_POWER_POLICY_MS(Policy->Config.OffDelayMs);
+
+	if (Policy->State == TRUE &&
+		Policy->OnSince + TOUCH_POWER_POLICY_MS(Policy->Config.MinOnMs) > due)
+	{
+		due = Policy->OnSince + TOUCH_POWER_POLICY_MS(Policy->Config.MinOnMs);
+	}
+
+	if (now >= due)
+	{
+		Policy->OffWanted = FALSE;
+		return 0;
+	}
+
+	//
+	// Count a held power-off once, not every time it is asked about
+	//
+	if (first)
+	{
+		InterlockedIncrement(&Policy->OffsHeld);
+	}
+
+	return due;
+}
+
+static VOID
+TchPolicyHysteresisCommitted(
+	IN PTOUCH_POWER_POLICY Policy,
+	IN BOOLEAN On
+)
+{
+	ULONGLONG now = TchPlatQueryTime();
+
+	if (On)
+	{
+		if (Policy->State == FALSE &&
+			now - Policy->OffSince < TOUCH_POWER_POLICY_MS(Policy->Config.MinOffMs))
+		{
+			InterlockedIncrement(&Policy->Thrashes);
+		}
+
+		Policy->OnSince = now;
+	}
+	else
+	{
+		//
+		// Only possible for power-offs that did not go through the
+		// stage, such as P-state batches
+		//
+		if (Policy->State == TRUE &&
+			now - Policy->OnSince < TOUCH_POWER_POLICY_MS(Policy->Config.MinOnMs))
+		{
+			InterlockedIncrement(&Policy->Thrashes);
+		}
+
+		Policy->OffSince = now;
+		Policy->OffWanted = FALSE;
+	}
+
+	Policy->State = On;
+}
+
+const TOUCH_POWER_POLICY_STAGE TchPolicyHysteresis =
+{
+	TchPolicyHysteresisAdmit,
+	TchPolicyHysteresisCommitted
+};
+
+VOID
+TchPolicyInitialize(
+	OUT PTOUCH_POWER_POLICY Policy,
+	IN const TOUCH_POWER_POLICY_STAGE* Stage,
+	IN const TOUCH_POWER_POLICY_CONFIG* Config
+)
+{
+	Policy->Stage = Stage;
+	Policy->Config = *Config;
+	Policy->State = TOUCH_POWER_NO_TARGET;
+	Policy->OnSince = 0;
+	Policy->OffSince = 0;
+	Policy->OffWanted = FALSE;
+	Policy->OffWantedSince = 0;
+	Policy->OffsHeld = 0;
+	Policy->OffsSuppressed = 0;
+	Policy->Thrashes = 0;
+}
+
+ULONGLONG
+TchPolicyAdmit(
+	IN PTOUCH_POWER_POLICY Policy,
+	IN BOOLEAN On
+)
+/*++
+
+Routine Description:
+
+	Asks the policy stage whether a transition of the digitizer power
+	gate may go out now. Calls are serialized by the caller, along with
+	those to TchPolicyCommitted.
+
+Arguments:
+
+	Policy - Power policy
+	On - TRUE for a power-on, FALSE for a power-off
+
+Return Value:
+
+	0 if the transition may go out now, otherwise the interrupt time
+	(100ns units) to ask again at
+
+--*/
+{
+	return Policy->Stage->Admit(Policy, On);
+}
+
+VOID
+TchPolicyCommitted(
+	IN PTOUCH_POWER_POLICY Policy,
+	IN BOOLEAN On
+)
+{
+	Policy->Stage->Committed(Policy, On);
+}
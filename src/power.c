@@ -20,81 +20,189 @@
 
 --*/
 
-#include <internal.h>
+//
+// initguid.h has to come first: internal.h pulls in private\pep.h, and
+// GUID_POWER_CHANGE_P_STATE_V2 is instantiated in this module, as are
+// the GUIDs of power.h and direct.h.
+//
 #include <initguid.h>
+#include <internal.h>
 #include <devguid.h>
-#include <private\pep.h>
 #include <power.h>
+#include <transition.h>
+#include <idle.h>
+#include <notify.h>
+#include <stats.h>
+#include <recorder.h>
+#include <vote.h>
+#include <schedule.h>
+#include <direct.h>
+#include <setting.h>
 #include <power.tmh>
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, TchPowerInitialize)
+#pragma alloc_text(PAGE, TchPowerSelfManagedIoCleanup)
 #endif
 
-NTSTATUS
-TchPowerControl(
-	IN PTOUCH_POWER pDeviceContext,
-	IN DWORD pState
+static NTSTATUS
+TchPowerBackendRegisterDevice(
+	IN PVOID Context
 )
-{
-	STATE_RESULT_TYPE_V2* pepResult = NULL;
-	PEP_PSTATE_RESOURCE_NODE_V2* pepRequest = NULL;
-	NTSTATUS status;
-	SIZE_T bytesReturned;
+/*++
 
-	Trace(
-		TRACE_LEVEL_INFORMATION,
-		TRACE_INIT,
-		"--> TchPowerControl");
+Routine Description:
 
-	pepResult = (STATE_RESULT_TYPE_V2*)ExAllocatePoolWithTag(
-		NonPagedPool,
-		sizeof(STATE_RESULT_TYPE_V2),
-		TOUCH_POOL_TAG);
+	Registers the digitizer component with PoFx, along with its F-states
+	and the callbacks of idle.c, and starts runtime power management.
 
-	if (!pepResult)
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_INIT,
-			"Could not allocate PState result type v2");
+Arguments:
 
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
+	Context - Touch power device context
+
+Return Value:
+
+	NTSTATUS indicating success or failure
 
-	pepRequest = (PEP_PSTATE_RESOURCE_NODE_V2*)ExAllocatePoolWithTag(
-		NonPagedPool,
-		sizeof(PEP_PSTATE_RESOURCE_NODE_V2),
-		TOUCH_POOL_TAG);
+--*/
+{
+	PTOUCH_POWER pDeviceContext = (PTOUCH_POWER)Context;
+	NTSTATUS status = STATUS_SUCCESS;
+	PPO_FX_DEVICE poFxDevice = NULL;
+	PPO_FX_COMPONENT_IDLE_STATE pIdleStates = NULL;
 
-	if (!pepRequest)
+	poFxDevice = (PPO_FX_DEVICE)ExAllocatePoolWithTag(NonPagedPool, sizeof(PO_FX_DEVICE), TOUCH_POOL_TAG);
+	if (poFxDevice)
 	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_INIT,
-			"Could not allocate PState resource node v2");
+		RtlZeroMemory(poFxDevice, sizeof(PO_FX_DEVICE));
+		poFxDevice->Version = PO_FX_VERSION_V1;
+		poFxDevice->ComponentCount = 1;
+		poFxDevice->ComponentActiveConditionCallback = TchIdleOnComponentActive;
+		poFxDevice->ComponentIdleConditionCallback = TchIdleOnComponentIdle;
+		poFxDevice->ComponentIdleStateCallback = TchIdleOnComponentIdleState;
+		poFxDevice->DevicePowerRequiredCallback = TchIdleOnDevicePowerRequired;
+		poFxDevice->DevicePowerNotRequiredCallback = TchIdleOnDevicePowerNotRequired;
+		poFxDevice->PowerControlCallback = TchPowerControlCallback;
+		poFxDevice->DeviceContext = pDeviceContext;
+
+		pIdleStates = (PPO_FX_COMPONENT_IDLE_STATE)ExAllocatePoolWithTag(NonPagedPool, sizeof(PO_FX_COMPONENT_IDLE_STATE) * TouchPowerFStateCount, TOUCH_POOL_TAG);
+		poFxDevice->Components->IdleStates = pIdleStates;
+		if (pIdleStates == NULL)
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				TRACE_INIT,
+				"Can't allocate pool for PO_FX_COMPONENT_IDLE_STATE");
+
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			goto exit;
+		}
 
-		ExFreePoolWithTag(pepResult, TOUCH_POOL_TAG);
+		TchIdleFillStates(pDeviceContext, poFxDevice->Components->IdleStates);
+		poFxDevice->Components->IdleStateCount = TouchPowerFStateCount;
+
+		//
+		// The digitizer does not detect touches once it is powered off
+		//
+		poFxDevice->Components->DeepestWakeableIdleState = TouchPowerF0Active;
+
+		status = PoFxRegisterDevice(pDeviceContext->PhysicalDevice, poFxDevice, &pDeviceContext->PepHandle);
+		if (!NT_SUCCESS(status)) {
+			if (status == STATUS_DEVICE_NOT_READY)
+			{
+				Trace(TRACE_LEVEL_ERROR, TRACE_INIT, "PoFxRegisterDevice not ready");
+				goto exit;
+			}
+
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			Trace(TRACE_LEVEL_ERROR, TRACE_INIT, "PoFxRegisterDevice failed %!STATUS!", status);
+			goto exit;
+		}
+
+		PoFxStartDevicePowerManagement(pDeviceContext->PepHandle);
+		TchIdleStart(pDeviceContext);
+	}
 
-		return STATUS_INSUFFICIENT_RESOURCES;
+exit:
+	if (poFxDevice)
+	{
+		if (pIdleStates)
+			ExFreePoolWithTag(pIdleStates, TOUCH_POOL_TAG);
+		ExFreePoolWithTag(poFxDevice, TOUCH_POOL_TAG);
 	}
 
+	return status;
+}
+
+static NTSTATUS
+TchPowerBackendPowerControl(
+	IN PVOID Context,
+	IN PTOUCH_POWER_TRANSITION_SLOT pSlot,
+	IN const TOUCH_POWER_PSTATE_ENTRY* Entries,
+	IN ULONG Count,
+	OUT NTSTATUS* PepStatus
+)
+/*++
+
+Routine Description:
+
+	Sends a P-state request built by the core to the PEP through
+	PoFxPowerControl, using the request and result buffers of the slot.
+	The slot's UserData travels as pUserData and comes back with the
+	PEP's confirmation in TchPowerControlCallback.
+
+Arguments:
+
+	Context - Touch power device context
+	pSlot - Transition slot of the request
+	Entries - P-state per set to request
+	Count - Number of entries
+	PepStatus - Receives the result the PEP answered with
+
+Return Value:
+
+	NTSTATUS of the PoFxPowerControl call
+
+--*/
+{
+	static TOUCH_TRACE_LIMIT waitTraceLimit;
+	PTOUCH_POWER pDeviceContext = (PTOUCH_POWER)Context;
+	PTOUCH_POWER_PEP_SLOT pPepSlot = &pDeviceContext->PepSlots[pSlot->Index];
+	STATE_RESULT_TYPE_V2* pepResult = &pPepSlot->Result;
+	PEP_PSTATE_RESOURCE_NODE_V2* pepRequest = &pPepSlot->Request.Node;
+	NTSTATUS status;
+	SIZE_T bytesReturned;
+	ULONG i;
+
+	Trace(
+		TRACE_LEVEL_VERBOSE,
+		TRACE_INIT,
+		"--> TchPowerControl");
+
+	RtlZeroMemory(pepResult, sizeof(STATE_RESULT_TYPE_V2));
+
 	pepRequest->hdr.version = 2;
 	pepRequest->hdr.ComponentIndex = 0;
 	pepRequest->hdr.PStateRequestType = PEP_PSTATE_SET_REQUEST;
-	pepRequest->hdr.pUserData = NULL;
-	pepRequest->PStateData->PStateIndex = pState;
-	pepRequest->PStateData->PStateSetIndex = 0;
+	pepRequest->hdr.pUserData = pSlot->UserData;
+
+	for (i = 0; i < Count; i++)
+	{
+		pepRequest->PStateData[i].PStateSetIndex = Entries[i].SetIndex;
+		pepRequest->PStateData[i].PStateIndex = Entries[i].PStateIndex;
+	}
 
 	status = PoFxPowerControl(
 		pDeviceContext->PepHandle,
 		&GUID_POWER_CHANGE_P_STATE_V2,
 		pepRequest,
-		sizeof(PEP_PSTATE_RESOURCE_NODE_V2),
+		FIELD_OFFSET(PEP_PSTATE_RESOURCE_NODE_V2, PStateData) + Count * sizeof(PStateSetRequestSt),
 		pepResult,
 		sizeof(STATE_RESULT_TYPE_V2),
 		&bytesReturned);
 
+	*PepStatus = pepResult->hdr.status;
+
 	if (!NT_SUCCESS(status))
 	{
 		switch (status)
@@ -117,231 +225,906 @@ TchPowerControl(
 				TRACE_INIT,
 				"TchPowerControl: Unknown error");
 		}
-
-		ExFreePoolWithTag(pepResult, TOUCH_POOL_TAG);
-		ExFreePoolWithTag(pepRequest, TOUCH_POOL_TAG);
-
-		return status;
-	}
-
-	if (pepResult->hdr.status == STATUS_WAIT_3)
-	{
-		Trace(
-			TRACE_LEVEL_INFORMATION,
-			TRACE_INIT,
-			"TchPowerControl: STATUS_WAIT_3");
 	}
-	else if (pepResult->hdr.status == STATUS_WAIT_1)
+	else if (*PepStatus == STATUS_WAIT_3 || *PepStatus == STATUS_WAIT_1)
 	{
-		Trace(
-			TRACE_LEVEL_INFORMATION,
-			TRACE_INIT,
-			"TchPowerControl: STATUS_WAIT_1");
-	}
+		if (TraceAllowed(TRACE_LEVEL_INFORMATION, TRACE_POWER, &waitTraceLimit))
+		{
+			Trace(
+				TRACE_LEVEL_INFORMATION,
+				TRACE_POWER,
+				"TchPowerControl: PEP returned %!STATUS!, waiting for confirmation",
+				*PepStatus);
+		}
 
-	ExFreePoolWithTag(pepRequest, TOUCH_POOL_TAG);
-	ExFreePoolWithTag(pepResult, TOUCH_POOL_TAG);
+		TchStatsRecordWait(pDeviceContext, *PepStatus);
+	}
 
 	Trace(
-		TRACE_LEVEL_INFORMATION,
+		TRACE_LEVEL_VERBOSE,
 		TRACE_INIT,
 		"<-- TchPowerControl");
 
 	return status;
 }
 
-NTSTATUS
-TchPowerSelfManagedIoStart(
-	IN PTOUCH_POWER pDeviceContext
+static VOID
+TchPowerBackendStartWatchdog(
+	IN PVOID Context,
+	IN PTOUCH_POWER_TRANSITION_SLOT pSlot,
+	IN ULONG TimeoutMs
 )
 {
-	NTSTATUS status = STATUS_SUCCESS;
-	PPO_FX_DEVICE poFxDevice = NULL;
-	PPO_FX_COMPONENT_IDLE_STATE pIdleStates = NULL;
+	PTOUCH_POWER pDeviceContext = (PTOUCH_POWER)Context;
 
-	Trace(
-		TRACE_LEVEL_INFORMATION,
-		TRACE_INIT,
-		"--> TchPowerSelfManagedIoStart");
+	WdfTimerStart(
+		pDeviceContext->PepSlots[pSlot->Index].Watchdog,
+		WDF_REL_TIMEOUT_IN_MS(TimeoutMs));
+}
 
-	poFxDevice = (PPO_FX_DEVICE)ExAllocatePoolWithTag(NonPagedPool, sizeof(PO_FX_DEVICE), TOUCH_POOL_TAG);
-	if (poFxDevice)
-	{
-		RtlZeroMemory(poFxDevice, sizeof(PO_FX_DEVICE));
-		poFxDevice->Version = PO_FX_VERSION_V1;
-		poFxDevice->ComponentCount = 1;
-		poFxDevice->ComponentActiveConditionCallback = NULL;
-		poFxDevice->ComponentIdleConditionCallback = NULL;
-		poFxDevice->ComponentIdleStateCallback = NULL;
-		poFxDevice->DevicePowerRequiredCallback = NULL;
-		poFxDevice->DevicePowerNotRequiredCallback = NULL;
-		poFxDevice->PowerControlCallback = NULL;
-		poFxDevice->DeviceContext = NULL;
-
-		pIdleStates = (PPO_FX_COMPONENT_IDLE_STATE)ExAllocatePoolWithTag(NonPagedPool, sizeof(PO_FX_COMPONENT_IDLE_STATE), TOUCH_POOL_TAG);
-		poFxDevice->Components->IdleStates = pIdleStates;
-		if (pIdleStates == NULL)
-		{
-			Trace(
-				TRACE_LEVEL_ERROR,
-				TRACE_INIT,
-				"Can't allocate pool for PO_FX_COMPONENT_IDLE_STATE");
+static VOID
+TchPowerBackendStopWatchdog(
+	IN PVOID Context,
+	IN PTOUCH_POWER_TRANSITION_SLOT pSlot
+)
+{
+	PTOUCH_POWER pDeviceContext = (PTOUCH_POWER)Context;
 
-			status = STATUS_INSUFFICIENT_RESOURCES;
-			goto exit;
-		}
+	WdfTimerStop(pDeviceContext->PepSlots[pSlot->Index].Watchdog, FALSE);
+}
 
-		RtlZeroMemory(poFxDevice->Components->IdleStates, sizeof(PO_FX_COMPONENT_IDLE_STATE));
-		poFxDevice->Components->IdleStateCount = 1;
-		poFxDevice->Components->IdleStates[0].NominalPower = PO_FX_UNKNOWN_POWER;
-		poFxDevice->Components->IdleStates[0].ResidencyRequirement = 0;
-		poFxDevice->Components->DeepestWakeableIdleState = 0;
+static VOID
+TchPowerBackendTransitionCommitted(
+	IN PVOID Context,
+	IN PTOUCH_POWER_TRANSITION_SLOT pSlot,
+	IN NTSTATUS Status,
+	IN BOOLEAN StateChanged
+)
+/*++
 
-		status = PoFxRegisterDevice(pDeviceContext->PhysicalDevice, poFxDevice, &pDeviceContext->PepHandle);
-		if (!NT_SUCCESS(status)) {
-			if (status == STATUS_DEVICE_NOT_READY)
-			{
-				Trace(TRACE_LEVEL_ERROR, TRACE_INIT, "PoFxRegisterDevice not ready");
-				goto exit;
-			}
+Routine Description:
 
-			status = STATUS_INSUFFICIENT_RESOURCES;
-			Trace(TRACE_LEVEL_ERROR, TRACE_INIT, "PoFxRegisterDevice failed %!STATUS!", status);
-			goto exit;
-		}
+	Accounts for a transition the core has published and wakes up
+	clients waiting for a state change.
 
-		PoFxStartDevicePowerManagement(pDeviceContext->PepHandle);
-		PoFxActivateComponent(pDeviceContext->PepHandle, 0, PO_FX_FLAG_BLOCKING);
+Arguments:
+
+	Context - Touch power device context
+	pSlot - Transition slot
+	Status - Outcome of the transition
+	StateChanged - Whether the digitizer power state changed
+
+Return Value:
+
+	None
+
+--*/
+{
+	PTOUCH_POWER pDeviceContext = (PTOUCH_POWER)Context;
+
+	TchStatsRecordTransition(pDeviceContext, pSlot, Status);
+
+	if (NT_SUCCESS(Status) && pSlot->Target.PStates[0] != TOUCH_POWER_NO_TARGET)
+	{
+		TchStatsEnterState(
+			pDeviceContext,
+			TouchPowerResidencyPState,
+			(ULONG)pSlot->Target.PStates[0]);
 	}
 
-exit:
-	if (poFxDevice)
+	TchRecorderLog(pDeviceContext, pSlot, Status);
+
+	if (StateChanged)
 	{
-		if (pIdleStates)
-			ExFreePoolWithTag(pIdleStates, TOUCH_POOL_TAG);
-		ExFreePoolWithTag(poFxDevice, TOUCH_POOL_TAG);
+		TchPolicyCommitted(
+			&pDeviceContext->Policy,
+			pSlot->Target.PStates[0] != TOUCH_POWER_PSTATE_OFF);
+
+		TchNotifyStateChange(
+			pDeviceContext,
+			TchPowerGetState(pDeviceContext),
+			pSlot->Cause);
 	}
+}
 
-	Trace(
-		TRACE_LEVEL_INFORMATION,
-		TRACE_INIT,
-		"<-- TchPowerSelfManagedIoStart");
+static VOID
+TchPowerBackendCompleteRequest(
+	IN PVOID Context,
+	IN PVOID Request,
+	IN NTSTATUS Status
+)
+{
+	static TOUCH_TRACE_LIMIT traceLimit;
+	PTOUCH_POWER pDeviceContext = (PTOUCH_POWER)Context;
 
-	return status;
+	if (TraceAllowed(TRACE_LEVEL_INFORMATION, TRACE_POWER, &traceLimit))
+	{
+		Trace(
+			TRACE_LEVEL_INFORMATION,
+			TRACE_POWER,
+			"Pending transition settled - %!STATUS!",
+			Status);
+	}
+
+	TchTransitionComplete(pDeviceContext, (WDFREQUEST)Request, Status);
+}
+
+//
+// The driver's side of the power core: PoFx for the PEP, WDF timers for
+// the watchdogs and the transition engine for request completion
+//
+static const TOUCH_POWER_CORE_BACKEND TchPowerBackend =
+{
+	TchPowerBackendRegisterDevice,
+	TchPowerBackendPowerControl,
+	TchPowerBackendStartWatchdog,
+	TchPowerBackendStopWatchdog,
+	TchPowerBackendTransitionCommitted,
+	TchPowerBackendCompleteRequest
+};
+
+DWORD
+TchPowerGetState(
+	IN PTOUCH_POWER pDeviceContext
+)
+/*++
+
+Routine Description:
+
+	Returns the digitizer state as reported to clients. Callers that
+	act on it treat anything but 0 as possibly on.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+
+Return Value:
+
+	1 if the digitizer is on, 0 if it is off, TOUCH_POWER_PSTATE_UNKNOWN
+	if the driver does not know
+
+--*/
+{
+	DWORD state = TchCoreGetState(&pDeviceContext->Core);
+
+	return (state == TOUCH_POWER_STATE_UNKNOWN) ? TOUCH_POWER_PSTATE_UNKNOWN : state;
 }
 
 VOID
-TchPowerOnDeviceControl(
-	IN WDFQUEUE Queue,
-	IN WDFREQUEST Request,
-	IN size_t OutputBufferLength,
-	IN size_t InputBufferLength,
-	IN ULONG IoControlCode
+TchPowerOnWatchdog(
+	IN WDFTIMER Timer
 )
 /*++
 
 Routine Description:
 
-	This dispatch routine allows a user-mode application to issue test
-	requests to the driver for execution on the chip and reporting of
-	results.
+	Lets the core fail a pending transition the PEP did not confirm in
+	time.
 
 Arguments:
 
-	Queue - Framework queue object handle
-	Request - Framework request object handle
-	OutputBufferLength - self-explanatory
-	InputBufferLength - self-explanatory
-	IoControlCode - Specifies what is being requested
+	Timer - Watchdog timer of the transition slot
 
 Return Value:
 
-	NTSTATUS indicating success or failure
+	None
 
 --*/
 {
 	PTOUCH_POWER devContext;
-	NTSTATUS status = STATUS_INVALID_PARAMETER;
 
-	UCHAR* pInputBuffer = NULL;
-	UCHAR* pOutputBuffer = NULL;
-	size_t dOutputLength = 0;
-	size_t dInputLength = 0;
+	devContext = GetDeviceContext(WdfTimerGetParentObject(Timer));
+
+	if (TchCoreOnWatchdog(&devContext->Core, GetWatchdogContext(Timer)->Slot))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_POWER,
+			"PEP did not confirm transition in time");
+	}
+}
+
+NTSTATUS
+TchPowerControlCallback(
+	IN PVOID DeviceContext,
+	IN LPCGUID PowerControlCode,
+	IN PVOID InBuffer,
+	IN SIZE_T InBufferSize,
+	OUT PVOID OutBuffer,
+	IN SIZE_T OutBufferSize,
+	OUT PSIZE_T BytesReturned
+)
+/*++
+
+Routine Description:
+
+	Receives the PEP's confirmation for a transition it earlier answered
+	with STATUS_WAIT_1 or STATUS_WAIT_3. The result carries back the
+	pUserData of the request, which tells the core the transition slot
+	and which of its transitions the confirmation is for.
+
+Arguments:
+
+	DeviceContext - Touch power device context, as registered with PoFx
+	PowerControlCode - Power control operation
+	InBuffer - STATE_RESULT_TYPE_V2 for GUID_POWER_CHANGE_P_STATE_V2
+	InBufferSize - Size of InBuffer
+	OutBuffer - Unused
+	OutBufferSize - Unused
+	BytesReturned - Unused
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	PTOUCH_POWER devContext = (PTOUCH_POWER)DeviceContext;
+	STATE_RESULT_TYPE_V2* pepResult;
+	NTSTATUS status;
+
+	UNREFERENCED_PARAMETER(OutBuffer);
+	UNREFERENCED_PARAMETER(OutBufferSize);
+
+	if (BytesReturned != NULL)
+	{
+		*BytesReturned = 0;
+	}
+
+	if (!IsEqualGUID(PowerControlCode, &GUID_POWER_CHANGE_P_STATE_V2))
+	{
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	if (InBuffer == NULL || InBufferSize < sizeof(STATE_RESULT_TYPE_V2))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pepResult = (STATE_RESULT_TYPE_V2*)InBuffer;
+
+	TchStatsRecordWait(devContext, pepResult->hdr.status);
+
+	status = TchCoreConfirm(
+		&devContext->Core,
+		pepResult->hdr.pUserData,
+		pepResult->hdr.status);
+
+	if (status == STATUS_NOT_FOUND)
+	{
+		Trace(
+			TRACE_LEVEL_WARNING,
+			TRACE_POWER,
+			"PEP confirmed a transition that was settled already - %!STATUS!",
+			pepResult->hdr.status);
+
+		status = STATUS_SUCCESS;
+	}
+	else if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_POWER,
+			"PEP confirmed an unknown transition");
+	}
+
+	return status;
+}
+
+NTSTATUS
+TchPowerSetPStates(
+	IN PTOUCH_POWER pDeviceContext,
+	IN PTOUCH_POWER_PSTATE_VECTOR Target,
+	IN WDFREQUEST Request,
+	IN ULONG Cause
+)
+/*++
+
+Routine Description:
+
+	Moves the digitizer to the requested P-states through the power
+	core, see TchCoreSetPStates.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Target - P-state per set, at least one set must be targeted
+	Request - Request to complete if the transition ends up pending
+	Cause - TOUCH_POWER_CAUSE reported if the power state changes
+
+Return Value:
+
+	STATUS_PENDING if the PEP has not confirmed the transition yet;
+	Request is then completed through TchTransitionComplete. Any other
+	status is the final outcome and Request is left to the caller.
+
+--*/
+{
+	static TOUCH_TRACE_LIMIT traceLimit;
+	NTSTATUS status;
+
+	status = TchCoreSetPStates(
+		&pDeviceContext->Core,
+		Target,
+		Request,
+		Cause,
+		(Request != NULL) ?
+			IoGetRequestorProcessId(WdfRequestWdmGetIrp(Request)) :
+			0);
+
+	if (status == STATUS_DEVICE_BUSY)
+	{
+		Trace(
+			TRACE_LEVEL_WARNING,
+			TRACE_POWER,
+			"TchPowerSetPStates: Another transition is in flight");
+	}
+	else if (status == STATUS_INSUFFICIENT_RESOURCES)
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_POWER,
+			"No free PState transition buffer");
+	}
+	else if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_POWER,
+			"TchPowerSetPStates: Transition failed - %!STATUS!",
+			status);
+	}
+	else if (status != STATUS_PENDING &&
+		TraceAllowed(TRACE_LEVEL_INFORMATION, TRACE_POWER, &traceLimit))
+	{
+		Trace(
+			TRACE_LEVEL_INFORMATION,
+			TRACE_POWER,
+			"TchPowerSetPStates: Transition done, set 0 now %d",
+			pDeviceContext->Core.PStateCache[0]);
+	}
+
+	return status;
+}
+
+static NTSTATUS
+TchPowerCreateWatchdogs(
+	IN WDFDEVICE Device
+)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	PTOUCH_POWER devContext;
+	WDF_TIMER_CONFIG timerConfig;
+	WDF_OBJECT_ATTRIBUTES timerAttributes;
+	ULONG i;
+
+	devContext = GetDeviceContext(Device);
+
+	for (i = 0; i < TOUCH_POWER_MAX_TRANSITIONS; i++)
+	{
+		WDF_TIMER_CONFIG_INIT(&timerConfig, TchPowerOnWatchdog);
+
+		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(
+			&timerAttributes,
+			TOUCH_POWER_WATCHDOG);
+
+		timerAttributes.ParentObject = Device;
+
+		status = WdfTimerCreate(
+			&timerConfig,
+			&timerAttributes,
+			&devContext->PepSlots[i].Watchdog);
+
+		if (!NT_SUCCESS(status))
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				TRACE_INIT,
+				"Error creating transition watchdog - %!STATUS!",
+				status);
+
+			break;
+		}
+
+		GetWatchdogContext(devContext->PepSlots[i].Watchdog)->Slot =
+			&devContext->Core.Slots[i];
+	}
+
+	return status;
+}
+
+NTSTATUS
+TchPowerSelfManagedIoStart(
+	IN PTOUCH_POWER pDeviceContext
+)
+{
+	NTSTATUS status;
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_INIT,
+		"--> TchPowerSelfManagedIoStart");
+
+	status = TchCoreRegisterDevice(&pDeviceContext->Core);
+
+	//
+	// The display notifications may power the digitizer off, which
+	// takes the device being registered with PoFx
+	//
+	if (NT_SUCCESS(status))
+	{
+		TchSettingRegister(pDeviceContext);
+	}
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_INIT,
+		"<-- TchPowerSelfManagedIoStart");
+
+	return status;
+}
+
+VOID
+TchPowerSelfManagedIoCleanup(
+	IN PTOUCH_POWER pDeviceContext
+)
+{
+	PAGED_CODE();
+
+	TchSettingUnregister(pDeviceContext);
+
+	//
+	// The PoFx callbacks carry the device context, which does not
+	// outlive the device
+	//
+	TchIdleStop(pDeviceContext);
+}
+
+VOID
+TchPowerOnDeviceControl(
+	IN WDFQUEUE Queue,
+	IN WDFREQUEST Request,
+	IN size_t OutputBufferLength,
+	IN size_t InputBufferLength,
+	IN ULONG IoControlCode
+)
+/*++
+
+Routine Description:
+
+	This dispatch routine allows a user-mode application to issue test
+	requests to the driver for execution on the chip and reporting of
+	results.
+
+Arguments:
+
+	Queue - Framework queue object handle
+	Request - Framework request object handle
+	OutputBufferLength - self-explanatory
+	InputBufferLength - self-explanatory
+	IoControlCode - Specifies what is being requested
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	PTOUCH_POWER devContext;
+	NTSTATUS status = STATUS_INVALID_PARAMETER;
+
+	UCHAR* pInputBuffer = NULL;
+	UCHAR* pOutputBuffer = NULL;
+	size_t dOutputLength = 0;
+	size_t dInputLength = 0;
+	TOUCH_POWER_PSTATE_VECTOR target;
+
+	devContext = GetDeviceContext(WdfPdoGetParent(WdfIoQueueGetDevice(Queue)));
+
+	if (devContext == NULL)
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"TchPowerOnDeviceControl: Could not get context");
+
+		status = STATUS_INVALID_HANDLE;
+
+		WdfRequestComplete(
+			Request,
+			status);
+
+		return;
+	}
+
+	if (InputBufferLength != 0)
+	{
+		status = WdfRequestRetrieveInputBuffer(
+			Request,
+			InputBufferLength,
+			&pInputBuffer,
+			&dInputLength);
+
+		if (!NT_SUCCESS(status) || pInputBuffer == NULL)
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				TRACE_INIT,
+				"TchPowerOnDeviceControl: Could not get input buffer");
+
+			WdfRequestComplete(
+				Request,
+				status);
+
+			return;
+		}
+	}
+
+	if (OutputBufferLength != 0)
+	{
+		status = WdfRequestRetrieveOutputBuffer(
+			Request,
+			OutputBufferLength,
+			&pOutputBuffer,
+			&dOutputLength);
+
+		if (!NT_SUCCESS(status) || pOutputBuffer == NULL)
+		{
+			Trace(
+				TRACE_LEVEL_ERROR,
+				TRACE_INIT,
+				"TchPowerOnDeviceControl: Could not get output buffer");
+
+			WdfRequestComplete(
+				Request,
+				status);
+
+			return;
+		}
+	}
+
+	switch (IoControlCode)
+	{
+	case IOCTL_TOUCH_POWER_RESET:
+	{
+		Trace(
+			TRACE_LEVEL_VERBOSE,
+			TRACE_INIT,
+			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_RESET");
+
+		if (dOutputLength < sizeof(DWORD))
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
+			WdfRequestComplete(
+				Request,
+				status);
+
+			return;
+		}
+
+		*(DWORD*)pOutputBuffer = 0x10000;
+
+		WdfRequestCompleteWithInformation(
+			Request,
+			status,
+			0);
+
+		return;
+	}
+	case IOCTL_TOUCH_POWER_TOGGLE:
+	{
+		Trace(
+			TRACE_LEVEL_VERBOSE,
+			TRACE_INIT,
+			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_TOGGLE");
+
+		if (dInputLength < sizeof(DWORD))
+		{
+			Trace(
+				TRACE_LEVEL_WARNING,
+				TRACE_INIT,
+				"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_TOGGLE STATUS_BUFFER_TOO_SMALL");
+
+			status = STATUS_BUFFER_TOO_SMALL;
+			WdfRequestComplete(
+				Request,
+				status);
+
+			return;
+		}
+
+		if (!NT_SUCCESS(TchCoreVectorFromState(*pInputBuffer, &target)))
+		{
+			Trace(
+				TRACE_LEVEL_WARNING,
+				TRACE_INIT,
+				"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_TOGGLE Unknown state");
+
+			WdfRequestComplete(
+				Request,
+				status);
+
+			return;
+		}
+
+		//
+		// The transition engine owns the request from here on and
+		// completes it once the PEP is done with the transition
+		//
+		status = TchTransitionSubmit(devContext, Request, &target);
+		if (!NT_SUCCESS(status))
+		{
+			WdfRequestComplete(
+				Request,
+				status);
+		}
+
+		return;
+	}
+	case IOCTL_TOUCH_POWER_STATE:
+	{
+		Trace(
+			TRACE_LEVEL_VERBOSE,
+			TRACE_INIT,
+			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_STATE");
+
+		if (dOutputLength >= sizeof(DWORD))
+		{
+			*(DWORD*)pOutputBuffer = TchPowerGetState(devContext);
+
+			Trace(
+				TRACE_LEVEL_VERBOSE,
+				TRACE_INIT,
+				"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_STATE success");
+
+			WdfRequestCompleteWithInformation(
+				Request,
+				status,
+				0);
+
+			return;
+		}
+		status = STATUS_BUFFER_TOO_SMALL;
+		WdfRequestComplete(
+			Request,
+			status);
+
+		return;
+	}
+	case IOCTL_TOUCH_POWER_SET_PSTATES:
+	{
+		PTOUCH_POWER_PSTATES pPStates;
+		ULONG i;
+
+		Trace(
+			TRACE_LEVEL_VERBOSE,
+			TRACE_INIT,
+			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_SET_PSTATES");
+
+		if (dInputLength < sizeof(TOUCH_POWER_PSTATES))
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
+			WdfRequestComplete(
+				Request,
+				status);
+
+			return;
+		}
+
+		pPStates = (PTOUCH_POWER_PSTATES)pInputBuffer;
+
+		for (i = 0; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+		{
+			target.PStates[i] = TOUCH_POWER_NO_TARGET;
+		}
+
+		status = STATUS_INVALID_PARAMETER;
+
+		if (pPStates->Count == 0 || pPStates->Count > TOUCH_POWER_MAX_PSTATE_SETS)
+		{
+			WdfRequestComplete(
+				Request,
+				status);
+
+			return;
+		}
+
+		for (i = 0; i < pPStates->Count; i++)
+		{
+			if (pPStates->Entries[i].SetIndex >= TOUCH_POWER_MAX_PSTATE_SETS ||
+				pPStates->Entries[i].PStateIndex > MAXLONG ||
+				target.PStates[pPStates->Entries[i].SetIndex] != TOUCH_POWER_NO_TARGET)
+			{
+				Trace(
+					TRACE_LEVEL_WARNING,
+					TRACE_INIT,
+					"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_SET_PSTATES bad entry %lu",
+					i);
+
+				WdfRequestComplete(
+					Request,
+					status);
+
+				return;
+			}
+
+			target.PStates[pPStates->Entries[i].SetIndex] = (LONG)pPStates->Entries[i].PStateIndex;
+		}
+
+		status = TchTransitionSubmit(devContext, Request, &target);
+		if (!NT_SUCCESS(status))
+		{
+			WdfRequestComplete(
+				Request,
+				status);
+		}
+
+		return;
+	}
+	case IOCTL_TOUCH_POWER_BATCH:
+	{
+		PTOUCH_POWER_BATCH pBatch;
+		size_t batchLength;
+		ULONG i;
+
+		Trace(
+			TRACE_LEVEL_VERBOSE,
+			TRACE_INIT,
+			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_BATCH");
+
+		if (dInputLength < FIELD_OFFSET(TOUCH_POWER_BATCH, Entries))
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
+			WdfRequestComplete(
+				Request,
+				status);
+
+			return;
+		}
+
+		//
+		// Buffered I/O, input and output share the system buffer and the
+		// results are written over the entries they belong to
+		//
+		pBatch = (PTOUCH_POWER_BATCH)pInputBuffer;
+
+		if (pBatch->Count == 0 || pBatch->Count > TOUCH_POWER_MAX_BATCH_ENTRIES)
+		{
+			status = STATUS_INVALID_PARAMETER;
+			WdfRequestComplete(
+				Request,
+				status);
+
+			return;
+		}
+
+		batchLength = FIELD_OFFSET(TOUCH_POWER_BATCH, Entries) +
+			pBatch->Count * sizeof(TOUCH_POWER_BATCH_ENTRY);
+
+		if (dInputLength < batchLength || dOutputLength < batchLength)
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
+			WdfRequestComplete(
+				Request,
+				status);
+
+			return;
+		}
+
+		for (i = 0; i < pBatch->Count; i++)
+		{
+			if (pBatch->Entries[i].SetIndex >= TOUCH_POWER_MAX_PSTATE_SETS ||
+				pBatch->Entries[i].PStateIndex > MAXLONG ||
+				pBatch->Entries[i].TimeUs > TOUCH_POWER_MAX_BATCH_TIME_US ||
+				(pBatch->Entries[i].Flags & ~TOUCH_POWER_BATCH_DEADLINE) != 0)
+			{
+				Trace(
+					TRACE_LEVEL_WARNING,
+					TRACE_INIT,
+					"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_BATCH bad entry %lu",
+					i);
 
-	devContext = GetDeviceContext(WdfPdoGetParent(WdfIoQueueGetDevice(Queue)));
+				status = STATUS_INVALID_PARAMETER;
+				WdfRequestComplete(
+					Request,
+					status);
 
-	if (devContext == NULL)
-	{
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_INIT,
-			"TchPowerOnDeviceControl: Could not get context");
+				return;
+			}
 
-		status = STATUS_INVALID_HANDLE;
+			pBatch->Entries[i].Status = STATUS_PENDING;
+			pBatch->Entries[i].Reserved = 0;
+			pBatch->Entries[i].StartTime = 0;
+			pBatch->Entries[i].EndTime = 0;
+		}
 
-		WdfRequestComplete(
-			Request,
-			status);
+		status = TchTransitionSubmitBatch(devContext, Request, pBatch);
+		if (!NT_SUCCESS(status))
+		{
+			WdfRequestComplete(
+				Request,
+				status);
+		}
 
 		return;
 	}
-
-	if (InputBufferLength != 0)
+	case IOCTL_TOUCH_POWER_NOTIFY:
 	{
-		status = WdfRequestRetrieveInputBuffer(
-			Request,
-			InputBufferLength,
-			&pInputBuffer,
-			&dInputLength);
+		Trace(
+			TRACE_LEVEL_VERBOSE,
+			TRACE_INIT,
+			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_NOTIFY");
 
-		if (!NT_SUCCESS(status) || pInputBuffer == NULL)
+		if (dOutputLength < sizeof(TOUCH_POWER_NOTIFICATION))
 		{
-			Trace(
-				TRACE_LEVEL_ERROR,
-				TRACE_INIT,
-				"TchPowerOnDeviceControl: Could not get input buffer");
-
+			status = STATUS_BUFFER_TOO_SMALL;
 			WdfRequestComplete(
 				Request,
 				status);
 
 			return;
 		}
-	}
 
-	if (OutputBufferLength != 0)
-	{
-		status = WdfRequestRetrieveOutputBuffer(
+		status = TchNotifySubmit(
+			devContext,
 			Request,
-			OutputBufferLength,
-			&pOutputBuffer,
-			&dOutputLength);
+			(dInputLength >= sizeof(ULONG)) ? (PULONG)pInputBuffer : NULL);
 
-		if (!NT_SUCCESS(status) || pOutputBuffer == NULL)
+		if (!NT_SUCCESS(status))
 		{
-			Trace(
-				TRACE_LEVEL_ERROR,
-				TRACE_INIT,
-				"TchPowerOnDeviceControl: Could not get output buffer");
+			WdfRequestComplete(
+				Request,
+				status);
+		}
+
+		return;
+	}
+	case IOCTL_TOUCH_POWER_GET_PSTATES:
+	{
+		PTOUCH_POWER_PSTATES pPStates;
+		LONG pState;
+		ULONG i;
 
+		if (dOutputLength < sizeof(TOUCH_POWER_PSTATES))
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
 			WdfRequestComplete(
 				Request,
 				status);
 
 			return;
 		}
-	}
 
-	switch (IoControlCode)
-	{
-	case IOCTL_TOUCH_POWER_RESET:
+		pPStates = (PTOUCH_POWER_PSTATES)pOutputBuffer;
+		pPStates->Count = TOUCH_POWER_MAX_PSTATE_SETS;
+
+		for (i = 0; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+		{
+			pState = ReadNoFence(&devContext->Core.PStateCache[i]);
+
+			pPStates->Entries[i].SetIndex = i;
+			pPStates->Entries[i].PStateIndex = (pState == TOUCH_POWER_NO_TARGET) ?
+				TOUCH_POWER_PSTATE_UNKNOWN :
+				(ULONG)pState;
+		}
+
+		WdfRequestCompleteWithInformation(
+			Request,
+			STATUS_SUCCESS,
+			sizeof(TOUCH_POWER_PSTATES));
+
+		return;
+	}
+	case IOCTL_TOUCH_POWER_COUNTERS:
 	{
+		PTOUCH_POWER_COUNTERS pCounters;
+
 		Trace(
-			TRACE_LEVEL_ERROR,
+			TRACE_LEVEL_VERBOSE,
 			TRACE_INIT,
-			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_RESET");
+			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_COUNTERS");
 
-		if (dOutputLength < sizeof(DWORD))
+		if (dOutputLength < sizeof(TOUCH_POWER_COUNTERS))
 		{
 			status = STATUS_BUFFER_TOO_SMALL;
 			WdfRequestComplete(
@@ -351,29 +1134,46 @@ Return Value:
 			return;
 		}
 
-		*(DWORD*)pOutputBuffer = 0x10000;
+		pCounters = (PTOUCH_POWER_COUNTERS)pOutputBuffer;
+		RtlZeroMemory(pCounters, sizeof(TOUCH_POWER_COUNTERS));
+
+		pCounters->Size = sizeof(TOUCH_POWER_COUNTERS);
+		pCounters->TransitionSlotExhausted = (ULONG)ReadNoFence(&devContext->Core.SlotExhausted);
+		pCounters->TransitionsRequested = (ULONG)ReadNoFence(&devContext->TransitionsRequested);
+		pCounters->TransitionsIssued = (ULONG)ReadNoFence(&devContext->TransitionsIssued);
+		pCounters->TransitionsElided = (ULONG)ReadNoFence(&devContext->TransitionsElided);
+		pCounters->TransitionsCoalesced = (ULONG)ReadNoFence(&devContext->TransitionsCoalesced);
+		pCounters->IdlePowerDowns = (ULONG)ReadNoFence(&devContext->IdlePowerDowns);
+		pCounters->VotesCast = (ULONG)ReadNoFence(&devContext->VotesCast);
+		pCounters->VoteOutcomeChanges = (ULONG)ReadNoFence(&devContext->VoteOutcomeChanges);
+		pCounters->PowerOffsHeld = (ULONG)ReadNoFence(&devContext->Policy.OffsHeld);
+		pCounters->PowerOffsSuppressed = (ULONG)ReadNoFence(&devContext->Policy.OffsSuppressed);
+		pCounters->ThrashEvents = (ULONG)ReadNoFence(&devContext->Policy.Thrashes);
+		pCounters->PowerOffsPreempted = (ULONG)ReadNoFence(&devContext->TransitionsPreempted);
+		pCounters->DisplayOffs = (ULONG)ReadNoFence(&devContext->Display.DisplayOffs);
+		pCounters->DisplayPowerOffs = (ULONG)ReadNoFence(&devContext->Display.PowerOffs);
+		pCounters->DisplayOffsCancelled = (ULONG)ReadNoFence(&devContext->Display.OffsCancelled);
+		pCounters->LateConfirmations = (ULONG)ReadNoFence(&devContext->Core.LateConfirmations);
+		pCounters->InternalTargetsReplaced = (ULONG)ReadNoFence(&devContext->TransitionsInternalReplaced);
 
 		WdfRequestCompleteWithInformation(
 			Request,
-			status,
-			0);
+			STATUS_SUCCESS,
+			sizeof(TOUCH_POWER_COUNTERS));
 
 		return;
 	}
-	case IOCTL_TOUCH_POWER_TOGGLE:
+	case IOCTL_TOUCH_POWER_RESIDENCY:
 	{
+		BOOLEAN reset = FALSE;
+
 		Trace(
-			TRACE_LEVEL_ERROR,
+			TRACE_LEVEL_VERBOSE,
 			TRACE_INIT,
-			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_TOGGLE");
+			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_RESIDENCY");
 
-		if (dInputLength < sizeof(DWORD))
+		if (dOutputLength < sizeof(TOUCH_POWER_RESIDENCY))
 		{
-			Trace(
-				TRACE_LEVEL_ERROR,
-				TRACE_INIT,
-				"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_TOGGLE STATUS_BUFFER_TOO_SMALL");
-
 			status = STATUS_BUFFER_TOO_SMALL;
 			WdfRequestComplete(
 				Request,
@@ -382,29 +1182,36 @@ Return Value:
 			return;
 		}
 
-		if (*pInputBuffer == 1)
+		//
+		// Read the flags before the shared buffer is overwritten
+		//
+		if (dInputLength >= sizeof(ULONG))
 		{
-			status = TchPowerControl(devContext, 0);
-			if (NT_SUCCESS(status))
-			{
-				Trace(
-					TRACE_LEVEL_ERROR,
-					TRACE_INIT,
-					"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_TOGGLE Switched state to 1");
+			reset = (*(PULONG)pInputBuffer & TOUCH_POWER_RESIDENCY_RESET) != 0;
+		}
 
-				devContext->State = 1;
-				WdfRequestComplete(
-					Request,
-					status);
+		status = TchStatsQueryResidency(
+			devContext,
+			reset,
+			(PTOUCH_POWER_RESIDENCY)pOutputBuffer);
 
-				return;
-			}
+		WdfRequestCompleteWithInformation(
+			Request,
+			status,
+			NT_SUCCESS(status) ? sizeof(TOUCH_POWER_RESIDENCY) : 0);
 
-			Trace(
-				TRACE_LEVEL_ERROR,
-				TRACE_INIT,
-				"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_TOGGLE Failed to Switch state to 1");
+		return;
+	}
+	case IOCTL_TOUCH_POWER_RECORDER:
+	{
+		Trace(
+			TRACE_LEVEL_VERBOSE,
+			TRACE_INIT,
+			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_RECORDER");
 
+		if (dOutputLength < FIELD_OFFSET(TOUCH_POWER_RECORDER_DUMP, Records))
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
 			WdfRequestComplete(
 				Request,
 				status);
@@ -412,29 +1219,52 @@ Return Value:
 			return;
 		}
 
-		if (*pInputBuffer == 0)
+		WdfRequestCompleteWithInformation(
+			Request,
+			STATUS_SUCCESS,
+			TchRecorderDump(
+				devContext,
+				(PTOUCH_POWER_RECORDER_DUMP)pOutputBuffer,
+				dOutputLength));
+
+		return;
+	}
+	case IOCTL_TOUCH_POWER_STATS:
+	{
+		Trace(
+			TRACE_LEVEL_VERBOSE,
+			TRACE_INIT,
+			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_STATS");
+
+		if (dOutputLength < sizeof(TOUCH_POWER_STATS))
 		{
-			status = TchPowerControl(devContext, 1);
-			if (NT_SUCCESS(status))
-			{
-				Trace(
-					TRACE_LEVEL_ERROR,
-					TRACE_INIT,
-					"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_TOGGLE Switched state to 0");
+			status = STATUS_BUFFER_TOO_SMALL;
+			WdfRequestComplete(
+				Request,
+				status);
 
-				devContext->State = 0;
-				WdfRequestComplete(
-					Request,
-					status);
+			return;
+		}
 
-				return;
-			}
+		TchStatsQuery(devContext, (PTOUCH_POWER_STATS)pOutputBuffer);
 
-			Trace(
-				TRACE_LEVEL_ERROR,
-				TRACE_INIT,
-				"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_TOGGLE Failed to Switch state to 0");
+		WdfRequestCompleteWithInformation(
+			Request,
+			STATUS_SUCCESS,
+			sizeof(TOUCH_POWER_STATS));
 
+		return;
+	}
+	case IOCTL_TOUCH_POWER_VOTE:
+	{
+		Trace(
+			TRACE_LEVEL_VERBOSE,
+			TRACE_INIT,
+			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_VOTE");
+
+		if (dInputLength < sizeof(TOUCH_POWER_VOTE))
+		{
+			status = STATUS_BUFFER_TOO_SMALL;
 			WdfRequestComplete(
 				Request,
 				status);
@@ -442,10 +1272,10 @@ Return Value:
 			return;
 		}
 
-		Trace(
-			TRACE_LEVEL_ERROR,
-			TRACE_INIT,
-			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_TOGGLE Unknown state");
+		status = TchVoteCast(
+			devContext,
+			GetFileContext(WdfRequestGetFileObject(Request)),
+			(PTOUCH_POWER_VOTE)pInputBuffer);
 
 		WdfRequestComplete(
 			Request,
@@ -453,30 +1283,42 @@ Return Value:
 
 		return;
 	}
-	case IOCTL_TOUCH_POWER_STATE:
+	case IOCTL_TOUCH_POWER_SCHEDULE:
 	{
+		BOOLEAN replaced;
+
 		Trace(
-			TRACE_LEVEL_ERROR,
+			TRACE_LEVEL_VERBOSE,
 			TRACE_INIT,
-			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_STATE");
+			"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_SCHEDULE");
 
-		if (dOutputLength >= sizeof(DWORD))
+		if (dInputLength < sizeof(TOUCH_POWER_SCHEDULE))
 		{
-			*(DWORD*)pOutputBuffer = devContext->State != 0;
+			status = STATUS_BUFFER_TOO_SMALL;
+			WdfRequestComplete(
+				Request,
+				status);
 
-			Trace(
-				TRACE_LEVEL_ERROR,
-				TRACE_INIT,
-				"TchPowerOnDeviceControl: IOCTL_TOUCH_POWER_STATE success");
+			return;
+		}
+
+		status = TchScheduleSet(
+			devContext,
+			(PTOUCH_POWER_SCHEDULE)pInputBuffer,
+			&replaced);
+
+		if (NT_SUCCESS(status) && dOutputLength >= sizeof(ULONG))
+		{
+			*(PULONG)pOutputBuffer = replaced;
 
 			WdfRequestCompleteWithInformation(
 				Request,
 				status,
-				0);
+				sizeof(ULONG));
 
 			return;
 		}
-		status = STATUS_BUFFER_TOO_SMALL;
+
 		WdfRequestComplete(
 			Request,
 			status);
@@ -486,7 +1328,7 @@ Return Value:
 	default:
 	{
 		Trace(
-			TRACE_LEVEL_ERROR,
+			TRACE_LEVEL_WARNING,
 			TRACE_INIT,
 			"TchPowerOnDeviceControl: Unknown IOCTL");
 
@@ -511,14 +1353,16 @@ TchPowerOnCreate(
 Routine Description:
 
 	This dispatch routine is invoked when a user-mode application is
-	opening a test session. We simply reference count the number of
-	creates and put the device into test mode.
+	opening a test session. We reference count the number of creates,
+	and each session keeps the digitizer component active. Kernel-mode
+	opens, such as the I/O target a sibling driver queries the direct
+	interface through, are no sessions.
 
 Arguments:
 
 	Device - Framework device object representing the test device
-	Request - Can be used to get create information, ununsed here.
-	FileObject - Unused here.
+	Request - Create request, tells who is opening the device
+	FileObject - Framework file object of the session
 
 Return Value:
 
@@ -530,10 +1374,15 @@ Return Value:
 	PTOUCH_POWER devContext;
 	LONG testSessionCount;
 
-	UNREFERENCED_PARAMETER(FileObject);
-
 	devContext = GetDeviceContext(WdfPdoGetParent(Device));
-	testSessionCount = InterlockedIncrement(&(devContext->TestSessionRefCnt));
+
+	if (WdfRequestGetRequestorMode(Request) == UserMode)
+	{
+		GetFileContext(FileObject)->Session = TRUE;
+		testSessionCount = InterlockedIncrement(&(devContext->TestSessionRefCnt));
+
+		TchIdleAcquire(devContext);
+	}
 
 	WdfRequestComplete(
 		Request,
@@ -549,12 +1398,13 @@ TchPowerOnClose(
 Routine Description:
 
 	This dispatch routine is invoked when a user-mode application is
-	closing a test session. We simply reference count the number of
-	closes and restore the driver to normal operation if necessary.
+	closing a test session. We reference count the number of closes,
+	withdraw the session's power vote and drop its active reference on
+	the digitizer component.
 
 Arguments:
 
-	FileObject - Unused here.
+	FileObject - Framework file object of the session
 
 Return Value:
 
@@ -568,7 +1418,14 @@ Return Value:
 
 	devContext = GetDeviceContext(WdfPdoGetParent(WdfFileObjectGetDevice(FileObject)));
 
-	testSessionCount = InterlockedDecrement(&(devContext->TestSessionRefCnt));
+	TchVoteRelease(devContext, GetFileContext(FileObject));
+
+	if (GetFileContext(FileObject)->Session)
+	{
+		testSessionCount = InterlockedDecrement(&(devContext->TestSessionRefCnt));
+
+		TchIdleRelease(devContext);
+	}
 }
 
 NTSTATUS
@@ -606,6 +1463,8 @@ Return Value:
 	WDFDEVICE childDevice = NULL;
 	WDF_OBJECT_ATTRIBUTES objectAttributes;
 	WDF_IO_QUEUE_CONFIG queueConfig;
+	WDF_OBJECT_ATTRIBUTES requestAttributes;
+	WDF_OBJECT_ATTRIBUTES fileAttributes;
 
 	DECLARE_CONST_UNICODE_STRING(deviceId, L"{9AE45E76-6EF0-4ED7-85A2-97712A20786A}\\TouchPower\0");
 	DECLARE_CONST_UNICODE_STRING(hardwareId, L"TOUCH_POWER");
@@ -614,6 +1473,64 @@ Return Value:
 
 	devContext = GetDeviceContext(Device);
 
+	//
+	// The power core drives the state machine, this module only plugs
+	// PoFx and WDF into it
+	//
+	TchCoreInitialize(
+		&devContext->Core,
+		&TchPowerBackend,
+		devContext,
+		devContext->Config.TransitionTimeoutMs);
+
+	//
+	// Every transition slot gets a watchdog for transitions the PEP
+	// leaves pending
+	//
+	status = TchPowerCreateWatchdogs(Device);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	status = TchStatsInitialize(Device);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	TchVoteInitialize(devContext);
+
+	status = TchRecorderInitialize(Device);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	status = TchIdleInitialize(Device);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	status = TchScheduleInitialize(Device);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	status = TchSettingInitialize(Device);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
 	//
 	// Create a child test PDO, the touch device is the parent
 	//
@@ -720,7 +1637,8 @@ Return Value:
 	//
 	// We will want to know when a test application has opened
 	// or closed a handle to the test device -- during this time
-	// the touch driver's normal operation is interrupted.
+	// the touch driver's normal operation is interrupted. Each
+	// handle carries the power vote of its session.
 	//
 	WDF_FILEOBJECT_CONFIG_INIT(
 		&fileConfig,
@@ -728,10 +1646,26 @@ Return Value:
 		TchPowerOnClose,
 		WDF_NO_EVENT_CALLBACK);
 
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(
+		&fileAttributes,
+		TOUCH_POWER_FILE);
+
 	WdfDeviceInitSetFileObjectConfig(
 		deviceInit,
 		&fileConfig,
-		WDF_NO_OBJECT_ATTRIBUTES);
+		&fileAttributes);
+
+	//
+	// Every request carries a small context the transition engine
+	// keeps its bookkeeping in
+	//
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(
+		&requestAttributes,
+		TOUCH_POWER_REQUEST);
+
+	WdfDeviceInitSetRequestAttributes(
+		deviceInit,
+		&requestAttributes);
 
 	//
 	// Create the touch test device
@@ -781,6 +1715,35 @@ Return Value:
 		goto exit;
 	}
 
+	//
+	// Toggle requests are carried out asynchronously by the
+	// transition engine
+	//
+	status = TchTransitionInitialize(Device, childDevice);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	status = TchNotifyInitialize(Device, childDevice);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
+	//
+	// Sibling kernel drivers gate power through a function table
+	// queried from the test device rather than through I/O requests
+	//
+	status = TchDirectInitialize(Device, childDevice);
+
+	if (!NT_SUCCESS(status))
+	{
+		goto exit;
+	}
+
 	//
 	// Expose a device interface for a user-mode test application
 	// to access this test device
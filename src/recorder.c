@@ -0,0 +1,328 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		recorder.c
+
+	Abstract:
+
+		Implements a flight recorder for P-state transitions.
+
+		Every settled transition is written as a compact binary record
+		to a fixed-size ring in nonpaged memory. Nothing is formatted
+		and no lock is taken, so the recorder stays on in the field
+		where no trace session runs. The ring can be read through
+		IOCTL_TOUCH_POWER_RECORDER and is added to crash dumps as
+		secondary data tagged GUID_TOUCH_POWER_RECORDER.
+
+		A record's Sequence is zero while it is being written, and is
+		set to the record number once it is complete.
+
+	Environment:
+
+		Kernel mode
+
+	Revision History:
+
+--*/
+
+#include <internal.h>
+#include <power.h>
+#include <stats.h>
+#include <recorder.h>
+#include <recorder.tmh>
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, TchRecorderInitialize)
+#pragma alloc_text(PAGE, TchRecorderOnCleanup)
+#endif
+
+VOID
+TchRecorderLog(
+	IN PTOUCH_POWER pDeviceContext,
+	IN PTOUCH_POWER_TRANSITION_SLOT pSlot,
+	IN NTSTATUS Status
+)
+/*++
+
+Routine Description:
+
+	Appends a settled transition to the ring, overwriting the oldest
+	record once it is full. May be called at DISPATCH_LEVEL.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	pSlot - Settled transition slot
+	Status - Outcome of the transition
+
+Return Value:
+
+	None
+
+--*/
+{
+	PTOUCH_POWER_RECORD record;
+	LONG sequence;
+	UCHAR setMask = 0;
+	ULONG i;
+
+	if (pDeviceContext->Recorder == NULL)
+	{
+		return;
+	}
+
+	for (i = 0; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+	{
+		if (pSlot->Target.PStates[i] != TOUCH_POWER_NO_TARGET)
+		{
+			setMask |= (UCHAR)(1 << i);
+		}
+	}
+
+	sequence = InterlockedIncrement(&pDeviceContext->RecorderNext);
+	record = &pDeviceContext->Recorder[(ULONG)(sequence - 1) & (TOUCH_POWER_RECORDER_ENTRIES - 1)];
+
+	InterlockedExchange((volatile LONG*)&record->Sequence, 0);
+
+	record->Timestamp = KeQueryInterruptTime();
+	record->CallerPid = pSlot->CallerPid;
+	record->Status = Status;
+	record->LatencyUs = TchStatsTransitionLatencyUs(pDeviceContext, pSlot);
+	record->RequestedPState = (UCHAR)min(
+		(ULONG)pSlot->Target.PStates[0],
+		TOUCH_POWER_RECORD_NO_PSTATE);
+	record->ResultPState = (UCHAR)min(
+		(ULONG)ReadNoFence(&pDeviceContext->Core.PStateCache[0]),
+		TOUCH_POWER_RECORD_NO_PSTATE);
+	record->Cause = (UCHAR)pSlot->Cause;
+	record->SetMask = setMask;
+	record->PepStatus = pSlot->PepStatus;
+
+	InterlockedExchange((volatile LONG*)&record->Sequence, sequence);
+}
+
+ULONG
+TchRecorderDump(
+	IN PTOUCH_POWER pDeviceContext,
+	OUT PTOUCH_POWER_RECORDER_DUMP Dump,
+	IN size_t Length
+)
+/*++
+
+Routine Description:
+
+	Copies the most recent records that fit into Length, oldest first.
+	Records overwritten while they are copied are left out.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Dump - Receives the records
+	Length - Size of Dump in bytes, at least the dump header
+
+Return Value:
+
+	Number of bytes filled in
+
+--*/
+{
+	PTOUCH_POWER_RECORD record;
+	ULONG next;
+	ULONG count;
+	ULONG sequence;
+	ULONG written = 0;
+
+	next = (ULONG)ReadAcquire(&pDeviceContext->RecorderNext);
+
+	count = (ULONG)min(
+		(Length - FIELD_OFFSET(TOUCH_POWER_RECORDER_DUMP, Records)) / sizeof(TOUCH_POWER_RECORD),
+		min(next, TOUCH_POWER_RECORDER_ENTRIES));
+
+	if (pDeviceContext->Recorder == NULL)
+	{
+		count = 0;
+	}
+
+	for (sequence = next - count + 1; sequence <= next && count != 0; sequence++)
+	{
+		record = &pDeviceContext->Recorder[(sequence - 1) & (TOUCH_POWER_RECORDER_ENTRIES - 1)];
+
+		if ((ULONG)ReadAcquire((volatile LONG*)&record->Sequence) != sequence)
+		{
+			continue;
+		}
+
+		Dump->Records[written] = *record;
+
+		KeMemoryBarrier();
+
+		if ((ULONG)ReadNoFence((volatile LONG*)&record->Sequence) != sequence)
+		{
+			continue;
+		}
+
+		written++;
+	}
+
+	Dump->Size = FIELD_OFFSET(TOUCH_POWER_RECORDER_DUMP, Records) +
+		written * sizeof(TOUCH_POWER_RECORD);
+	Dump->Count = written;
+	Dump->Capacity = TOUCH_POWER_RECORDER_ENTRIES;
+	Dump->Recorded = next;
+
+	return Dump->Size;
+}
+
+VOID
+TchRecorderOnBugCheck(
+	IN KBUGCHECK_CALLBACK_REASON Reason,
+	IN PKBUGCHECK_REASON_CALLBACK_RECORD Record,
+	IN OUT PVOID ReasonSpecificData,
+	IN ULONG ReasonSpecificDataLength
+)
+/*++
+
+Routine Description:
+
+	Hands the ring to the crash dump as secondary data. Runs at
+	HIGH_LEVEL with the system halted, so the ring goes in as is.
+
+Arguments:
+
+	Reason - Bugcheck callback reason
+	Record - Callback record, embedded in the device context
+	ReasonSpecificData - KBUGCHECK_SECONDARY_DUMP_DATA
+	ReasonSpecificDataLength - Size of ReasonSpecificData
+
+Return Value:
+
+	None
+
+--*/
+{
+	PKBUGCHECK_SECONDARY_DUMP_DATA dumpData;
+	PTOUCH_POWER devContext;
+	ULONG length = TOUCH_POWER_RECORDER_ENTRIES * sizeof(TOUCH_POWER_RECORD);
+
+	if (Reason != KbCallbackSecondaryDumpData ||
+		ReasonSpecificDataLength < sizeof(KBUGCHECK_SECONDARY_DUMP_DATA))
+	{
+		return;
+	}
+
+	devContext = CONTAINING_RECORD(Record, TOUCH_POWER, RecorderBugCheckRecord);
+	dumpData = (PKBUGCHECK_SECONDARY_DUMP_DATA)ReasonSpecificData;
+
+	if (devContext->Recorder == NULL || dumpData->MaximumAllowed < length)
+	{
+		return;
+	}
+
+	dumpData->Guid = GUID_TOUCH_POWER_RECORDER;
+	dumpData->OutBuffer = devContext->Recorder;
+	dumpData->OutBufferLength = length;
+}
+
+VOID
+TchRecorderOnCleanup(
+	IN WDFOBJECT Memory
+)
+{
+	PTOUCH_POWER devContext;
+
+	PAGED_CODE();
+
+	devContext = GetDeviceContext(WdfObjectGetParentObject(Memory));
+
+	if (devContext->RecorderBugCheckRegistered)
+	{
+		KeDeregisterBugCheckReasonCallback(&devContext->RecorderBugCheckRecord);
+		devContext->RecorderBugCheckRegistered = FALSE;
+	}
+
+	devContext->Recorder = NULL;
+}
+
+NTSTATUS
+TchRecorderInitialize(
+	IN WDFDEVICE Device
+)
+/*++
+
+Routine Description:
+
+	Allocates the ring and registers it for crash dumps. The ring is
+	parented to the device, its cleanup takes it out of crash dumps
+	again.
+
+Arguments:
+
+	Device - Framework device object representing the actual touch device
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	NTSTATUS status;
+	PTOUCH_POWER devContext;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDFMEMORY memory;
+	PVOID buffer;
+
+	PAGED_CODE();
+
+	devContext = GetDeviceContext(Device);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = Device;
+	attributes.EvtCleanupCallback = TchRecorderOnCleanup;
+
+	status = WdfMemoryCreate(
+		&attributes,
+		NonPagedPoolNx,
+		TOUCH_POOL_TAG,
+		TOUCH_POWER_RECORDER_ENTRIES * sizeof(TOUCH_POWER_RECORD),
+		&memory,
+		&buffer);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error allocating flight recorder - %!STATUS!",
+			status);
+
+		return status;
+	}
+
+	RtlZeroMemory(buffer, TOUCH_POWER_RECORDER_ENTRIES * sizeof(TOUCH_POWER_RECORD));
+
+	devContext->Recorder = (PTOUCH_POWER_RECORD)buffer;
+	devContext->RecorderNext = 0;
+
+	KeInitializeCallbackRecord(&devContext->RecorderBugCheckRecord);
+
+	devContext->RecorderBugCheckRegistered = KeRegisterBugCheckReasonCallback(
+		&devContext->RecorderBugCheckRecord,
+		TchRecorderOnBugCheck,
+		KbCallbackSecondaryDumpData,
+		(PUCHAR)"TouchPower");
+
+	if (!devContext->RecorderBugCheckRegistered)
+	{
+		//
+		// The recorder is still useful without crash dumps
+		//
+		Trace(
+			TRACE_LEVEL_WARNING,
+			TRACE_INIT,
+			"Could not register flight recorder for crash dumps");
+	}
+
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,142 @@
+/*++
+    Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+    Module Name:
+
+        registry.c
+
+    Abstract:
+
+        Reads driver tunables from the device's hardware key. Every value
+        is optional, missing or unreadable values fall back to the
+        built-in default.
+
+    Environment:
+
+        Kernel mode
+
+    Revision History:
+
+--*/
+
+#include <internal.h>
+#include <registry.h>
+#include <defaults.h>
+#include <registry.tmh>
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, TchPowerReadConfiguration)
+#endif
+
+typedef struct _TOUCH_POWER_REGISTRY_VALUE
+{
+    PCWSTR Name;
+    SIZE_T Offset;
+    ULONG DefaultValue;
+} TOUCH_POWER_REGISTRY_VALUE;
+
+static const TOUCH_POWER_REGISTRY_VALUE TchPowerRegistryValues[] =
+{
+    { L"TransitionTimeoutMs", FIELD_OFFSET(TOUCH_POWER_CONFIG, TransitionTimeoutMs), TOUCH_POWER_DEFAULT_TRANSITION_TIMEOUT_MS },
+    { L"CoalesceWindowMs",    FIELD_OFFSET(TOUCH_POWER_CONFIG, CoalesceWindowMs),    TOUCH_POWER_DEFAULT_COALESCE_WINDOW_MS },
+    { L"IdleTimeoutMs",       FIELD_OFFSET(TOUCH_POWER_CONFIG, IdleTimeoutMs),       TOUCH_POWER_DEFAULT_IDLE_TIMEOUT_MS },
+    { L"MinOnTimeMs",         FIELD_OFFSET(TOUCH_POWER_CONFIG, Policy.MinOnMs),      TOUCH_POWER_DEFAULT_MIN_ON_MS },
+    { L"MinOffTimeMs",        FIELD_OFFSET(TOUCH_POWER_CONFIG, Policy.MinOffMs),     TOUCH_POWER_DEFAULT_MIN_OFF_MS },
+    { L"PowerOffDelayMs",     FIELD_OFFSET(TOUCH_POWER_CONFIG, Policy.OffDelayMs),   TOUCH_POWER_DEFAULT_OFF_DELAY_MS },
+    { L"DisplayGating",       FIELD_OFFSET(TOUCH_POWER_CONFIG, Display.Enabled),     TOUCH_POWER_DEFAULT_DISPLAY_GATING },
+    { L"DisplayOffDelayMs",   FIELD_OFFSET(TOUCH_POWER_CONFIG, Display.OffDelayMs),  TOUCH_POWER_DEFAULT_DISPLAY_OFF_DELAY_MS },
+
+    //
+    // F-state table. The latencies and residencies are conservative
+    // defaults for the panels we ship, platforms should override them
+    // with measured values from the INF.
+    //
+    { L"F0NominalPowerUw",      FIELD_OFFSET(TOUCH_POWER_CONFIG, FStateNominalPowerUw[TouchPowerF0Active]),   25000 },
+    { L"F1NominalPowerUw",      FIELD_OFFSET(TOUCH_POWER_CONFIG, FStateNominalPowerUw[TouchPowerF1Off]),      0 },
+    { L"F1TransitionLatencyUs", FIELD_OFFSET(TOUCH_POWER_CONFIG, FStateTransitionLatencyUs[TouchPowerF1Off]), 30000 },
+    { L"F1ResidencyUs",         FIELD_OFFSET(TOUCH_POWER_CONFIG, FStateResidencyUs[TouchPowerF1Off]),         300000 },
+};
+
+NTSTATUS
+TchPowerReadConfiguration(
+    IN WDFDEVICE Device,
+    OUT PTOUCH_POWER_CONFIG Config
+)
+/*++
+
+Routine Description:
+
+    Fills in the driver configuration, starting from the defaults and
+    overriding them with whatever is present under the device's
+    hardware key.
+
+Arguments:
+
+    Device - Framework device object representing the actual touch device
+    Config - Receives the configuration
+
+Return Value:
+
+    NTSTATUS indicating success or failure, failing to open the key is
+    not an error
+
+--*/
+{
+    NTSTATUS status;
+    WDFKEY key = NULL;
+    UNICODE_STRING valueName;
+    ULONG value;
+    ULONG i;
+
+    PAGED_CODE();
+
+    for (i = 0; i < ARRAYSIZE(TchPowerRegistryValues); i++)
+    {
+        *(PULONG)((PUCHAR)Config + TchPowerRegistryValues[i].Offset) =
+            TchPowerRegistryValues[i].DefaultValue;
+    }
+
+    status = WdfDeviceOpenRegistryKey(
+        Device,
+        PLUGPLAY_REGKEY_DEVICE,
+        KEY_READ,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &key);
+
+    if (!NT_SUCCESS(status))
+    {
+        Trace(
+            TRACE_LEVEL_WARNING,
+            TRACE_REGISTRY,
+            "Could not open device key, using defaults - %!STATUS!",
+            status);
+
+        return STATUS_SUCCESS;
+    }
+
+    for (i = 0; i < ARRAYSIZE(TchPowerRegistryValues); i++)
+    {
+        RtlInitUnicodeString(&valueName, TchPowerRegistryValues[i].Name);
+
+        status = WdfRegistryQueryULong(
+            key,
+            &valueName,
+            &value);
+
+        if (NT_SUCCESS(status))
+        {
+            *(PULONG)((PUCHAR)Config + TchPowerRegistryValues[i].Offset) = value;
+
+            Trace(
+                TRACE_LEVEL_INFORMATION,
+                TRACE_REGISTRY,
+                "%ws = %lu",
+                TchPowerRegistryValues[i].Name,
+                value);
+        }
+    }
+
+    WdfRegistryClose(key);
+
+    return STATUS_SUCCESS;
+}
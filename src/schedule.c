@@ -0,0 +1,224 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		schedule.c
+
+	Abstract:
+
+		Implements transitions scheduled ahead of time, such as powering
+		the digitizer down a little while after the display went off,
+		so that the user-mode agent asking for them can stay asleep.
+
+		The device has at most one scheduled transition, carried by a
+		WDFTIMER. Since the tolerance a timer may be delayed by to
+		coalesce it with other wakeups is fixed when the timer is
+		created, each schedule gets a timer of its own, replacing the
+		one of the schedule before it. Once the timer expires the
+		transition goes to the transition engine like any other the
+		driver decided on by itself.
+
+	Environment:
+
+		Kernel mode
+
+	Revision History:
+
+--*/
+
+#include <internal.h>
+#include <power.h>
+#include <transition.h>
+#include <schedule.h>
+#include <schedule.tmh>
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, TchScheduleInitialize)
+#pragma alloc_text(PAGE, TchScheduleSet)
+#endif
+
+VOID
+TchScheduleOnTimer(
+	IN WDFTIMER Timer
+)
+{
+	PTOUCH_POWER devContext;
+	LONG state;
+
+	devContext = GetDeviceContext(WdfTimerGetParentObject(Timer));
+
+	state = InterlockedExchange(&devContext->ScheduledState, TOUCH_POWER_NO_TARGET);
+	if (state == TOUCH_POWER_NO_TARGET)
+	{
+		return;
+	}
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_POWER,
+		"Scheduled transition to state %ld due",
+		state);
+
+	TchTransitionSubmitInternal(devContext, (DWORD)state, TouchPowerCauseSchedule);
+}
+
+NTSTATUS
+TchScheduleSet(
+	IN PTOUCH_POWER pDeviceContext,
+	IN PTOUCH_POWER_SCHEDULE Schedule,
+	OUT PBOOLEAN Replaced
+)
+/*++
+
+Routine Description:
+
+	Replaces or cancels the scheduled transition of the device.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Schedule - What to schedule, see IOCTL_TOUCH_POWER_SCHEDULE
+	Replaced - Set to TRUE if a scheduled transition was still pending
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	WDF_TIMER_CONFIG timerConfig;
+	WDF_OBJECT_ATTRIBUTES timerAttributes;
+	ULONGLONG now;
+	LONGLONG dueTime;
+
+	PAGED_CODE();
+
+	*Replaced = FALSE;
+
+	if ((Schedule->Flags & ~(TOUCH_POWER_SCHEDULE_DEADLINE | TOUCH_POWER_SCHEDULE_CANCEL)) != 0 ||
+		Schedule->State > 1)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	WdfWaitLockAcquire(pDeviceContext->ScheduleLock, NULL);
+
+	//
+	// Once the timer is stopped and its callback done the old schedule
+	// can no longer go off
+	//
+	if (pDeviceContext->ScheduleTimer != NULL)
+	{
+		WdfTimerStop(pDeviceContext->ScheduleTimer, TRUE);
+		WdfObjectDelete(pDeviceContext->ScheduleTimer);
+		pDeviceContext->ScheduleTimer = NULL;
+	}
+
+	*Replaced = InterlockedExchange(
+		&pDeviceContext->ScheduledState,
+		TOUCH_POWER_NO_TARGET) != TOUCH_POWER_NO_TARGET;
+
+	if (Schedule->Flags & TOUCH_POWER_SCHEDULE_CANCEL)
+	{
+		goto exit;
+	}
+
+	//
+	// Negative due times are relative, in 100ns units
+	//
+	if (Schedule->Flags & TOUCH_POWER_SCHEDULE_DEADLINE)
+	{
+		now = KeQueryInterruptTime();
+
+		if (Schedule->Deadline <= now)
+		{
+			TchTransitionSubmitInternal(
+				pDeviceContext,
+				Schedule->State,
+				TouchPowerCauseSchedule);
+
+			goto exit;
+		}
+
+		dueTime = -(LONGLONG)(Schedule->Deadline - now);
+	}
+	else
+	{
+		dueTime = WDF_REL_TIMEOUT_IN_MS(Schedule->DelayMs);
+	}
+
+	WDF_TIMER_CONFIG_INIT(&timerConfig, TchScheduleOnTimer);
+	timerConfig.TolerableDelay = Schedule->ToleranceMs;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
+	timerAttributes.ParentObject = pDeviceContext->FxDevice;
+
+	status = WdfTimerCreate(
+		&timerConfig,
+		&timerAttributes,
+		&pDeviceContext->ScheduleTimer);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_POWER,
+			"Error creating schedule timer - %!STATUS!",
+			status);
+
+		pDeviceContext->ScheduleTimer = NULL;
+		goto exit;
+	}
+
+	InterlockedExchange(&pDeviceContext->ScheduledState, (LONG)Schedule->State);
+
+	WdfTimerStart(pDeviceContext->ScheduleTimer, dueTime);
+
+	Trace(
+		TRACE_LEVEL_VERBOSE,
+		TRACE_POWER,
+		"Scheduled transition to state %lu, tolerance %lums",
+		Schedule->State,
+		Schedule->ToleranceMs);
+
+exit:
+
+	WdfWaitLockRelease(pDeviceContext->ScheduleLock);
+
+	return status;
+}
+
+NTSTATUS
+TchScheduleInitialize(
+	IN WDFDEVICE Device
+)
+{
+	NTSTATUS status;
+	PTOUCH_POWER devContext;
+	WDF_OBJECT_ATTRIBUTES lockAttributes;
+
+	PAGED_CODE();
+
+	devContext = GetDeviceContext(Device);
+	devContext->ScheduledState = TOUCH_POWER_NO_TARGET;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&lockAttributes);
+	lockAttributes.ParentObject = Device;
+
+	status = WdfWaitLockCreate(
+		&lockAttributes,
+		&devContext->ScheduleLock);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating schedule lock - %!STATUS!",
+			status);
+	}
+
+	return status;
+}
@@ -0,0 +1,342 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		setting.c
+
+	Abstract:
+
+		Powers the digitizer off after the display, so that how soon
+		it goes off does not depend on a user-mode process getting to
+		run. The driver registers for the GUID_CONSOLE_DISPLAY_STATE and
+		GUID_MONITOR_POWER_ON power setting notifications and hands them
+		to the display gate (see display.c), which decides what to do;
+		this module only carries it out, with a timer for the delayed
+		power-off and the transition engine for the transitions.
+
+		The display ranks below the client votes (see vote.c): it does
+		not power the digitizer off while a client votes it on, and
+		when the display comes back it only powers the digitizer on if
+		it was on, or in a state the driver did not know, before.
+
+	Environment:
+
+		Kernel mode
+
+	Revision History:
+
+--*/
+
+#include <internal.h>
+#include <power.h>
+#include <transition.h>
+#include <vote.h>
+#include <setting.h>
+#include <setting.tmh>
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, TchSettingInitialize)
+#pragma alloc_text(PAGE, TchSettingRegister)
+#pragma alloc_text(PAGE, TchSettingUnregister)
+#endif
+
+static VOID
+TchSettingArm(
+	IN PTOUCH_POWER pDeviceContext,
+	IN ULONGLONG Due
+)
+{
+	ULONGLONG now = KeQueryInterruptTime();
+
+	//
+	// Negative due times are relative, in 100ns units
+	//
+	WdfTimerStart(
+		pDeviceContext->DisplayTimer,
+		(Due > now) ? -(LONGLONG)(Due - now) : -1);
+}
+
+static VOID
+TchSettingApply(
+	IN PTOUCH_POWER pDeviceContext,
+	IN TOUCH_POWER_DISPLAY_ACTION Action,
+	IN ULONGLONG Due
+)
+/*++
+
+Routine Description:
+
+	Carries out what the display gate decided. Called with DisplayLock
+	held, so that the transitions reach the engine in the order the
+	gate decided on them.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Action - What the gate decided
+	Due - Interrupt time the gate wants to be asked again at, for
+		TouchPowerDisplayArm
+
+Return Value:
+
+	None
+
+--*/
+{
+	switch (Action)
+	{
+	case TouchPowerDisplayArm:
+		TchSettingArm(pDeviceContext, Due);
+		break;
+
+	case TouchPowerDisplayDisarm:
+		WdfTimerStop(pDeviceContext->DisplayTimer, FALSE);
+		break;
+
+	case TouchPowerDisplayPowerOff:
+		if (TchDisplayGate(
+			&pDeviceContext->Display,
+			TchPowerGetState(pDeviceContext),
+			TchVoteOutcome(pDeviceContext) == 1))
+		{
+			TchTransitionSubmitInternal(pDeviceContext, 0, TouchPowerCauseDisplay);
+		}
+		break;
+
+	case TouchPowerDisplayPowerOn:
+		TchTransitionSubmitInternal(pDeviceContext, 1, TouchPowerCauseDisplay);
+		break;
+
+	default:
+		break;
+	}
+}
+
+NTSTATUS
+TchSettingOnChange(
+	IN LPCGUID SettingGuid,
+	IN PVOID Value,
+	IN ULONG ValueLength,
+	IN OUT PVOID Context
+)
+{
+	PTOUCH_POWER devContext = (PTOUCH_POWER)Context;
+	TOUCH_POWER_DISPLAY_SOURCE source;
+	TOUCH_POWER_DISPLAY_ACTION action;
+	ULONGLONG due;
+
+	if (ValueLength < sizeof(ULONG))
+	{
+		return STATUS_SUCCESS;
+	}
+
+	source = IsEqualGUID(SettingGuid, &GUID_CONSOLE_DISPLAY_STATE) ?
+		TouchPowerDisplayConsole :
+		TouchPowerDisplayMonitor;
+
+	Trace(
+		TRACE_LEVEL_INFORMATION,
+		TRACE_POWER,
+		"Display state %lu reported by source %d",
+		*(PULONG)Value,
+		source);
+
+	WdfSpinLockAcquire(devContext->DisplayLock);
+
+	action = TchDisplayNotify(
+		&devContext->Display,
+		source,
+		*(PULONG)Value,
+		&due);
+
+	TchSettingApply(devContext, action, due);
+
+	WdfSpinLockRelease(devContext->DisplayLock);
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+TchSettingOnTimer(
+	IN WDFTIMER Timer
+)
+{
+	PTOUCH_POWER devContext;
+
+	devContext = GetDeviceContext(WdfTimerGetParentObject(Timer));
+
+	WdfSpinLockAcquire(devContext->DisplayLock);
+
+	if (TchDisplayExpire(&devContext->Display))
+	{
+		TchSettingApply(devContext, TouchPowerDisplayPowerOff, 0);
+	}
+	else if (devContext->Display.OffPending)
+	{
+		//
+		// Went off ahead of the power-off the gate armed for
+		//
+		TchSettingArm(devContext, devContext->Display.OffDue);
+	}
+
+	WdfSpinLockRelease(devContext->DisplayLock);
+}
+
+VOID
+TchSettingRegister(
+	IN PTOUCH_POWER pDeviceContext
+)
+/*++
+
+Routine Description:
+
+	Registers for the display power setting notifications, unless
+	display gating is turned off. Both notifications report the current
+	display state right away. Failing to register for one of them is not
+	fatal, the digitizer is then left on with the display off.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+
+Return Value:
+
+	None
+
+--*/
+{
+	PDEVICE_OBJECT deviceObject;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	if (!pDeviceContext->Config.Display.Enabled)
+	{
+		return;
+	}
+
+	deviceObject = WdfDeviceWdmGetDeviceObject(pDeviceContext->FxDevice);
+
+	status = PoRegisterPowerSettingCallback(
+		deviceObject,
+		&GUID_CONSOLE_DISPLAY_STATE,
+		TchSettingOnChange,
+		pDeviceContext,
+		&pDeviceContext->DisplayConsoleHandle);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_WARNING,
+			TRACE_INIT,
+			"Error registering for console display state - %!STATUS!",
+			status);
+
+		pDeviceContext->DisplayConsoleHandle = NULL;
+	}
+
+	status = PoRegisterPowerSettingCallback(
+		deviceObject,
+		&GUID_MONITOR_POWER_ON,
+		TchSettingOnChange,
+		pDeviceContext,
+		&pDeviceContext->DisplayMonitorHandle);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_WARNING,
+			TRACE_INIT,
+			"Error registering for monitor power state - %!STATUS!",
+			status);
+
+		pDeviceContext->DisplayMonitorHandle = NULL;
+	}
+}
+
+VOID
+TchSettingUnregister(
+	IN PTOUCH_POWER pDeviceContext
+)
+{
+	PAGED_CODE();
+
+	if (pDeviceContext->DisplayConsoleHandle != NULL)
+	{
+		PoUnregisterPowerSettingCallback(pDeviceContext->DisplayConsoleHandle);
+		pDeviceContext->DisplayConsoleHandle = NULL;
+	}
+
+	if (pDeviceContext->DisplayMonitorHandle != NULL)
+	{
+		PoUnregisterPowerSettingCallback(pDeviceContext->DisplayMonitorHandle);
+		pDeviceContext->DisplayMonitorHandle = NULL;
+	}
+
+	WdfTimerStop(pDeviceContext->DisplayTimer, TRUE);
+}
+
+NTSTATUS
+TchSettingInitialize(
+	IN WDFDEVICE Device
+)
+{
+	NTSTATUS status;
+	PTOUCH_POWER devContext;
+	WDF_OBJECT_ATTRIBUTES objectAttributes;
+	WDF_TIMER_CONFIG timerConfig;
+
+	PAGED_CODE();
+
+	devContext = GetDeviceContext(Device);
+
+	TchDisplayInitialize(
+		&devContext->Display,
+		&devContext->Config.Display);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&objectAttributes);
+	objectAttributes.ParentObject = Device;
+
+	status = WdfSpinLockCreate(
+		&objectAttributes,
+		&devContext->DisplayLock);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating display lock - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	WDF_TIMER_CONFIG_INIT(
+		&timerConfig,
+		TchSettingOnTimer);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&objectAttributes);
+	objectAttributes.ParentObject = Device;
+
+	status = WdfTimerCreate(
+		&timerConfig,
+		&objectAttributes,
+		&devContext->DisplayTimer);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating display timer - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+exit:
+
+	return status;
+}
@@ -0,0 +1,581 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		stats.c
+
+	Abstract:
+
+		Keeps statistics about the P-state transitions the PEP carries
+		out for the digitizer.
+
+		Each transition is timed with the performance counter from the
+		PoFxPowerControl call to the moment it settles, PEP
+		confirmation included. Latencies go into a log2-bucketed
+		histogram per direction. Failed transitions are counted per
+		NTSTATUS instead. The time requests spend queued before the
+		transition engine gets to them goes into the same kind of
+		histogram, per priority class.
+
+		Residency is accounted per P-state of set 0 and per F-state.
+		A state change closes the interval spent in the previous state,
+		so the cost does not depend on how long the driver has been
+		running. Snapshots are kept as a copy of the totals, the
+		accounting itself is never reset.
+
+		Everything is updated with interlocked operations only, so
+		recording is safe from the PEP callback at DISPATCH_LEVEL.
+
+	Environment:
+
+		Kernel mode
+
+	Revision History:
+
+--*/
+
+#include <internal.h>
+#include <power.h>
+#include <stats.h>
+#include <stats.tmh>
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, TchStatsInitialize)
+#pragma alloc_text(PAGE, TchStatsQueryResidency)
+#endif
+
+static ULONG
+TchStatsBucket(
+	IN ULONGLONG LatencyUs
+)
+/*++
+
+Routine Description:
+
+	Maps a latency to its histogram bucket. Bucket 0 holds latencies
+	under 1us, bucket n latencies in [2^(n-1), 2^n) us and the last
+	bucket everything above.
+
+Arguments:
+
+	LatencyUs - Latency in microseconds
+
+Return Value:
+
+	Bucket index
+
+--*/
+{
+	ULONG bucket;
+
+	if (LatencyUs == 0)
+	{
+		return 0;
+	}
+
+	bucket = (ULONG)RtlFindMostSignificantBit(LatencyUs) + 1;
+
+	return min(bucket, TOUCH_POWER_LATENCY_BUCKETS - 1);
+}
+
+static VOID
+TchStatsRecordFailure(
+	IN PTOUCH_POWER pDeviceContext,
+	IN NTSTATUS Status
+)
+{
+	LONG previous;
+	ULONG i;
+
+	//
+	// A free entry has status 0, which is never a failure. Entries are
+	// claimed for good, statuses that come too late end up as other
+	// failures.
+	//
+	for (i = 0; i < TOUCH_POWER_MAX_FAILURE_STATUSES; i++)
+	{
+		previous = ReadNoFence(&pDeviceContext->FailureStatus[i]);
+
+		if (previous == 0)
+		{
+			previous = InterlockedCompareExchange(
+				&pDeviceContext->FailureStatus[i],
+				Status,
+				0);
+		}
+
+		if (previous == 0 || previous == Status)
+		{
+			InterlockedIncrement(&pDeviceContext->FailureCounts[i]);
+			return;
+		}
+	}
+
+	InterlockedIncrement(&pDeviceContext->OtherFailures);
+}
+
+static VOID
+TchStatsRecordLatency(
+	IN PTOUCH_POWER_LATENCY_COUNTERS Latency,
+	IN LONG ValueUs
+)
+{
+	LONG previous;
+
+	InterlockedIncrement(&Latency->Count);
+	InterlockedAdd64(&Latency->TotalUs, ValueUs);
+	InterlockedIncrement(&Latency->Buckets[TchStatsBucket((ULONGLONG)ValueUs)]);
+
+	do
+	{
+		previous = ReadNoFence(&Latency->MinUs);
+	} while (ValueUs < previous &&
+		InterlockedCompareExchange(&Latency->MinUs, ValueUs, previous) != previous);
+
+	do
+	{
+		previous = ReadNoFence(&Latency->MaxUs);
+	} while (ValueUs > previous &&
+		InterlockedCompareExchange(&Latency->MaxUs, ValueUs, previous) != previous);
+}
+
+ULONG
+TchStatsTransitionLatencyUs(
+	IN PTOUCH_POWER pDeviceContext,
+	IN PTOUCH_POWER_TRANSITION_SLOT pSlot
+)
+/*++
+
+Routine Description:
+
+	Converts the time a settled transition took to microseconds.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	pSlot - Settled transition slot
+
+Return Value:
+
+	Latency in microseconds, capped at MAXLONG
+
+--*/
+{
+	ULONGLONG latencyUs;
+
+	latencyUs = (ULONGLONG)(pSlot->SettledTicks - pSlot->StartTicks) * 1000000 /
+		(ULONGLONG)pDeviceContext->PerformanceFrequency;
+
+	return (ULONG)min(latencyUs, MAXLONG);
+}
+
+VOID
+TchStatsRecordTransition(
+	IN PTOUCH_POWER pDeviceContext,
+	IN PTOUCH_POWER_TRANSITION_SLOT pSlot,
+	IN NTSTATUS Status
+)
+/*++
+
+Routine Description:
+
+	Accounts for a settled transition. Only transitions that reached
+	their target contribute to the latency histograms.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	pSlot - Settled transition slot
+	Status - Outcome of the transition
+
+Return Value:
+
+	None
+
+--*/
+{
+	PTOUCH_POWER_LATENCY_COUNTERS latency;
+
+	if (!NT_SUCCESS(Status))
+	{
+		TchStatsRecordFailure(pDeviceContext, Status);
+		return;
+	}
+
+	if (pSlot->Target.PStates[0] == TOUCH_POWER_NO_TARGET)
+	{
+		latency = &pDeviceContext->Latency[TouchPowerDirectionOther];
+	}
+	else if (pSlot->Target.PStates[0] == TOUCH_POWER_PSTATE_OFF)
+	{
+		latency = &pDeviceContext->Latency[TouchPowerDirectionOff];
+	}
+	else
+	{
+		latency = &pDeviceContext->Latency[TouchPowerDirectionOn];
+	}
+
+	TchStatsRecordLatency(
+		latency,
+		(LONG)TchStatsTransitionLatencyUs(pDeviceContext, pSlot));
+}
+
+VOID
+TchStatsRecordQueueWait(
+	IN PTOUCH_POWER pDeviceContext,
+	IN TOUCH_POWER_QUEUE_CLASS Class,
+	IN PTOUCH_POWER_REQUEST RequestContext
+)
+/*++
+
+Routine Description:
+
+	Accounts for the time a request spent queued, called when the
+	transition engine picks the request up.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Class - Priority class the request was queued in
+	RequestContext - Context of the request
+
+Return Value:
+
+	None
+
+--*/
+{
+	ULONGLONG waitUs;
+
+	waitUs = (KeQueryInterruptTime() - RequestContext->QueuedTime) / 10;
+
+	TchStatsRecordLatency(
+		&pDeviceContext->QueueWait[Class],
+		(LONG)min(waitUs, MAXLONG));
+}
+
+VOID
+TchStatsRecordWait(
+	IN PTOUCH_POWER pDeviceContext,
+	IN NTSTATUS PepStatus
+)
+/*++
+
+Routine Description:
+
+	Counts a STATUS_WAIT_1 or STATUS_WAIT_3 answer of the PEP, whether
+	it came with the request or with a later confirmation.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	PepStatus - Status the PEP answered with
+
+Return Value:
+
+	None
+
+--*/
+{
+	if (PepStatus == STATUS_WAIT_1)
+	{
+		InterlockedIncrement(&pDeviceContext->Wait1Results);
+	}
+	else if (PepStatus == STATUS_WAIT_3)
+	{
+		InterlockedIncrement(&pDeviceContext->Wait3Results);
+	}
+}
+
+VOID
+TchStatsEnterState(
+	IN PTOUCH_POWER pDeviceContext,
+	IN TOUCH_POWER_RESIDENCY_DOMAIN Domain,
+	IN ULONG State
+)
+/*++
+
+Routine Description:
+
+	Accounts for a P-state or F-state change. Changes within a domain
+	are serialized, by the transition engine for P-states and by PoFx
+	for F-states.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Domain - Whether State is a P-state or an F-state
+	State - State entered
+
+Return Value:
+
+	None
+
+--*/
+{
+	PTOUCH_POWER_RESIDENCY_COUNTERS residency = &pDeviceContext->Residency[Domain];
+	LONG previous;
+	LONG64 now;
+	LONG64 enterTime;
+
+	State = min(State, TOUCH_POWER_RESIDENCY_STATES - 1);
+	previous = ReadNoFence(&residency->Current);
+
+	if ((ULONG)previous == State)
+	{
+		return;
+	}
+
+	now = (LONG64)KeQueryInterruptTime();
+	enterTime = InterlockedExchange64(&residency->EnterTime, now);
+
+	InterlockedAdd64(&residency->Time[previous], now - enterTime);
+	InterlockedExchange(&residency->Current, (LONG)State);
+	InterlockedIncrement(&residency->Entries[State]);
+}
+
+static VOID
+TchStatsReadResidency(
+	IN PTOUCH_POWER_RESIDENCY_COUNTERS Residency,
+	IN ULONGLONG Now,
+	OUT PTOUCH_POWER_RESIDENCY_ENTRY Entries
+)
+{
+	LONG current = ReadNoFence(&Residency->Current);
+	ULONG i;
+
+	for (i = 0; i < TOUCH_POWER_RESIDENCY_STATES; i++)
+	{
+		Entries[i].Time = (ULONGLONG)ReadNoFence64(&Residency->Time[i]);
+		Entries[i].Entries = (ULONG)ReadNoFence(&Residency->Entries[i]);
+		Entries[i].Reserved = 0;
+	}
+
+	//
+	// The interval in the current state is still open
+	//
+	Entries[current].Time += Now - (ULONGLONG)ReadNoFence64(&Residency->EnterTime);
+}
+
+NTSTATUS
+TchStatsQueryResidency(
+	IN PTOUCH_POWER pDeviceContext,
+	IN BOOLEAN Reset,
+	OUT PTOUCH_POWER_RESIDENCY Residency
+)
+/*++
+
+Routine Description:
+
+	Reports residency since the driver started and since the last
+	snapshot, and optionally starts a new snapshot period. Concurrent
+	callers take their turn.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Reset - Whether to start a new snapshot period
+	Residency - Receives the residency data
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	PTOUCH_POWER_RESIDENCY_ENTRY totals[TouchPowerResidencyDomainCount];
+	PTOUCH_POWER_RESIDENCY_ENTRY snapshots[TouchPowerResidencyDomainCount];
+	PTOUCH_POWER_RESIDENCY_COUNTERS baseline;
+	ULONG domain;
+	ULONG i;
+
+	PAGED_CODE();
+
+	WdfWaitLockAcquire(pDeviceContext->ResidencyLock, NULL);
+
+	RtlZeroMemory(Residency, sizeof(TOUCH_POWER_RESIDENCY));
+
+	totals[TouchPowerResidencyPState] = Residency->PStates;
+	totals[TouchPowerResidencyFState] = Residency->FStates;
+	snapshots[TouchPowerResidencyPState] = Residency->SnapshotPStates;
+	snapshots[TouchPowerResidencyFState] = Residency->SnapshotFStates;
+
+	Residency->Size = sizeof(TOUCH_POWER_RESIDENCY);
+	Residency->Now = KeQueryInterruptTime();
+	Residency->CurrentPState = (ULONG)ReadNoFence(&pDeviceContext->Residency[TouchPowerResidencyPState].Current);
+	Residency->CurrentFState = (ULONG)ReadNoFence(&pDeviceContext->Residency[TouchPowerResidencyFState].Current);
+
+	for (domain = 0; domain < TouchPowerResidencyDomainCount; domain++)
+	{
+		baseline = &pDeviceContext->ResidencyBaseline[domain];
+
+		TchStatsReadResidency(
+			&pDeviceContext->Residency[domain],
+			Residency->Now,
+			totals[domain]);
+
+		for (i = 0; i < TOUCH_POWER_RESIDENCY_STATES; i++)
+		{
+			snapshots[domain][i].Time = totals[domain][i].Time - (ULONGLONG)baseline->Time[i];
+			snapshots[domain][i].Entries = totals[domain][i].Entries - (ULONG)baseline->Entries[i];
+
+			if (Reset)
+			{
+				baseline->Time[i] = (LONG64)totals[domain][i].Time;
+				baseline->Entries[i] = (LONG)totals[domain][i].Entries;
+			}
+		}
+	}
+
+	//
+	// The baseline's EnterTime holds the start of the snapshot period
+	//
+	Residency->SnapshotTime = (ULONGLONG)pDeviceContext->ResidencyBaseline[0].EnterTime;
+
+	if (Reset)
+	{
+		pDeviceContext->ResidencyBaseline[0].EnterTime = (LONG64)Residency->Now;
+	}
+
+	WdfWaitLockRelease(pDeviceContext->ResidencyLock);
+
+	return STATUS_SUCCESS;
+}
+
+static VOID
+TchStatsReadLatency(
+	IN PTOUCH_POWER_LATENCY_COUNTERS Latency,
+	OUT PTOUCH_POWER_LATENCY Copy
+)
+{
+	ULONG i;
+
+	Copy->Count = (ULONG)ReadNoFence(&Latency->Count);
+
+	if (Copy->Count == 0)
+	{
+		return;
+	}
+
+	Copy->MinUs = (ULONG)ReadNoFence(&Latency->MinUs);
+	Copy->MaxUs = (ULONG)ReadNoFence(&Latency->MaxUs);
+	Copy->TotalUs = (ULONGLONG)ReadNoFence64(&Latency->TotalUs);
+	Copy->MeanUs = (ULONG)(Copy->TotalUs / Copy->Count);
+
+	for (i = 0; i < TOUCH_POWER_LATENCY_BUCKETS; i++)
+	{
+		Copy->Buckets[i] = (ULONG)ReadNoFence(&Latency->Buckets[i]);
+	}
+}
+
+VOID
+TchStatsQuery(
+	IN PTOUCH_POWER pDeviceContext,
+	OUT PTOUCH_POWER_STATS Stats
+)
+/*++
+
+Routine Description:
+
+	Takes a copy of the statistics. The copy is not atomic as a whole,
+	a transition settling meanwhile may show up in some fields only.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Stats - Receives the statistics
+
+Return Value:
+
+	None
+
+--*/
+{
+	ULONG i;
+
+	RtlZeroMemory(Stats, sizeof(TOUCH_POWER_STATS));
+
+	Stats->Size = sizeof(TOUCH_POWER_STATS);
+	Stats->Wait1Results = (ULONG)ReadNoFence(&pDeviceContext->Wait1Results);
+	Stats->Wait3Results = (ULONG)ReadNoFence(&pDeviceContext->Wait3Results);
+	Stats->OtherFailures = (ULONG)ReadNoFence(&pDeviceContext->OtherFailures);
+
+	for (i = 0; i < TouchPowerDirectionCount; i++)
+	{
+		TchStatsReadLatency(&pDeviceContext->Latency[i], &Stats->Latency[i]);
+	}
+
+	for (i = 0; i < TouchPowerQueueClassCount; i++)
+	{
+		TchStatsReadLatency(&pDeviceContext->QueueWait[i], &Stats->QueueWait[i]);
+	}
+
+	for (i = 0; i < TOUCH_POWER_MAX_FAILURE_STATUSES; i++)
+	{
+		Stats->Failures[i].Status = ReadNoFence(&pDeviceContext->FailureStatus[i]);
+		Stats->Failures[i].Count = (ULONG)ReadNoFence(&pDeviceContext->FailureCounts[i]);
+	}
+}
+
+NTSTATUS
+TchStatsInitialize(
+	IN WDFDEVICE Device
+)
+{
+	NTSTATUS status;
+	PTOUCH_POWER pDeviceContext;
+	WDF_OBJECT_ATTRIBUTES lockAttributes;
+	LARGE_INTEGER frequency;
+	ULONG i;
+
+	PAGED_CODE();
+
+	pDeviceContext = GetDeviceContext(Device);
+
+	KeQueryPerformanceCounter(&frequency);
+	pDeviceContext->PerformanceFrequency = frequency.QuadPart;
+
+	//
+	// The digitizer is accounted as off until the first transition
+	// tells, and PoFx registers the component in F0
+	//
+	pDeviceContext->Residency[TouchPowerResidencyPState].Current = TOUCH_POWER_PSTATE_OFF;
+	pDeviceContext->Residency[TouchPowerResidencyFState].Current = TouchPowerF0Active;
+
+	for (i = 0; i < TouchPowerResidencyDomainCount; i++)
+	{
+		pDeviceContext->Residency[i].EnterTime = (LONG64)KeQueryInterruptTime();
+		pDeviceContext->Residency[i].Entries[pDeviceContext->Residency[i].Current] = 1;
+	}
+
+	pDeviceContext->ResidencyBaseline[0].EnterTime = pDeviceContext->Residency[0].EnterTime;
+
+	for (i = 0; i < TouchPowerDirectionCount; i++)
+	{
+		pDeviceContext->Latency[i].MinUs = MAXLONG;
+	}
+
+	for (i = 0; i < TouchPowerQueueClassCount; i++)
+	{
+		pDeviceContext->QueueWait[i].MinUs = MAXLONG;
+	}
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&lockAttributes);
+	lockAttributes.ParentObject = Device;
+
+	status = WdfWaitLockCreate(
+		&lockAttributes,
+		&pDeviceContext->ResidencyLock);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating residency lock - %!STATUS!",
+			status);
+	}
+
+	return status;
+}
@@ -0,0 +1,1609 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		transition.c
+
+	Abstract:
+
+		Implements the P-state transition engine. Toggle and P-state
+		requests are forwarded to a manual queue and left pending; a
+		work item drains the queue, talks to the PEP and completes each
+		request once its transition is done, which for transitions the
+		PEP answers with STATUS_WAIT_1 or STATUS_WAIT_3 is only once the
+		PEP confirms.
+
+		Requests that pile up while a transition is in flight, or that
+		arrive within the coalescing window, are collapsed into the last
+		one of the burst. P-state sets that are already in the requested
+		P-state never reach the PEP.
+
+		Once no requests are queued, the engine carries out changes in
+		the outcome of the client votes (see vote.c), then transitions
+		the driver asked for on its own.
+
+		Power-on is latency critical, the user is about to touch, while
+		power-off is not. Requests that power the digitizer on are
+		queued apart and served first, as are the client votes and the
+		driver asking for power-on; only the transition in flight at
+		the PEP is not overtaken. A power-on drops the digitizer power
+		gate from every request queued before it, which would otherwise
+		undo it afterwards; requests left with nothing to do are
+		cancelled, the others keep their place in the queue.
+
+		Every transition of the digitizer power gate other than batch
+		entries goes past the policy stage (see policy.c) first, which
+		may hold a power-off back for a while. Power-on is never held
+		back, neither by the stage nor by the coalescing window.
+
+		Batches are carried out entry by entry, honoring each entry's
+		delay or deadline with a timer rather than a waiting thread.
+
+	Environment:
+
+		Kernel mode
+
+	Revision History:
+
+--*/
+
+#include <internal.h>
+#include <power.h>
+#include <transition.h>
+#include <vote.h>
+#include <idle.h>
+#include <stats.h>
+#include <transition.tmh>
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, TchTransitionInitialize)
+#pragma alloc_text(PAGE, TchTransitionWorkItem)
+#endif
+
+VOID
+TchTransitionKick(
+	IN PTOUCH_POWER pDeviceContext
+)
+/*++
+
+Routine Description:
+
+	Makes the transition engine look for work, for instance after the
+	outcome of the client votes may have changed. May be called at
+	DISPATCH_LEVEL.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+
+Return Value:
+
+	None
+
+--*/
+{
+	InterlockedExchange(&pDeviceContext->TransitionPumpKick, 1);
+	WdfWorkItemEnqueue(pDeviceContext->TransitionWorkItem);
+}
+
+static VOID
+TchTransitionCompleteBurst(
+	IN PTOUCH_POWER pDeviceContext,
+	IN WDFREQUEST Request,
+	IN NTSTATUS Status,
+	IN ULONG Cause
+)
+/*++
+
+Routine Description:
+
+	Completes the request that carried a burst's final target, along
+	with every request of the burst that was collapsed into it, and an
+	F-state change that waited for the transition.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Request - Request carrying the final target of the burst, NULL for
+		transitions the driver started on its own
+	Status - Outcome of the transition
+	Cause - TOUCH_POWER_CAUSE of the transition
+
+Return Value:
+
+	None
+
+--*/
+{
+	WDFREQUEST waiter;
+
+	while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(
+		pDeviceContext->TransitionWaitQueue,
+		&waiter)))
+	{
+		WdfRequestComplete(
+			waiter,
+			Status);
+	}
+
+	if (Request != NULL)
+	{
+		WdfRequestComplete(
+			Request,
+			Status);
+	}
+
+	TchIdleTransitionDone(pDeviceContext, Cause);
+}
+
+static VOID
+TchTransitionMoveRequests(
+	IN WDFQUEUE From,
+	IN WDFQUEUE To
+)
+/*++
+
+Routine Description:
+
+	Moves every request of one manual queue to another, completing the
+	ones that cannot be moved with the reason why.
+
+Arguments:
+
+	From - Queue to take the requests from
+	To - Queue to park the requests in
+
+Return Value:
+
+	None
+
+--*/
+{
+	WDFREQUEST request;
+	NTSTATUS status;
+
+	while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(
+		From,
+		&request)))
+	{
+		status = WdfRequestForwardToIoQueue(
+			request,
+			To);
+
+		if (!NT_SUCCESS(status))
+		{
+			WdfRequestComplete(
+				request,
+				status);
+		}
+	}
+}
+
+static BOOLEAN
+TchTransitionPowerOffOnly(
+	IN const TOUCH_POWER_PSTATE_VECTOR* Target
+)
+{
+	ULONG i;
+
+	if (Target->PStates[0] != TOUCH_POWER_PSTATE_OFF)
+	{
+		return FALSE;
+	}
+
+	for (i = 1; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+	{
+		if (Target->PStates[i] != TOUCH_POWER_NO_TARGET)
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static NTSTATUS
+TchTransitionCollapse(
+	IN PTOUCH_POWER pDeviceContext,
+	IN TOUCH_POWER_QUEUE_CLASS Class,
+	OUT WDFREQUEST* Request,
+	OUT PTOUCH_POWER_PSTATE_VECTOR Target
+)
+/*++
+
+Routine Description:
+
+	Takes every request currently queued in a priority class and
+	collapses them into the last one, later requests overriding earlier
+	ones set by set. The others are parked in the wait queue and
+	completed together with it.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Class - Priority class to take the requests of
+	Request - Receives the request carrying the final target
+	Target - Receives the merged P-state vector of the burst
+
+Return Value:
+
+	NTSTATUS indicating success or failure, STATUS_NO_MORE_ENTRIES if
+	nothing is queued
+
+--*/
+{
+	WDFQUEUE queue;
+	WDFREQUEST last;
+	WDFREQUEST next;
+	NTSTATUS status;
+
+	queue = (Class == TouchPowerQueueWake) ?
+		pDeviceContext->TransitionWakeQueue :
+		pDeviceContext->TransitionQueue;
+
+	status = WdfIoQueueRetrieveNextRequest(
+		queue,
+		&last);
+
+	if (!NT_SUCCESS(status))
+	{
+		return status;
+	}
+
+	*Target = GetRequestContext(last)->Target;
+	TchStatsRecordQueueWait(pDeviceContext, Class, GetRequestContext(last));
+
+	while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(
+		queue,
+		&next)))
+	{
+		TchCoreMerge(Target, &GetRequestContext(next)->Target);
+		TchStatsRecordQueueWait(pDeviceContext, Class, GetRequestContext(next));
+
+		status = WdfRequestForwardToIoQueue(
+			last,
+			pDeviceContext->TransitionWaitQueue);
+
+		if (!NT_SUCCESS(status))
+		{
+			WdfRequestComplete(
+				last,
+				status);
+		}
+
+		InterlockedIncrement(&pDeviceContext->TransitionsCoalesced);
+		last = next;
+	}
+
+	*Request = last;
+
+	return STATUS_SUCCESS;
+}
+
+static VOID
+TchTransitionOvertake(
+	IN PTOUCH_POWER pDeviceContext,
+	IN LONG Sequence
+)
+/*++
+
+Routine Description:
+
+	Drops the digitizer power gate, P-state set 0, from the queued
+	requests that arrived before the power-on about to go out. Requests
+	that move other P-state sets as well keep those and their place in
+	the queue, requests that did nothing but power the digitizer off are
+	cancelled.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Sequence - Arrival sequence number of the power-on
+
+Return Value:
+
+	None
+
+--*/
+{
+	PTOUCH_POWER_REQUEST context;
+	WDFREQUEST previous = NULL;
+	WDFREQUEST found;
+	WDFREQUEST request;
+	NTSTATUS status;
+
+	for (;;)
+	{
+		status = WdfIoQueueFindRequest(
+			pDeviceContext->TransitionQueue,
+			previous,
+			NULL,
+			NULL,
+			&found);
+
+		if (previous != NULL)
+		{
+			WdfObjectDereference(previous);
+			previous = NULL;
+		}
+
+		//
+		// The request the search went on from was cancelled meanwhile,
+		// start over
+		//
+		if (status == STATUS_NOT_FOUND)
+		{
+			continue;
+		}
+
+		if (!NT_SUCCESS(status))
+		{
+			break;
+		}
+
+		context = GetRequestContext(found);
+
+		if (context->Sequence - Sequence >= 0 ||
+			context->Target.PStates[0] == TOUCH_POWER_NO_TARGET)
+		{
+			previous = found;
+			continue;
+		}
+
+		//
+		// Only the engine takes requests off the queue, so the target
+		// of one still queued can be changed in place
+		//
+		if (!TchTransitionPowerOffOnly(&context->Target))
+		{
+			context->Target.PStates[0] = TOUCH_POWER_NO_TARGET;
+			previous = found;
+			continue;
+		}
+
+		status = WdfIoQueueRetrieveFoundRequest(
+			pDeviceContext->TransitionQueue,
+			found,
+			&request);
+
+		WdfObjectDereference(found);
+
+		if (NT_SUCCESS(status))
+		{
+			InterlockedIncrement(&pDeviceContext->TransitionsPreempted);
+
+			WdfRequestComplete(
+				request,
+				STATUS_CANCELLED);
+		}
+	}
+}
+
+static BOOLEAN
+TchTransitionNextWake(
+	IN PTOUCH_POWER pDeviceContext,
+	OUT WDFREQUEST* Request,
+	OUT PTOUCH_POWER_PSTATE_VECTOR Target,
+	OUT PULONG Cause
+)
+/*++
+
+Routine Description:
+
+	Picks up the next power-on, which goes ahead of everything else
+	waiting for the engine: queued power-on requests first, then the
+	client votes or the driver itself asking for power-on. Requests
+	queued before it no longer move the digitizer power gate.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Request - Receives the request carrying the power-on, NULL for
+		power-on the driver started on its own
+	Target - Receives the requested P-state per set
+	Cause - Receives the TOUCH_POWER_CAUSE of the power-on
+
+Return Value:
+
+	TRUE if there is a power-on to carry out
+
+--*/
+{
+	LONG internal;
+	LONG sequence;
+
+	if (NT_SUCCESS(TchTransitionCollapse(
+		pDeviceContext,
+		TouchPowerQueueWake,
+		Request,
+		Target)))
+	{
+		*Cause = TouchPowerCauseRequest;
+		sequence = GetRequestContext(*Request)->Sequence;
+	}
+	else
+	{
+		//
+		// Power-on the driver or the client votes ask for overtakes
+		// every request queued so far. An internal power-off target is
+		// left in place for the pump to pick up in turn.
+		//
+		*Request = NULL;
+		sequence = ReadNoFence(&pDeviceContext->TransitionSequence) + 1;
+		internal = ReadNoFence(&pDeviceContext->TransitionInternal);
+
+		if (TOUCH_POWER_INTERNAL_TARGET(internal) == 1 &&
+			InterlockedCompareExchange(
+				&pDeviceContext->TransitionInternal,
+				TOUCH_POWER_INTERNAL_NONE,
+				internal) == internal)
+		{
+			*Cause = TOUCH_POWER_INTERNAL_CAUSE(internal);
+		}
+		else if (TchVoteCollect(pDeviceContext, TRUE) == 1)
+		{
+			*Cause = TouchPowerCauseVote;
+		}
+		else
+		{
+			return FALSE;
+		}
+
+		TchCoreVectorFromState(1, Target);
+	}
+
+	TchTransitionOvertake(pDeviceContext, sequence);
+
+	return TRUE;
+}
+
+static BOOLEAN
+TchTransitionWindowOpen(
+	IN PTOUCH_POWER pDeviceContext
+)
+/*++
+
+Routine Description:
+
+	Holds the first request of a burst back for the coalescing window
+	so that the requests following it can be collapsed into one
+	transition. The window timer kicks the pump once it expires.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+
+Return Value:
+
+	TRUE if the pump has to wait for the window to expire
+
+--*/
+{
+	ULONG windowMs = pDeviceContext->Config.CoalesceWindowMs;
+	ULONG queued = 0;
+
+	if (windowMs == 0 || ReadNoFence(&pDeviceContext->TransitionWindowExpired) != 0)
+	{
+		return FALSE;
+	}
+
+	//
+	// Power-on takes the fast path: with the digitizer off, whatever
+	// is queued is not held back
+	//
+	if (ReadNoFence(&pDeviceContext->Core.PStateCache[0]) == TOUCH_POWER_PSTATE_OFF)
+	{
+		return FALSE;
+	}
+
+	WdfIoQueueGetState(
+		pDeviceContext->TransitionQueue,
+		&queued,
+		NULL);
+
+	if (queued == 0)
+	{
+		return FALSE;
+	}
+
+	if (InterlockedCompareExchange(&pDeviceContext->TransitionWindowArmed, 1, 0) == 0)
+	{
+		WdfTimerStart(
+			pDeviceContext->TransitionWindowTimer,
+			WDF_REL_TIMEOUT_IN_MS(windowMs));
+	}
+
+	return TRUE;
+}
+
+static VOID
+TchTransitionReleaseHeld(
+	IN PTOUCH_POWER pDeviceContext,
+	IN OUT PTOUCH_POWER_PSTATE_VECTOR Target
+)
+/*++
+
+Routine Description:
+
+	Lets go of the power-off the policy stage held back, as it either
+	goes out now or is overtaken by a later transition. Like a collapsed
+	burst, the later transition overrides the held one set by set and
+	its requests are completed along with it, except that requests that
+	did nothing but power off are cancelled when the digitizer is
+	powered on instead.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Target - Transition going out in place of the held one, the sets
+		only the held one moves are merged into it
+
+Return Value:
+
+	None
+
+--*/
+{
+	TOUCH_POWER_PSTATE_VECTOR merged;
+	WDFREQUEST request;
+	NTSTATUS status;
+	BOOLEAN powerOn;
+
+	pDeviceContext->PolicyHeld = FALSE;
+
+	merged = pDeviceContext->PolicyHeldTarget;
+	TchCoreMerge(&merged, Target);
+	*Target = merged;
+
+	powerOn = Target->PStates[0] != TOUCH_POWER_PSTATE_OFF;
+
+	while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(
+		pDeviceContext->PolicyHeldQueue,
+		&request)))
+	{
+		if (powerOn && TchTransitionPowerOffOnly(&GetRequestContext(request)->Target))
+		{
+			InterlockedIncrement(&pDeviceContext->TransitionsPreempted);
+
+			WdfRequestComplete(
+				request,
+				STATUS_CANCELLED);
+
+			continue;
+		}
+
+		status = WdfRequestForwardToIoQueue(
+			request,
+			pDeviceContext->TransitionWaitQueue);
+
+		if (!NT_SUCCESS(status))
+		{
+			WdfRequestComplete(
+				request,
+				status);
+		}
+	}
+}
+
+static BOOLEAN
+TchTransitionAdmit(
+	IN PTOUCH_POWER pDeviceContext,
+	IN WDFREQUEST Request,
+	IN OUT PTOUCH_POWER_PSTATE_VECTOR Target,
+	IN ULONG Cause
+)
+/*++
+
+Routine Description:
+
+	Runs a transition of the digitizer power gate past the policy
+	stage. It takes the place of the power-off held back, if there is
+	one; if the stage holds it back in turn, it is parked until the
+	policy timer has the pump ask again, and the requests of its burst
+	are parked apart until it goes out or is overtaken.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Request - Request carrying the transition, NULL for transitions the
+		driver started on its own
+	Target - Requested P-state per set, receives the sets of the held
+		power-off it takes the place of
+	Cause - TOUCH_POWER_CAUSE of the transition
+
+Return Value:
+
+	FALSE if the transition is held back
+
+--*/
+{
+	ULONGLONG due;
+	ULONGLONG now;
+	NTSTATUS status;
+
+	if (Target->PStates[0] == TOUCH_POWER_NO_TARGET)
+	{
+		return TRUE;
+	}
+
+	if (pDeviceContext->PolicyHeld)
+	{
+		TchTransitionReleaseHeld(pDeviceContext, Target);
+	}
+
+	//
+	// PoFx already weighed the F-state residency before moving the
+	// component to F1, and waits for the power-off to complete it
+	//
+	if (Cause == TouchPowerCauseComponentIdle)
+	{
+		return TRUE;
+	}
+
+	due = TchPolicyAdmit(
+		&pDeviceContext->Policy,
+		Target->PStates[0] != TOUCH_POWER_PSTATE_OFF);
+
+	if (due == 0)
+	{
+		return TRUE;
+	}
+
+	pDeviceContext->PolicyHeld = TRUE;
+	pDeviceContext->PolicyHeldTarget = *Target;
+	pDeviceContext->PolicyHeldCause = Cause;
+
+	//
+	// The wait queue only holds the burst of this transition, nothing
+	// else is in flight
+	//
+	TchTransitionMoveRequests(
+		pDeviceContext->TransitionWaitQueue,
+		pDeviceContext->PolicyHeldQueue);
+
+	if (Request != NULL)
+	{
+		status = WdfRequestForwardToIoQueue(
+			Request,
+			pDeviceContext->PolicyHeldQueue);
+
+		if (!NT_SUCCESS(status))
+		{
+			WdfRequestComplete(
+				Request,
+				status);
+		}
+	}
+
+	//
+	// Negative due times are relative, in 100ns units
+	//
+	now = KeQueryInterruptTime();
+
+	WdfTimerStart(
+		pDeviceContext->PolicyTimer,
+		(due > now) ? -(LONGLONG)(due - now) : -1);
+
+	return FALSE;
+}
+
+static VOID
+TchTransitionBatchEntryDone(
+	IN PTOUCH_POWER pDeviceContext,
+	IN NTSTATUS Status
+)
+{
+	PTOUCH_POWER_BATCH batch = GetRequestContext(pDeviceContext->ActiveBatch)->Batch;
+	PTOUCH_POWER_BATCH_ENTRY entry = &batch->Entries[pDeviceContext->BatchIndex];
+
+	entry->Status = Status;
+	entry->EndTime = KeQueryInterruptTime();
+
+	pDeviceContext->BatchLastEnd = entry->EndTime;
+	pDeviceContext->BatchIndex++;
+}
+
+static VOID
+TchTransitionBatchFinish(
+	IN WDFREQUEST Request,
+	IN NTSTATUS Status
+)
+{
+	PTOUCH_POWER_BATCH batch = GetRequestContext(Request)->Batch;
+	ULONG i;
+
+	for (i = 0; i < batch->Count; i++)
+	{
+		if (batch->Entries[i].Status == STATUS_PENDING)
+		{
+			batch->Entries[i].Status = STATUS_CANCELLED;
+		}
+	}
+
+	WdfRequestCompleteWithInformation(
+		Request,
+		Status,
+		FIELD_OFFSET(TOUCH_POWER_BATCH, Entries) + batch->Count * sizeof(TOUCH_POWER_BATCH_ENTRY));
+}
+
+static BOOLEAN
+TchTransitionBatchStart(
+	IN PTOUCH_POWER pDeviceContext
+)
+{
+	WDFREQUEST request;
+	NTSTATUS status;
+
+	if (!NT_SUCCESS(WdfIoQueueRetrieveNextRequest(
+		pDeviceContext->TransitionBatchQueue,
+		&request)))
+	{
+		return FALSE;
+	}
+
+	TchStatsRecordQueueWait(
+		pDeviceContext,
+		TouchPowerQueueNormal,
+		GetRequestContext(request));
+
+	InterlockedExchange(&pDeviceContext->BatchCancelled, 0);
+
+	status = WdfRequestMarkCancelableEx(
+		request,
+		TchTransitionOnBatchCancel);
+
+	if (!NT_SUCCESS(status))
+	{
+		TchTransitionBatchFinish(request, status);
+		return TRUE;
+	}
+
+	pDeviceContext->ActiveBatch = request;
+	pDeviceContext->BatchIndex = 0;
+	pDeviceContext->BatchStart = KeQueryInterruptTime();
+	pDeviceContext->BatchLastEnd = pDeviceContext->BatchStart;
+
+	return TRUE;
+}
+
+static BOOLEAN
+TchTransitionBatchStep(
+	IN PTOUCH_POWER pDeviceContext
+)
+/*++
+
+Routine Description:
+
+	Carries out the next entry of the active batch. An entry is not
+	started before its delay (counted from the end of the previous
+	entry) or its deadline (counted from the start of the batch) has
+	passed; the batch timer kicks the pump once it has. The batch owns
+	the engine until its last entry is done or it is cancelled, except
+	for power-on, which may go out while the batch waits for an entry to
+	become due. An entry already at the PEP is waited for.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+
+Return Value:
+
+	FALSE if the pump has to wait for the batch timer
+
+--*/
+{
+	WDFREQUEST request = pDeviceContext->ActiveBatch;
+	PTOUCH_POWER_BATCH batch = GetRequestContext(request)->Batch;
+	PTOUCH_POWER_BATCH_ENTRY entry;
+	TOUCH_POWER_PSTATE_VECTOR target;
+	ULONGLONG now;
+	ULONGLONG due;
+	NTSTATUS status;
+	ULONG i;
+
+	if (ReadNoFence(&pDeviceContext->BatchCancelled) != 0)
+	{
+		pDeviceContext->ActiveBatch = NULL;
+		TchTransitionBatchFinish(request, STATUS_CANCELLED);
+
+		return TRUE;
+	}
+
+	if (pDeviceContext->BatchIndex == batch->Count)
+	{
+		//
+		// The cancel routine completes the batch if it got there
+		// first, it kicks the pump once it has flagged it
+		//
+		if (WdfRequestUnmarkCancelable(request) == STATUS_CANCELLED)
+		{
+			return FALSE;
+		}
+
+		pDeviceContext->ActiveBatch = NULL;
+		TchTransitionBatchFinish(request, STATUS_SUCCESS);
+
+		return TRUE;
+	}
+
+	entry = &batch->Entries[pDeviceContext->BatchIndex];
+
+	due = (entry->Flags & TOUCH_POWER_BATCH_DEADLINE) ?
+		pDeviceContext->BatchStart :
+		pDeviceContext->BatchLastEnd;
+	due += (ULONGLONG)entry->TimeUs * 10;
+
+	now = KeQueryInterruptTime();
+
+	if (now < due)
+	{
+		if (InterlockedCompareExchange(&pDeviceContext->BatchTimerArmed, 1, 0) == 0)
+		{
+			//
+			// Negative due times are relative, in 100ns units
+			//
+			WdfTimerStart(
+				pDeviceContext->TransitionBatchTimer,
+				-(LONGLONG)(due - now));
+		}
+
+		return FALSE;
+	}
+
+	entry->StartTime = now;
+
+	for (i = 0; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+	{
+		target.PStates[i] = TOUCH_POWER_NO_TARGET;
+	}
+
+	target.PStates[entry->SetIndex] = (LONG)entry->PStateIndex;
+
+	if (TchCoreElide(&pDeviceContext->Core, &target))
+	{
+		InterlockedIncrement(&pDeviceContext->TransitionsElided);
+		TchTransitionBatchEntryDone(pDeviceContext, STATUS_SUCCESS);
+
+		return TRUE;
+	}
+
+	InterlockedExchange(&pDeviceContext->TransitionInFlight, 1);
+	InterlockedIncrement(&pDeviceContext->TransitionsIssued);
+
+	status = TchPowerSetPStates(
+		pDeviceContext,
+		&target,
+		request,
+		TouchPowerCauseBatch);
+
+	if (status == STATUS_PENDING)
+	{
+		return TRUE;
+	}
+
+	InterlockedExchange(&pDeviceContext->TransitionInFlight, 0);
+	TchTransitionBatchEntryDone(pDeviceContext, status);
+
+	return TRUE;
+}
+
+static VOID
+TchTransitionPump(
+	IN PTOUCH_POWER pDeviceContext
+)
+/*++
+
+Routine Description:
+
+	Carries out queued transitions, power-on first and everything else
+	in arrival order. Only one instance runs at a time, a kick that
+	comes in while the pump is active makes it go around once more so
+	that no request is left behind.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+
+Return Value:
+
+	None
+
+--*/
+{
+	WDFREQUEST request;
+	TOUCH_POWER_PSTATE_VECTOR target;
+	LONG internalState;
+	LONG internal;
+	ULONG cause;
+	NTSTATUS status;
+
+	do
+	{
+		if (InterlockedCompareExchange(&pDeviceContext->TransitionPumpActive, 1, 0) != 0)
+		{
+			return;
+		}
+
+		InterlockedExchange(&pDeviceContext->TransitionPumpKick, 0);
+
+		for (;;)
+		{
+			//
+			// Transitions are carried out one at a time, a transition
+			// the PEP has not confirmed yet holds up the ones behind it
+			//
+			if (ReadNoFence(&pDeviceContext->TransitionInFlight) != 0)
+			{
+				break;
+			}
+
+			//
+			// Power-on goes out right away, ahead of whatever else is
+			// waiting for the engine
+			//
+			if (!TchTransitionNextWake(pDeviceContext, &request, &target, &cause))
+			{
+				if (pDeviceContext->ActiveBatch != NULL)
+				{
+					if (!TchTransitionBatchStep(pDeviceContext))
+					{
+						break;
+					}
+
+					continue;
+				}
+
+				if (TchTransitionWindowOpen(pDeviceContext))
+				{
+					break;
+				}
+
+				status = TchTransitionCollapse(
+					pDeviceContext,
+					TouchPowerQueueNormal,
+					&request,
+					&target);
+
+				if (!NT_SUCCESS(status))
+				{
+					//
+					// Nothing queued from user mode, pick up a change in
+					// the outcome of the client votes, then a transition
+					// the driver asked for on its own
+					//
+					cause = TouchPowerCauseVote;
+					internalState = TchVoteCollect(pDeviceContext, FALSE);
+
+					if (internalState == TOUCH_POWER_NO_TARGET)
+					{
+						internal = InterlockedExchange(
+							&pDeviceContext->TransitionInternal,
+							TOUCH_POWER_INTERNAL_NONE);
+
+						internalState = TOUCH_POWER_INTERNAL_TARGET(internal);
+						cause = TOUCH_POWER_INTERNAL_CAUSE(internal);
+					}
+
+					request = NULL;
+
+					if (internalState != TOUCH_POWER_NO_TARGET)
+					{
+						TchCoreVectorFromState((DWORD)internalState, &target);
+					}
+					else if (pDeviceContext->PolicyHeld &&
+						InterlockedExchange(&pDeviceContext->PolicyTimerExpired, 0) != 0)
+					{
+						//
+						// A power-off the policy stage held back is due
+						//
+						target = pDeviceContext->PolicyHeldTarget;
+						cause = pDeviceContext->PolicyHeldCause;
+					}
+					else
+					{
+						//
+						// Batches go last, they hold the engine for as
+						// long as they run
+						//
+						if (TchTransitionBatchStart(pDeviceContext))
+						{
+							continue;
+						}
+
+						break;
+					}
+				}
+				else
+				{
+					cause = TouchPowerCauseRequest;
+				}
+			}
+
+			InterlockedExchange(&pDeviceContext->TransitionWindowExpired, 0);
+			InterlockedExchange(&pDeviceContext->TransitionWindowArmed, 0);
+
+			if (!TchTransitionAdmit(pDeviceContext, request, &target, cause))
+			{
+				continue;
+			}
+
+			if (TchCoreElide(&pDeviceContext->Core, &target))
+			{
+				InterlockedIncrement(&pDeviceContext->TransitionsElided);
+
+				TchTransitionCompleteBurst(
+					pDeviceContext,
+					request,
+					STATUS_SUCCESS,
+					cause);
+
+				continue;
+			}
+
+			pDeviceContext->TransitionCause = cause;
+			InterlockedExchange(&pDeviceContext->TransitionInFlight, 1);
+			InterlockedIncrement(&pDeviceContext->TransitionsIssued);
+
+			status = TchPowerSetPStates(
+				pDeviceContext,
+				&target,
+				request,
+				cause);
+
+			if (status == STATUS_PENDING)
+			{
+				continue;
+			}
+
+			InterlockedExchange(&pDeviceContext->TransitionInFlight, 0);
+
+			TchTransitionCompleteBurst(
+				pDeviceContext,
+				request,
+				status,
+				cause);
+		}
+
+		InterlockedExchange(&pDeviceContext->TransitionPumpActive, 0);
+
+	} while (InterlockedCompareExchange(&pDeviceContext->TransitionPumpKick, 0, 0) != 0);
+}
+
+VOID
+TchTransitionWorkItem(
+	IN WDFWORKITEM WorkItem
+)
+{
+	PTOUCH_POWER devContext;
+
+	PAGED_CODE();
+
+	devContext = GetDeviceContext(WdfWorkItemGetParentObject(WorkItem));
+
+	TchTransitionPump(devContext);
+}
+
+VOID
+TchTransitionOnWindowExpired(
+	IN WDFTIMER Timer
+)
+{
+	PTOUCH_POWER devContext;
+
+	devContext = GetDeviceContext(WdfTimerGetParentObject(Timer));
+
+	InterlockedExchange(&devContext->TransitionWindowExpired, 1);
+	TchTransitionKick(devContext);
+}
+
+VOID
+TchTransitionOnPolicyTimer(
+	IN WDFTIMER Timer
+)
+{
+	PTOUCH_POWER devContext;
+
+	devContext = GetDeviceContext(WdfTimerGetParentObject(Timer));
+
+	InterlockedExchange(&devContext->PolicyTimerExpired, 1);
+	TchTransitionKick(devContext);
+}
+
+VOID
+TchTransitionOnBatchTimer(
+	IN WDFTIMER Timer
+)
+{
+	PTOUCH_POWER devContext;
+
+	devContext = GetDeviceContext(WdfTimerGetParentObject(Timer));
+
+	InterlockedExchange(&devContext->BatchTimerArmed, 0);
+	TchTransitionKick(devContext);
+}
+
+VOID
+TchTransitionOnBatchCancel(
+	IN WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+	Cancels the active batch. The entry waiting for its delay or
+	deadline is dropped along with the batch timer, and the pump
+	completes the batch as soon as no entry of it is at the PEP.
+
+Arguments:
+
+	Request - Batch request being cancelled
+
+Return Value:
+
+	None
+
+--*/
+{
+	PTOUCH_POWER devContext;
+
+	devContext = GetDeviceContext(WdfPdoGetParent(WdfIoQueueGetDevice(WdfRequestGetIoQueue(Request))));
+
+	InterlockedExchange(&devContext->BatchCancelled, 1);
+
+	if (WdfTimerStop(devContext->TransitionBatchTimer, FALSE))
+	{
+		InterlockedExchange(&devContext->BatchTimerArmed, 0);
+	}
+
+	TchTransitionKick(devContext);
+}
+
+VOID
+TchTransitionComplete(
+	IN PTOUCH_POWER pDeviceContext,
+	IN WDFREQUEST Request,
+	IN NTSTATUS Status
+)
+/*++
+
+Routine Description:
+
+	Completes a request whose transition the PEP left pending, or
+	records the result if it was an entry of the active batch, and lets
+	the engine move on to the next queued transition. May be called at
+	DISPATCH_LEVEL.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Request - Request that was waiting on the transition
+	Status - Outcome of the transition
+
+Return Value:
+
+	None
+
+--*/
+{
+	if (Request != NULL && Request == pDeviceContext->ActiveBatch)
+	{
+		TchTransitionBatchEntryDone(pDeviceContext, Status);
+	}
+	else
+	{
+		TchTransitionCompleteBurst(
+			pDeviceContext,
+			Request,
+			Status,
+			pDeviceContext->TransitionCause);
+	}
+
+	InterlockedExchange(&pDeviceContext->TransitionInFlight, 0);
+	TchTransitionKick(pDeviceContext);
+}
+
+NTSTATUS
+TchTransitionSubmit(
+	IN PTOUCH_POWER pDeviceContext,
+	IN WDFREQUEST Request,
+	IN PTOUCH_POWER_PSTATE_VECTOR Target
+)
+/*++
+
+Routine Description:
+
+	Hands a transition request over to the transition engine. Requests
+	that power the digitizer on are queued in the wake class, all
+	others in the normal class. On success the request belongs to the
+	engine and must not be touched by the caller anymore.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Request - Framework request object handle
+	Target - Requested P-state per set
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	PTOUCH_POWER_REQUEST context = GetRequestContext(Request);
+	NTSTATUS status;
+
+	context->Target = *Target;
+	context->Sequence = InterlockedIncrement(&pDeviceContext->TransitionSequence);
+	context->QueuedTime = KeQueryInterruptTime();
+
+	status = WdfRequestForwardToIoQueue(
+		Request,
+		(Target->PStates[0] != TOUCH_POWER_NO_TARGET &&
+			Target->PStates[0] != TOUCH_POWER_PSTATE_OFF) ?
+			pDeviceContext->TransitionWakeQueue :
+			pDeviceContext->TransitionQueue);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_POWER,
+			"Error forwarding request to transition queue - %!STATUS!",
+			status);
+
+		return status;
+	}
+
+	InterlockedIncrement(&pDeviceContext->TransitionsRequested);
+	TchTransitionKick(pDeviceContext);
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+TchTransitionSubmitBatch(
+	IN PTOUCH_POWER pDeviceContext,
+	IN WDFREQUEST Request,
+	IN PTOUCH_POWER_BATCH Batch
+)
+/*++
+
+Routine Description:
+
+	Hands a validated batch over to the transition engine. Results are
+	written back into the entries in place, so Batch has to be the
+	request's buffered I/O buffer.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Request - Framework request object handle
+	Batch - Batch, both input and output of the request
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	NTSTATUS status;
+
+	GetRequestContext(Request)->Batch = Batch;
+	GetRequestContext(Request)->QueuedTime = KeQueryInterruptTime();
+
+	status = WdfRequestForwardToIoQueue(
+		Request,
+		pDeviceContext->TransitionBatchQueue);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_POWER,
+			"Error forwarding request to batch queue - %!STATUS!",
+			status);
+
+		return status;
+	}
+
+	TchTransitionKick(pDeviceContext);
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+TchTransitionSubmitInternal(
+	IN PTOUCH_POWER pDeviceContext,
+	IN DWORD TargetState,
+	IN ULONG Cause
+)
+/*++
+
+Routine Description:
+
+	Asks the transition engine for a transition the driver decided on
+	by itself, such as powering down after the idle timeout. Power-on
+	is served ahead of queued user requests, power-off after them. May
+	be called at DISPATCH_LEVEL.
+
+	The idle timeout, the F-states, the display and schedules share one
+	pending target, and the latest one wins whatever its cause: each of
+	them is decided on the state of things when it is submitted, which
+	the one it replaces no longer reflects. The transition is recorded
+	and notified with the cause of the target that went out. Replaced
+	targets are counted and traced, and an F-state change waiting for
+	one is completed.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	TargetState - Requested digitizer state, 1 for on, 0 for off
+	Cause - TOUCH_POWER_CAUSE reported if the power state changes
+
+Return Value:
+
+	None
+
+--*/
+{
+	LONG previous;
+
+	previous = InterlockedExchange(
+		&pDeviceContext->TransitionInternal,
+		TOUCH_POWER_INTERNAL_PACK(TargetState, Cause));
+
+	if (TOUCH_POWER_INTERNAL_TARGET(previous) != TOUCH_POWER_NO_TARGET)
+	{
+		InterlockedIncrement(&pDeviceContext->TransitionsInternalReplaced);
+
+		Trace(
+			TRACE_LEVEL_INFORMATION,
+			TRACE_POWER,
+			"Internal target %d (cause %lu) replaced by %lu (cause %lu)",
+			TOUCH_POWER_INTERNAL_TARGET(previous),
+			TOUCH_POWER_INTERNAL_CAUSE(previous),
+			TargetState,
+			Cause);
+
+		TchIdleTransitionDone(
+			pDeviceContext,
+			TOUCH_POWER_INTERNAL_CAUSE(previous));
+	}
+
+	TchTransitionKick(pDeviceContext);
+}
+
+NTSTATUS
+TchTransitionInitialize(
+	IN WDFDEVICE Device,
+	IN WDFDEVICE ChildDevice
+)
+/*++
+
+Routine Description:
+
+	Creates the manual queues pending toggle requests and batches are
+	parked in, the work item that drains them and the engine's timers.
+	The queues have to live on the test PDO since requests are
+	forwarded to them from the PDO's default queue.
+
+Arguments:
+
+	Device - Framework device object representing the actual touch device
+	ChildDevice - Framework device object representing the test PDO
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	NTSTATUS status;
+	PTOUCH_POWER devContext;
+	WDF_IO_QUEUE_CONFIG queueConfig;
+	WDF_WORKITEM_CONFIG workItemConfig;
+	WDF_TIMER_CONFIG timerConfig;
+	WDF_OBJECT_ATTRIBUTES objectAttributes;
+
+	PAGED_CODE();
+
+	devContext = GetDeviceContext(Device);
+	devContext->TransitionInternal = TOUCH_POWER_INTERNAL_NONE;
+
+	//
+	// Transitions must make progress regardless of the PDO's own
+	// device power state, so the queues are not power managed
+	//
+	WDF_IO_QUEUE_CONFIG_INIT(
+		&queueConfig,
+		WdfIoQueueDispatchManual);
+
+	queueConfig.PowerManaged = WdfFalse;
+
+	status = WdfIoQueueCreate(
+		ChildDevice,
+		&queueConfig,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&devContext->TransitionQueue);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating transition queue - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	status = WdfIoQueueCreate(
+		ChildDevice,
+		&queueConfig,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&devContext->TransitionWakeQueue);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating transition wake queue - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	status = WdfIoQueueCreate(
+		ChildDevice,
+		&queueConfig,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&devContext->TransitionWaitQueue);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating transition wait queue - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	status = WdfIoQueueCreate(
+		ChildDevice,
+		&queueConfig,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&devContext->PolicyHeldQueue);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating policy held queue - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	status = WdfIoQueueCreate(
+		ChildDevice,
+		&queueConfig,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&devContext->TransitionBatchQueue);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating transition batch queue - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	WDF_WORKITEM_CONFIG_INIT(
+		&workItemConfig,
+		TchTransitionWorkItem);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&objectAttributes);
+	objectAttributes.ParentObject = Device;
+
+	status = WdfWorkItemCreate(
+		&workItemConfig,
+		&objectAttributes,
+		&devContext->TransitionWorkItem);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating transition work item - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	WDF_TIMER_CONFIG_INIT(
+		&timerConfig,
+		TchTransitionOnWindowExpired);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&objectAttributes);
+	objectAttributes.ParentObject = Device;
+
+	status = WdfTimerCreate(
+		&timerConfig,
+		&objectAttributes,
+		&devContext->TransitionWindowTimer);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating coalescing window timer - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	WDF_TIMER_CONFIG_INIT(
+		&timerConfig,
+		TchTransitionOnBatchTimer);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&objectAttributes);
+	objectAttributes.ParentObject = Device;
+
+	status = WdfTimerCreate(
+		&timerConfig,
+		&objectAttributes,
+		&devContext->TransitionBatchTimer);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating batch timer - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+	TchPolicyInitialize(
+		&devContext->Policy,
+		&TchPolicyHysteresis,
+		&devContext->Config.Policy);
+
+	WDF_TIMER_CONFIG_INIT(
+		&timerConfig,
+		TchTransitionOnPolicyTimer);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&objectAttributes);
+	objectAttributes.ParentObject = Device;
+
+	status = WdfTimerCreate(
+		&timerConfig,
+		&objectAttributes,
+		&devContext->PolicyTimer);
+
+	if (!NT_SUCCESS(status))
+	{
+		Trace(
+			TRACE_LEVEL_ERROR,
+			TRACE_INIT,
+			"Error creating policy timer - %!STATUS!",
+			status);
+
+		goto exit;
+	}
+
+exit:
+
+	return status;
+}
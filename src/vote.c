@@ -0,0 +1,328 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		vote.c
+
+	Abstract:
+
+		Arbitrates the power votes of the clients holding a handle to
+		the test device or the direct interface (see direct.c). Each
+		handle or interface holds at most one vote; the driver
+		keeps a count of votes per priority and kind, so that working
+		out the outcome costs the same no matter how many clients vote.
+
+		Casting or withdrawing a vote only kicks the transition engine,
+		which collects the outcome when it gets to it and only moves the
+		digitizer when the outcome changed since it last did, or when
+		another path moved the digitizer away from it and a vote came in
+		since. A burst of votes therefore reaches the PEP at most once.
+
+	Environment:
+
+		Kernel mode
+
+	Revision History:
+
+--*/
+
+#include <internal.h>
+#include <power.h>
+#include <transition.h>
+#include <vote.h>
+#include <vote.tmh>
+
+//
+// A handle's vote as kept in its file object context, 0 for none
+//
+#define TOUCH_POWER_VOTE_PACK(vote, priority)   ((LONG)(((priority) << 8) | (vote)))
+#define TOUCH_POWER_VOTE_TYPE(packed)           ((ULONG)(packed) & 0xFF)
+#define TOUCH_POWER_VOTE_PRIORITY(packed)       ((ULONG)(packed) >> 8)
+
+static VOID
+TchVoteCount(
+	IN PTOUCH_POWER pDeviceContext,
+	IN LONG Vote,
+	IN LONG Delta
+)
+{
+	switch (TOUCH_POWER_VOTE_TYPE(Vote))
+	{
+	case TouchPowerVoteNeedOn:
+		InterlockedAdd(&pDeviceContext->VoteNeedOn[TOUCH_POWER_VOTE_PRIORITY(Vote)], Delta);
+		break;
+
+	case TouchPowerVoteAllowOff:
+		InterlockedAdd(&pDeviceContext->VoteAllowOff[TOUCH_POWER_VOTE_PRIORITY(Vote)], Delta);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static VOID
+TchVoteSwap(
+	IN PTOUCH_POWER pDeviceContext,
+	IN PTOUCH_POWER_FILE File,
+	IN LONG Vote
+)
+/*++
+
+Routine Description:
+
+	Replaces the vote of a handle. The new vote is counted before the
+	old one is dropped, so that the transition engine, which may look
+	at the counts in between, sees either the old or the new outcome
+	but never one the handle did not vote for.
+
+	Swaps on the same handle are serialized by publishing the new vote
+	with a compare-exchange against the vote counted as the previous
+	one: a swap that lost the race takes its count back and retries.
+	The vote a swap drops has therefore always been counted by the swap
+	that put it in place, and no count ever goes below zero. The counts
+	are left alone when the vote does not change, but the engine is
+	kicked all the same.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	File - File object context of the handle
+	Vote - New vote, packed
+
+Return Value:
+
+	None
+
+--*/
+{
+	LONG previous;
+
+	for (;;)
+	{
+		previous = ReadNoFence(&File->Vote);
+		if (previous == Vote)
+		{
+			//
+			// A handle that had no vote and still has none, being
+			// closed for instance, changes nothing
+			//
+			if (Vote == 0)
+			{
+				return;
+			}
+
+			break;
+		}
+
+		TchVoteCount(pDeviceContext, Vote, 1);
+
+		if (InterlockedCompareExchange(&File->Vote, Vote, previous) == previous)
+		{
+			TchVoteCount(pDeviceContext, previous, -1);
+			break;
+		}
+
+		TchVoteCount(pDeviceContext, Vote, -1);
+	}
+
+	//
+	// Casting the same vote again still counts as a vote cast, it
+	// re-asserts the outcome if another path moved the digitizer since
+	//
+	InterlockedExchange(&pDeviceContext->VoteChanged, TRUE);
+	TchTransitionKick(pDeviceContext);
+}
+
+VOID
+TchVoteInitialize(
+	IN PTOUCH_POWER pDeviceContext
+)
+{
+	pDeviceContext->VoteOutcome = TOUCH_POWER_NO_TARGET;
+}
+
+NTSTATUS
+TchVoteCast(
+	IN PTOUCH_POWER pDeviceContext,
+	IN PTOUCH_POWER_FILE Voter,
+	IN PTOUCH_POWER_VOTE Vote
+)
+/*++
+
+Routine Description:
+
+	Replaces the vote of a handle or direct interface. May be called at
+	DISPATCH_LEVEL.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Voter - Vote kept for the handle or interface
+	Vote - Vote and its priority
+
+Return Value:
+
+	NTSTATUS indicating success or failure
+
+--*/
+{
+	if (Vote->Vote >= TouchPowerVoteTypeCount ||
+		Vote->Priority >= TOUCH_POWER_VOTE_PRIORITIES)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	TchVoteSwap(
+		pDeviceContext,
+		Voter,
+		(Vote->Vote == TouchPowerVoteNone) ? 0 : TOUCH_POWER_VOTE_PACK(Vote->Vote, Vote->Priority));
+
+	InterlockedIncrement(&pDeviceContext->VotesCast);
+
+	Trace(
+		TRACE_LEVEL_VERBOSE,
+		TRACE_POWER,
+		"Vote %lu at priority %lu",
+		Vote->Vote,
+		Vote->Priority);
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+TchVoteRelease(
+	IN PTOUCH_POWER pDeviceContext,
+	IN PTOUCH_POWER_FILE Voter
+)
+/*++
+
+Routine Description:
+
+	Withdraws the vote of a handle that is being closed or a direct
+	interface that is being let go of.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	Voter - Vote kept for the handle or interface
+
+Return Value:
+
+	None
+
+--*/
+{
+	TchVoteSwap(pDeviceContext, Voter, 0);
+}
+
+LONG
+TchVoteOutcome(
+	IN PTOUCH_POWER pDeviceContext
+)
+/*++
+
+Routine Description:
+
+	Works out the outcome of all votes as they stand. May be called at
+	DISPATCH_LEVEL.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+
+Return Value:
+
+	1 if the votes keep the digitizer on, 0 if they allow it off,
+	TOUCH_POWER_NO_TARGET if nobody votes
+
+--*/
+{
+	LONG priority;
+
+	for (priority = TOUCH_POWER_VOTE_PRIORITIES - 1; priority >= 0; priority--)
+	{
+		if (ReadNoFence(&pDeviceContext->VoteNeedOn[priority]) != 0)
+		{
+			return 1;
+		}
+
+		if (ReadNoFence(&pDeviceContext->VoteAllowOff[priority]) != 0)
+		{
+			return 0;
+		}
+	}
+
+	return TOUCH_POWER_NO_TARGET;
+}
+
+LONG
+TchVoteCollect(
+	IN PTOUCH_POWER pDeviceContext,
+	IN BOOLEAN PowerOnOnly
+)
+/*++
+
+Routine Description:
+
+	Works out the outcome of all votes. Called by the transition engine
+	only, which serializes calls.
+
+Arguments:
+
+	pDeviceContext - Touch power device context
+	PowerOnOnly - Only pick up an outcome that powers the digitizer on,
+		any other change is left for a later call
+
+Return Value:
+
+	The digitizer state to move to, 1 for on and 0 for off, if the
+	outcome changed since the last call or a vote was cast since and the
+	digitizer is not in the state it asks for, TOUCH_POWER_NO_TARGET
+	otherwise
+
+--*/
+{
+	LONG outcome;
+	BOOLEAN changed;
+
+	outcome = TchVoteOutcome(pDeviceContext);
+
+	if (PowerOnOnly && outcome != 1)
+	{
+		return TOUCH_POWER_NO_TARGET;
+	}
+
+	//
+	// VoteOutcome is only what this layer last carried out; a toggle,
+	// the idle policy, the display or a schedule may have moved the
+	// digitizer since. An unchanged outcome is therefore carried out
+	// again when a vote was cast since and the digitizer is not where
+	// the outcome wants it, but left alone otherwise so that the votes
+	// do not fight those on every kick of the engine.
+	//
+	changed = InterlockedExchange(&pDeviceContext->VoteChanged, FALSE) != FALSE;
+
+	//
+	// With no votes left the digitizer stays as it is, and the next
+	// vote is carried out whatever it is
+	//
+	if (outcome == TOUCH_POWER_NO_TARGET)
+	{
+		pDeviceContext->VoteOutcome = TOUCH_POWER_NO_TARGET;
+		return TOUCH_POWER_NO_TARGET;
+	}
+
+	if (outcome == pDeviceContext->VoteOutcome &&
+		(!changed || (LONG)TchPowerGetState(pDeviceContext) == outcome))
+	{
+		return TOUCH_POWER_NO_TARGET;
+	}
+
+	pDeviceContext->VoteOutcome = outcome;
+
+	InterlockedIncrement(&pDeviceContext->VoteOutcomeChanges);
+
+	return outcome;
+}
@@ -0,0 +1,583 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		bench.c
+
+	Abstract:
+
+		Microbenchmark of the power core against the simulated PEP.
+
+		The toggle benchmark runs what IOCTL_TOUCH_POWER_TOGGLE runs
+		once the transition engine picks a request up: the on/off
+		vector is built, elided against the P-state cache and handed to
+		TchCoreSetPStates, which goes through the PEP request path and
+		commits the result. The state benchmark is IOCTL_TOUCH_POWER_STATE.
+		Both run on 1 to --threads threads; concurrent toggles that find
+		another transition in flight are counted as busy, as the driver
+		would fail them with STATUS_DEVICE_BUSY.
+
+		Results are written as JSON, one benchmark per line. With
+		--compare the run is checked against an earlier result and the
+		process fails if throughput, CPU time or allocations per
+		operation regressed by more than --threshold percent.
+
+	Environment:
+
+		User mode
+
+	Revision History:
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include "fakepep.h"
+
+#define TOUCH_BENCH_MAX_THREADS         64
+#define TOUCH_BENCH_MAX_RESULTS         32
+
+typedef enum _TOUCH_BENCH_KIND
+{
+	BenchToggle = 0,
+	BenchState,
+	BenchKindCount
+} TOUCH_BENCH_KIND;
+
+static const char* const TchBenchNames[BenchKindCount] =
+{
+	"toggle",
+	"state"
+};
+
+typedef struct _TOUCH_BENCH_RESULT
+{
+	char Name[32];
+	ULONG Threads;
+	ULONGLONG Ops;
+	ULONGLONG Busy;
+	double OpsPerSec;
+	double NsPerOp;
+	double CpuNsPerOp;
+	double AllocsPerOp;
+} TOUCH_BENCH_RESULT, *PTOUCH_BENCH_RESULT;
+
+//
+// Workers count into their own cache line
+//
+typedef struct __attribute__((aligned(64))) _TOUCH_BENCH_WORKER
+{
+	pthread_t Thread;
+	PTOUCH_FAKE_PEP Pep;
+	TOUCH_BENCH_KIND Kind;
+	volatile LONG* Start;
+	volatile LONG* Stop;
+	ULONGLONG Ops;
+	ULONGLONG Busy;
+	ULONG Sink;
+} TOUCH_BENCH_WORKER, *PTOUCH_BENCH_WORKER;
+
+//
+// Allocations made by the core and the simulated PEP. The build wraps
+// the allocator for this executable where the linker supports it.
+//
+static volatile LONG64 TchBenchAllocations;
+
+#ifdef TOUCH_BENCH_COUNT_ALLOCATIONS
+
+void* __real_malloc(size_t Size);
+void* __real_calloc(size_t Count, size_t Size);
+void* __real_realloc(void* Pointer, size_t Size);
+
+void*
+__wrap_malloc(
+	size_t Size
+)
+{
+	InterlockedAdd64(&TchBenchAllocations, 1);
+	return __real_malloc(Size);
+}
+
+void*
+__wrap_calloc(
+	size_t Count,
+	size_t Size
+)
+{
+	InterlockedAdd64(&TchBenchAllocations, 1);
+	return __real_calloc(Count, Size);
+}
+
+void*
+__wrap_realloc(
+	void* Pointer,
+	size_t Size
+)
+{
+	InterlockedAdd64(&TchBenchAllocations, 1);
+	return __real_realloc(Pointer, Size);
+}
+
+#endif
+
+static LONGLONG
+TchBenchCpuNs(
+	VOID
+)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+
+	return (LONGLONG)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void*
+TchBenchWorker(
+	IN void* Context
+)
+{
+	PTOUCH_BENCH_WORKER worker = (PTOUCH_BENCH_WORKER)Context;
+	TOUCH_POWER_PSTATE_VECTOR target;
+	NTSTATUS status;
+	DWORD state;
+
+	while (!ReadAcquire(worker->Start))
+	{
+	}
+
+	while (!ReadNoFence(worker->Stop))
+	{
+		if (worker->Kind == BenchState)
+		{
+			worker->Sink += TchCoreGetState(&worker->Pep->Core);
+			worker->Ops++;
+			continue;
+		}
+
+		state = TchCoreGetState(&worker->Pep->Core) ? 0 : 1;
+
+		TchCoreVectorFromState(state, &target);
+
+		if (TchCoreElide(&worker->Pep->Core, &target))
+		{
+			continue;
+		}
+
+		status = TchFakePepSetPStates(worker->Pep, &target, 1);
+
+		if (status == STATUS_DEVICE_BUSY)
+		{
+			//
+			// Let the transition in flight finish rather than spin
+			// against it
+			//
+			worker->Busy++;
+			sched_yield();
+		}
+		else
+		{
+			worker->Ops++;
+		}
+	}
+
+	return NULL;
+}
+
+static int
+TchBenchRun(
+	IN const TOUCH_FAKE_PEP_CONFIG* Config,
+	IN TOUCH_BENCH_KIND Kind,
+	IN ULONG Threads,
+	IN ULONG DurationMs,
+	OUT PTOUCH_BENCH_RESULT Result
+)
+{
+	static TOUCH_BENCH_WORKER workers[TOUCH_BENCH_MAX_THREADS];
+	TOUCH_FAKE_PEP pep;
+	volatile LONG start = 0;
+	volatile LONG stop = 0;
+	struct timespec duration;
+	LONGLONG wallStart, wallEnd, cpuStart, cpuEnd;
+	LONG64 allocations;
+	ULONG i;
+
+	if (!NT_SUCCESS(TchFakePepInitialize(&pep, Config)))
+	{
+		return -1;
+	}
+
+	for (i = 0; i < Threads; i++)
+	{
+		memset(&workers[i], 0, sizeof(workers[i]));
+		workers[i].Pep = &pep;
+		workers[i].Kind = Kind;
+		workers[i].Start = &start;
+		workers[i].Stop = &stop;
+
+		if (pthread_create(&workers[i].Thread, NULL, TchBenchWorker, &workers[i]) != 0)
+		{
+			InterlockedExchange(&stop, 1);
+			InterlockedExchange(&start, 1);
+			Threads = i;
+			break;
+		}
+	}
+
+	duration.tv_sec = DurationMs / 1000;
+	duration.tv_nsec = (long)(DurationMs % 1000) * 1000000;
+
+	allocations = ReadNoFence64(&TchBenchAllocations);
+	cpuStart = TchBenchCpuNs();
+	wallStart = TchPlatQueryTicks();
+
+	InterlockedExchange(&start, 1);
+	nanosleep(&duration, NULL);
+	InterlockedExchange(&stop, 1);
+
+	for (i = 0; i < Threads; i++)
+	{
+		pthread_join(workers[i].Thread, NULL);
+	}
+
+	wallEnd = TchPlatQueryTicks();
+	cpuEnd = TchBenchCpuNs();
+	allocations = ReadNoFence64(&TchBenchAllocations) - allocations;
+
+	TchFakePepCleanup(&pep);
+
+	memset(Result, 0, sizeof(*Result));
+	snprintf(Result->Name, sizeof(Result->Name), "%s", TchBenchNames[Kind]);
+	Result->Threads = Threads;
+
+	for (i = 0; i < Threads; i++)
+	{
+		Result->Ops += workers[i].Ops;
+		Result->Busy += workers[i].Busy;
+	}
+
+	if (Result->Ops != 0)
+	{
+		Result->OpsPerSec = (double)Result->Ops * 1e9 / (double)(wallEnd - wallStart);
+		Result->NsPerOp = (double)(wallEnd - wallStart) / (double)Result->Ops;
+
+		//
+		// Toggles that found the engine busy are overhead of the ones
+		// that went through
+		//
+		Result->CpuNsPerOp = (double)(cpuEnd - cpuStart) / (double)Result->Ops;
+		Result->AllocsPerOp = (double)allocations / (double)Result->Ops;
+	}
+
+	return 0;
+}
+
+static VOID
+TchBenchWrite(
+	IN FILE* Output,
+	IN const TOUCH_FAKE_PEP_CONFIG* Config,
+	IN ULONG DurationMs,
+	IN const TOUCH_BENCH_RESULT* Results,
+	IN ULONG Count
+)
+{
+	ULONG i;
+
+	fprintf(Output, "{\n");
+	fprintf(Output, "  \"version\": 1,\n");
+	fprintf(Output, "  \"duration_ms\": %u,\n", DurationMs);
+	fprintf(Output, "  \"pep_latency_us\": %u,\n", Config->MeanUs);
+	fprintf(Output, "  \"pep_pending_percent\": %u,\n", Config->Wait1Percent + Config->Wait3Percent);
+	fprintf(Output, "  \"benchmarks\": [\n");
+
+	for (i = 0; i < Count; i++)
+	{
+		fprintf(Output,
+			"    {\"name\": \"%s\", \"threads\": %u, \"ops\": %llu, \"busy\": %llu, "
+			"\"ops_per_sec\": %.1f, \"ns_per_op\": %.2f, \"cpu_ns_per_op\": %.2f, "
+			"\"allocs_per_op\": %.4f}%s\n",
+			Results[i].Name,
+			Results[i].Threads,
+			(unsigned long long)Results[i].Ops,
+			(unsigned long long)Results[i].Busy,
+			Results[i].OpsPerSec,
+			Results[i].NsPerOp,
+			Results[i].CpuNsPerOp,
+			Results[i].AllocsPerOp,
+			(i + 1 < Count) ? "," : "");
+	}
+
+	fprintf(Output, "  ]\n");
+	fprintf(Output, "}\n");
+}
+
+static BOOLEAN
+TchBenchField(
+	IN const char* Line,
+	IN const char* Name,
+	OUT double* Value
+)
+{
+	char key[48];
+	const char* field;
+
+	snprintf(key, sizeof(key), "\"%s\":", Name);
+
+	field = strstr(Line, key);
+	if (field == NULL)
+	{
+		return FALSE;
+	}
+
+	*Value = strtod(field + strlen(key), NULL);
+
+	return TRUE;
+}
+
+static int
+TchBenchCompare(
+	IN const char* BaselinePath,
+	IN double ThresholdPercent,
+	IN const TOUCH_BENCH_RESULT* Results,
+	IN ULONG Count
+)
+/*++
+
+Routine Description:
+
+	Checks the results against a baseline written by an earlier run.
+	Benchmarks are matched by name and thread count, those missing on
+	either side are skipped. A baseline that matches none of them
+	compared nothing and fails the check.
+
+Return Value:
+
+	0 if nothing regressed beyond the threshold, 1 if something did, 2
+	if the baseline cannot be read or has no benchmark in common
+
+--*/
+{
+	const TOUCH_BENCH_RESULT* result;
+	double threads, opsPerSec, cpuNsPerOp, allocsPerOp;
+	char line[512];
+	char name[32];
+	const char* field;
+	int regressions = 0;
+	int matched = 0;
+	FILE* baseline;
+	ULONG i;
+
+	baseline = fopen(BaselinePath, "r");
+	if (baseline == NULL)
+	{
+		fprintf(stderr, "bench: cannot open baseline %s\n", BaselinePath);
+		return 2;
+	}
+
+	while (fgets(line, sizeof(line), baseline) != NULL)
+	{
+		field = strstr(line, "\"name\": \"");
+		if (field == NULL ||
+			sscanf(field + strlen("\"name\": \""), "%31[^\"]", name) != 1 ||
+			!TchBenchField(line, "threads", &threads) ||
+			!TchBenchField(line, "ops_per_sec", &opsPerSec) ||
+			!TchBenchField(line, "cpu_ns_per_op", &cpuNsPerOp) ||
+			!TchBenchField(line, "allocs_per_op", &allocsPerOp))
+		{
+			continue;
+		}
+
+		result = NULL;
+		for (i = 0; i < Count; i++)
+		{
+			if (strcmp(Results[i].Name, name) == 0 && Results[i].Threads == (ULONG)threads)
+			{
+				result = &Results[i];
+				break;
+			}
+		}
+
+		if (result == NULL)
+		{
+			continue;
+		}
+
+		matched++;
+
+		if (result->OpsPerSec < opsPerSec * (1.0 - ThresholdPercent / 100.0))
+		{
+			fprintf(stderr, "bench: %s/%u throughput %.1f -> %.1f ops/s\n",
+				name, result->Threads, opsPerSec, result->OpsPerSec);
+			regressions++;
+		}
+
+		if (result->CpuNsPerOp > cpuNsPerOp * (1.0 + ThresholdPercent / 100.0))
+		{
+			fprintf(stderr, "bench: %s/%u CPU time %.2f -> %.2f ns/op\n",
+				name, result->Threads, cpuNsPerOp, result->CpuNsPerOp);
+			regressions++;
+		}
+
+		//
+		// The toggle path is meant to be allocation free, any new
+		// allocation counts
+		//
+		if (result->AllocsPerOp > allocsPerOp * (1.0 + ThresholdPercent / 100.0) + 0.0001)
+		{
+			fprintf(stderr, "bench: %s/%u allocations %.4f -> %.4f per op\n",
+				name, result->Threads, allocsPerOp, result->AllocsPerOp);
+			regressions++;
+		}
+	}
+
+	fclose(baseline);
+
+	if (matched == 0)
+	{
+		fprintf(stderr, "bench: baseline %s has no benchmark in common with this run\n", BaselinePath);
+		return 2;
+	}
+
+	fprintf(stderr, "bench: %d benchmarks compared, %d regressions beyond %.1f%%\n",
+		matched, regressions, ThresholdPercent);
+
+	return (regressions != 0) ? 1 : 0;
+}
+
+static VOID
+TchBenchUsage(
+	VOID
+)
+{
+	fprintf(stderr,
+		"usage: touchpower_bench [options]\n"
+		"  --output FILE       write JSON results to FILE instead of stdout\n"
+		"  --compare FILE      fail if results regressed against FILE\n"
+		"  --threshold PCT     allowed regression in percent (default 10)\n"
+		"  --duration-ms MS    run time per benchmark (default 500)\n"
+		"  --threads N         highest thread count, doubling from 1 (default 8)\n"
+		"  --latency-us US     PEP latency per transition (default 0)\n"
+		"  --pending PCT       share of transitions the PEP leaves pending (default 0)\n");
+}
+
+int
+main(
+	int argc,
+	char** argv
+)
+{
+	static TOUCH_BENCH_RESULT results[TOUCH_BENCH_MAX_RESULTS];
+	TOUCH_FAKE_PEP_CONFIG config;
+	const char* outputPath = NULL;
+	const char* baselinePath = NULL;
+	double threshold = 10.0;
+	ULONG durationMs = 500;
+	ULONG maxThreads = 8;
+	ULONG pending = 0;
+	ULONG count = 0;
+	ULONG threads;
+	FILE* output = stdout;
+	int kind;
+	int i;
+
+	TchFakePepDefaultConfig(&config);
+
+	for (i = 1; i < argc; i++)
+	{
+		if (i + 1 >= argc)
+		{
+			TchBenchUsage();
+			return 2;
+		}
+
+		if (strcmp(argv[i], "--output") == 0)
+		{
+			outputPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--compare") == 0)
+		{
+			baselinePath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--threshold") == 0)
+		{
+			threshold = strtod(argv[++i], NULL);
+		}
+		else if (strcmp(argv[i], "--duration-ms") == 0)
+		{
+			durationMs = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--threads") == 0)
+		{
+			maxThreads = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--latency-us") == 0)
+		{
+			config.MeanUs = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--pending") == 0)
+		{
+			pending = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else
+		{
+			TchBenchUsage();
+			return 2;
+		}
+	}
+
+	if (maxThreads == 0 || maxThreads > TOUCH_BENCH_MAX_THREADS || pending > 100)
+	{
+		TchBenchUsage();
+		return 2;
+	}
+
+	//
+	// Synchronous answers spend the latency inline, pending ones are
+	// split evenly between STATUS_WAIT_1 and STATUS_WAIT_3
+	//
+	config.SyncLatency = TRUE;
+	config.Wait1Percent = pending / 2;
+	config.Wait3Percent = pending - pending / 2;
+
+	for (kind = 0; kind < BenchKindCount; kind++)
+	{
+		for (threads = 1; threads <= maxThreads && count < TOUCH_BENCH_MAX_RESULTS; threads *= 2)
+		{
+			if (TchBenchRun(&config, (TOUCH_BENCH_KIND)kind, threads, durationMs, &results[count]) != 0)
+			{
+				fprintf(stderr, "bench: cannot start the simulated PEP\n");
+				return 2;
+			}
+
+			count++;
+		}
+	}
+
+	if (outputPath != NULL)
+	{
+		output = fopen(outputPath, "w");
+		if (output == NULL)
+		{
+			fprintf(stderr, "bench: cannot write %s\n", outputPath);
+			return 2;
+		}
+	}
+
+	TchBenchWrite(output, &config, durationMs, results, count);
+
+	if (output != stdout)
+	{
+		fclose(output);
+	}
+
+	if (baselinePath != NULL)
+	{
+		return TchBenchCompare(baselinePath, threshold, results, count);
+	}
+
+	return 0;
+}
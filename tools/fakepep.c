@@ -0,0 +1,750 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		fakepep.c
+
+	Abstract:
+
+		Simulated PEP for off-target builds of the power core. It stands
+		in for PoFx and WDF behind the TOUCH_POWER_CORE_BACKEND and
+		serves GUID_POWER_CHANGE_P_STATE_V2 requests the way the PEP
+		does: PEP_PSTATE_RESOURCE_NODE_V2 in, STATE_RESULT_TYPE_V2 out,
+		STATUS_WAIT_1 or STATUS_WAIT_3 for transitions that complete
+		later through the power control callback.
+
+		Latency, pending answers, lost confirmations and failures of
+		PoFxPowerControl are drawn from the configuration, so the core
+		can be driven through all of its paths from a user-mode process.
+		Confirmations and watchdogs are delivered by a timer thread.
+
+	Environment:
+
+		User mode
+
+	Revision History:
+
+--*/
+
+#define INITGUID
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "fakepep.h"
+
+static ULONGLONG
+TchFakePepRandom(
+	IN PTOUCH_FAKE_PEP Pep
+)
+{
+	ULONGLONG z;
+
+	//
+	// splitmix64 over a shared counter, lock-free and reproducible for a
+	// given seed as long as requests come from a single thread
+	//
+	z = (ULONGLONG)InterlockedAdd64(&Pep->RandomState, (LONG64)0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+	return z ^ (z >> 31);
+}
+
+static ULONGLONG
+TchFakePepSampleLatencyUs(
+	IN PTOUCH_FAKE_PEP Pep
+)
+{
+	const TOUCH_FAKE_PEP_CONFIG* config = &Pep->Config;
+	ULONGLONG latency;
+	double u;
+
+	switch (config->Distribution)
+	{
+	case FakeLatencyUniform:
+		latency = config->MinUs;
+		if (config->MaxUs > config->MinUs)
+		{
+			latency += TchFakePepRandom(Pep) % (config->MaxUs - config->MinUs + 1);
+		}
+		break;
+
+	case FakeLatencyExponential:
+		u = (double)((TchFakePepRandom(Pep) >> 11) + 1) / 9007199254740992.0;
+		latency = config->MinUs + (ULONGLONG)(-log(u) * config->MeanUs);
+		break;
+
+	default:
+		latency = config->MeanUs;
+		break;
+	}
+
+	if (config->MaxUs != 0 && latency > config->MaxUs)
+	{
+		latency = config->MaxUs;
+	}
+
+	return latency;
+}
+
+static VOID
+TchFakePepSleepUs(
+	IN ULONGLONG Us
+)
+{
+	struct timespec delay;
+
+	if (Us == 0)
+	{
+		return;
+	}
+
+	delay.tv_sec = (time_t)(Us / 1000000);
+	delay.tv_nsec = (long)(Us % 1000000) * 1000;
+
+	while (nanosleep(&delay, &delay) != 0)
+	{
+	}
+}
+
+static VOID
+TchFakePepApply(
+	IN PTOUCH_FAKE_PEP Pep,
+	IN const PStateSetRequestSt* PStateData,
+	IN ULONG Count
+)
+{
+	ULONG i;
+
+	for (i = 0; i < Count; i++)
+	{
+		InterlockedExchange(
+			&Pep->PStates[PStateData[i].PStateSetIndex],
+			(LONG)PStateData[i].PStateIndex);
+	}
+}
+
+NTSTATUS
+TchFakePepPowerControl(
+	IN PTOUCH_FAKE_PEP Pep,
+	IN LPCGUID PowerControlCode,
+	IN PVOID InBuffer,
+	IN SIZE_T InBufferSize,
+	OUT PVOID OutBuffer,
+	IN SIZE_T OutBufferSize,
+	OUT SIZE_T* BytesReturned
+)
+/*++
+
+Routine Description:
+
+	Stands in for PoFxPowerControl with the PEP behind it. A request is
+	either failed outright, carried out before returning, or answered
+	with STATUS_WAIT_1 / STATUS_WAIT_3 and confirmed by the timer thread
+	once its latency has elapsed.
+
+Arguments:
+
+	Pep - Simulated PEP
+	PowerControlCode - Must be GUID_POWER_CHANGE_P_STATE_V2
+	InBuffer - PEP_PSTATE_RESOURCE_NODE_V2, the number of entries is
+		taken from InBufferSize
+	InBufferSize - Size of InBuffer
+	OutBuffer - Receives the STATE_RESULT_TYPE_V2
+	OutBufferSize - Size of OutBuffer
+	BytesReturned - Receives the size of the result
+
+Return Value:
+
+	NTSTATUS of the call; the PEP's answer is in the result
+
+--*/
+{
+	PEP_PSTATE_RESOURCE_NODE_V2* request = (PEP_PSTATE_RESOURCE_NODE_V2*)InBuffer;
+	STATE_RESULT_TYPE_V2* result = (STATE_RESULT_TYPE_V2*)OutBuffer;
+	const TOUCH_FAKE_PEP_CONFIG* config = &Pep->Config;
+	PTOUCH_FAKE_CONFIRMATION confirmation;
+	ULONGLONG latencyUs;
+	ULONG count;
+	ULONG draw;
+	ULONG i;
+
+	InterlockedIncrement(&Pep->PowerControlCalls);
+
+	*BytesReturned = 0;
+
+	if (memcmp(PowerControlCode, &GUID_POWER_CHANGE_P_STATE_V2, sizeof(GUID)) != 0)
+	{
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	if (InBufferSize < sizeof(PEP_PSTATE_RESOURCE_NODE_V2) ||
+		OutBufferSize < sizeof(STATE_RESULT_TYPE_V2) ||
+		request->hdr.version != 2 ||
+		request->hdr.PStateRequestType != PEP_PSTATE_SET_REQUEST)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	count = (ULONG)((InBufferSize - FIELD_OFFSET(PEP_PSTATE_RESOURCE_NODE_V2, PStateData)) /
+		sizeof(PStateSetRequestSt));
+
+	if (count > TOUCH_POWER_MAX_PSTATE_SETS)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (request->PStateData[i].PStateSetIndex >= TOUCH_POWER_MAX_PSTATE_SETS)
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
+
+	draw = (ULONG)(TchFakePepRandom(Pep) % 100);
+
+	if (draw < config->NotSupportedPercent)
+	{
+		InterlockedIncrement(&Pep->NotSupportedResults);
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	if (draw < config->NotSupportedPercent + config->DeviceNotReadyPercent)
+	{
+		InterlockedIncrement(&Pep->DeviceNotReadyResults);
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	memset(result, 0, sizeof(*result));
+	result->hdr.version = 2;
+	result->hdr.ComponentIndex = request->hdr.ComponentIndex;
+	result->hdr.pUserData = request->hdr.pUserData;
+	*BytesReturned = sizeof(*result);
+
+	latencyUs = TchFakePepSampleLatencyUs(Pep);
+	draw = (ULONG)(TchFakePepRandom(Pep) % 100);
+
+	if (draw >= config->Wait1Percent + config->Wait3Percent)
+	{
+		if (config->SyncLatency)
+		{
+			TchFakePepSleepUs(latencyUs);
+		}
+
+		TchFakePepApply(Pep, request->PStateData, count);
+		result->hdr.status = STATUS_SUCCESS;
+
+		return STATUS_SUCCESS;
+	}
+
+	if (draw < config->Wait1Percent)
+	{
+		InterlockedIncrement(&Pep->Wait1Results);
+		result->hdr.status = STATUS_WAIT_1;
+	}
+	else
+	{
+		InterlockedIncrement(&Pep->Wait3Results);
+		result->hdr.status = STATUS_WAIT_3;
+	}
+
+	if ((ULONG)(TchFakePepRandom(Pep) % 100) < config->DropPercent)
+	{
+		InterlockedIncrement(&Pep->DroppedConfirmations);
+		return STATUS_SUCCESS;
+	}
+
+	pthread_mutex_lock(&Pep->Lock);
+
+	for (i = 0; i < TOUCH_FAKE_MAX_CONFIRMATIONS; i++)
+	{
+		confirmation = &Pep->Confirmations[i];
+
+		if (confirmation->Due == 0)
+		{
+			confirmation->Due = TchPlatQueryTicks() + (LONGLONG)latencyUs * 1000;
+			confirmation->UserData = request->hdr.pUserData;
+			confirmation->Count = count;
+			memcpy(confirmation->PStateData, request->PStateData, count * sizeof(PStateSetRequestSt));
+
+			pthread_cond_signal(&Pep->EventChanged);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&Pep->Lock);
+
+	//
+	// Confirmations the driver gave up on pile up next to the ones it
+	// waits for, past what the table holds they are lost
+	//
+	if (i == TOUCH_FAKE_MAX_CONFIRMATIONS)
+	{
+		InterlockedIncrement(&Pep->DroppedConfirmations);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+static VOID
+TchFakePepControlCallback(
+	IN PTOUCH_FAKE_PEP Pep,
+	IN STATE_RESULT_TYPE_V2* Result
+)
+{
+	//
+	// Same as TchPowerControlCallback in the driver
+	//
+	TchCoreConfirm(&Pep->Core, Result->hdr.pUserData, Result->hdr.status);
+}
+
+static void*
+TchFakePepTimerThread(
+	IN void* Context
+)
+/*++
+
+Routine Description:
+
+	Delivers confirmations and watchdogs when they fall due, the way
+	the PEP and WDF timers call back into the driver.
+
+--*/
+{
+	PTOUCH_FAKE_PEP pep = (PTOUCH_FAKE_PEP)Context;
+	TOUCH_FAKE_CONFIRMATION confirmation;
+	STATE_RESULT_TYPE_V2 result;
+	struct timespec due;
+	LONGLONG earliest;
+	LONGLONG now;
+	BOOLEAN confirm = FALSE;
+	ULONG index = 0;
+	ULONG i;
+
+	pthread_mutex_lock(&pep->Lock);
+
+	while (!pep->Stop)
+	{
+		earliest = 0;
+
+		for (i = 0; i < TOUCH_FAKE_MAX_CONFIRMATIONS; i++)
+		{
+			if (pep->Confirmations[i].Due != 0 &&
+				(earliest == 0 || pep->Confirmations[i].Due < earliest))
+			{
+				earliest = pep->Confirmations[i].Due;
+				confirm = TRUE;
+				index = i;
+			}
+		}
+
+		for (i = 0; i < TOUCH_POWER_MAX_TRANSITIONS; i++)
+		{
+			if (pep->WatchdogDue[i] != 0 &&
+				(earliest == 0 || pep->WatchdogDue[i] < earliest))
+			{
+				earliest = pep->WatchdogDue[i];
+				confirm = FALSE;
+				index = i;
+			}
+		}
+
+		if (earliest == 0)
+		{
+			pthread_cond_wait(&pep->EventChanged, &pep->Lock);
+			continue;
+		}
+
+		now = TchPlatQueryTicks();
+		if (now < earliest)
+		{
+			due.tv_sec = (time_t)(earliest / 1000000000);
+			due.tv_nsec = (long)(earliest % 1000000000);
+			pthread_cond_timedwait(&pep->EventChanged, &pep->Lock, &due);
+			continue;
+		}
+
+		if (confirm)
+		{
+			confirmation = pep->Confirmations[index];
+			pep->Confirmations[index].Due = 0;
+
+			pthread_mutex_unlock(&pep->Lock);
+
+			InterlockedIncrement(&pep->ConfirmedResults);
+			TchFakePepApply(pep, confirmation.PStateData, confirmation.Count);
+
+			memset(&result, 0, sizeof(result));
+			result.hdr.version = 2;
+			result.hdr.status = STATUS_SUCCESS;
+			result.hdr.pUserData = confirmation.UserData;
+
+			TchFakePepControlCallback(pep, &result);
+		}
+		else
+		{
+			pep->WatchdogDue[index] = 0;
+
+			pthread_mutex_unlock(&pep->Lock);
+
+			TchCoreOnWatchdog(&pep->Core, &pep->Core.Slots[index]);
+		}
+
+		pthread_mutex_lock(&pep->Lock);
+	}
+
+	pthread_mutex_unlock(&pep->Lock);
+
+	return NULL;
+}
+
+static NTSTATUS
+TchFakePepBackendRegisterDevice(
+	IN PVOID Context
+)
+{
+	PTOUCH_FAKE_PEP pep = (PTOUCH_FAKE_PEP)Context;
+
+	if (NT_SUCCESS(pep->Config.RegisterStatus))
+	{
+		InterlockedIncrement(&pep->Registered);
+	}
+
+	return pep->Config.RegisterStatus;
+}
+
+static NTSTATUS
+TchFakePepBackendPowerControl(
+	IN PVOID Context,
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot,
+	IN const TOUCH_POWER_PSTATE_ENTRY* Entries,
+	IN ULONG Count,
+	OUT NTSTATUS* PepStatus
+)
+{
+	PTOUCH_FAKE_PEP pep = (PTOUCH_FAKE_PEP)Context;
+	PTOUCH_FAKE_PEP_SLOT pepSlot = &pep->Slots[Slot->Index];
+	SIZE_T bytesReturned;
+	NTSTATUS status;
+	ULONG i;
+
+	//
+	// Built exactly like the driver does, see power.c
+	//
+	memset(&pepSlot->Result, 0, sizeof(pepSlot->Result));
+
+	pepSlot->Node.hdr.version = 2;
+	pepSlot->Node.hdr.ComponentIndex = 0;
+	pepSlot->Node.hdr.PStateRequestType = PEP_PSTATE_SET_REQUEST;
+	pepSlot->Node.hdr.pUserData = Slot->UserData;
+
+	for (i = 0; i < Count; i++)
+	{
+		pepSlot->Node.PStateData[i].PStateSetIndex = Entries[i].SetIndex;
+		pepSlot->Node.PStateData[i].PStateIndex = Entries[i].PStateIndex;
+	}
+
+	status = TchFakePepPowerControl(
+		pep,
+		&GUID_POWER_CHANGE_P_STATE_V2,
+		&pepSlot->Node,
+		FIELD_OFFSET(PEP_PSTATE_RESOURCE_NODE_V2, PStateData) + Count * sizeof(PStateSetRequestSt),
+		&pepSlot->Result,
+		sizeof(pepSlot->Result),
+		&bytesReturned);
+
+	*PepStatus = pepSlot->Result.hdr.status;
+
+	return status;
+}
+
+static VOID
+TchFakePepBackendStartWatchdog(
+	IN PVOID Context,
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot,
+	IN ULONG TimeoutMs
+)
+{
+	PTOUCH_FAKE_PEP pep = (PTOUCH_FAKE_PEP)Context;
+
+	pthread_mutex_lock(&pep->Lock);
+
+	pep->WatchdogDue[Slot->Index] =
+		TchPlatQueryTicks() + (LONGLONG)TimeoutMs * 1000000;
+
+	pthread_cond_signal(&pep->EventChanged);
+	pthread_mutex_unlock(&pep->Lock);
+}
+
+static VOID
+TchFakePepBackendStopWatchdog(
+	IN PVOID Context,
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot
+)
+{
+	PTOUCH_FAKE_PEP pep = (PTOUCH_FAKE_PEP)Context;
+
+	//
+	// A confirmation still scheduled for the transition is delivered all
+	// the same, the core tells it apart from the slot's next transition
+	//
+	pthread_mutex_lock(&pep->Lock);
+	pep->WatchdogDue[Slot->Index] = 0;
+	pthread_mutex_unlock(&pep->Lock);
+}
+
+static VOID
+TchFakePepBackendTransitionCommitted(
+	IN PVOID Context,
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot,
+	IN NTSTATUS Status,
+	IN BOOLEAN StateChanged
+)
+{
+	PTOUCH_FAKE_PEP pep = (PTOUCH_FAKE_PEP)Context;
+
+	InterlockedIncrement(&pep->Commits);
+
+	if (Status == STATUS_IO_TIMEOUT)
+	{
+		InterlockedIncrement(&pep->Timeouts);
+	}
+
+	if (StateChanged)
+	{
+		InterlockedIncrement(&pep->StateChanges);
+
+		if (Slot->Target.PStates[0] != TOUCH_POWER_PSTATE_OFF)
+		{
+			InterlockedIncrement(&pep->PowerOns);
+		}
+	}
+}
+
+static VOID
+TchFakePepBackendCompleteRequest(
+	IN PVOID Context,
+	IN PVOID Request,
+	IN NTSTATUS Status
+)
+{
+	PTOUCH_FAKE_PEP pep = (PTOUCH_FAKE_PEP)Context;
+	PTOUCH_FAKE_REQUEST request = (PTOUCH_FAKE_REQUEST)Request;
+
+	InterlockedIncrement(&pep->Completions);
+
+	if (request == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&pep->Lock);
+
+	request->Status = Status;
+	InterlockedExchange(&request->Completed, 1);
+
+	pthread_cond_broadcast(&pep->RequestDone);
+	pthread_mutex_unlock(&pep->Lock);
+}
+
+const TOUCH_POWER_CORE_BACKEND TchFakePepBackend =
+{
+	TchFakePepBackendRegisterDevice,
+	TchFakePepBackendPowerControl,
+	TchFakePepBackendStartWatchdog,
+	TchFakePepBackendStopWatchdog,
+	TchFakePepBackendTransitionCommitted,
+	TchFakePepBackendCompleteRequest
+};
+
+VOID
+TchFakePepDefaultConfig(
+	OUT PTOUCH_FAKE_PEP_CONFIG Config
+)
+/*++
+
+Routine Description:
+
+	Fills in a configuration for a PEP that answers every request on
+	the spot and never fails, with the driver's default watchdog.
+
+Arguments:
+
+	Config - Receives the configuration
+
+Return Value:
+
+	None
+
+--*/
+{
+	memset(Config, 0, sizeof(*Config));
+
+	Config->TransitionTimeoutMs = 1000;
+	Config->Distribution = FakeLatencyFixed;
+	Config->RegisterStatus = STATUS_SUCCESS;
+	Config->Seed = 1;
+}
+
+NTSTATUS
+TchFakePepInitialize(
+	OUT PTOUCH_FAKE_PEP Pep,
+	IN const TOUCH_FAKE_PEP_CONFIG* Config
+)
+/*++
+
+Routine Description:
+
+	Sets up a simulated PEP and the power core it backs, and starts its
+	timer thread. The PEP starts out with the digitizer off, matching
+	the core.
+
+Arguments:
+
+	Pep - Simulated PEP to initialize
+	Config - Behavior of the PEP
+
+Return Value:
+
+	STATUS_INSUFFICIENT_RESOURCES if the timer thread cannot be started
+
+--*/
+{
+	pthread_condattr_t conditionAttributes;
+	ULONG i;
+
+	memset(Pep, 0, sizeof(*Pep));
+
+	Pep->Config = *Config;
+	Pep->RandomState = (LONG64)Config->Seed;
+
+	for (i = 0; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+	{
+		Pep->PStates[i] = TOUCH_POWER_NO_TARGET;
+	}
+
+	Pep->PStates[0] = TOUCH_POWER_PSTATE_OFF;
+
+	TchCoreInitialize(&Pep->Core, &TchFakePepBackend, Pep, Config->TransitionTimeoutMs);
+
+	//
+	// Due times come from CLOCK_MONOTONIC, see coreplat.h
+	//
+	pthread_condattr_init(&conditionAttributes);
+	pthread_condattr_setclock(&conditionAttributes, CLOCK_MONOTONIC);
+
+	pthread_mutex_init(&Pep->Lock, NULL);
+	pthread_cond_init(&Pep->EventChanged, &conditionAttributes);
+	pthread_cond_init(&Pep->RequestDone, NULL);
+
+	pthread_condattr_destroy(&conditionAttributes);
+
+	if (pthread_create(&Pep->Thread, NULL, TchFakePepTimerThread, Pep) != 0)
+	{
+		pthread_cond_destroy(&Pep->RequestDone);
+		pthread_cond_destroy(&Pep->EventChanged);
+		pthread_mutex_destroy(&Pep->Lock);
+
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+TchFakePepCleanup(
+	IN PTOUCH_FAKE_PEP Pep
+)
+/*++
+
+Routine Description:
+
+	Stops the timer thread. Confirmations and watchdogs that have not
+	fallen due yet are never delivered.
+
+Arguments:
+
+	Pep - Simulated PEP
+
+Return Value:
+
+	None
+
+--*/
+{
+	pthread_mutex_lock(&Pep->Lock);
+	Pep->Stop = TRUE;
+	pthread_cond_signal(&Pep->EventChanged);
+	pthread_mutex_unlock(&Pep->Lock);
+
+	pthread_join(Pep->Thread, NULL);
+
+	pthread_cond_destroy(&Pep->RequestDone);
+	pthread_cond_destroy(&Pep->EventChanged);
+	pthread_mutex_destroy(&Pep->Lock);
+}
+
+VOID
+TchFakePepWaitRequest(
+	IN PTOUCH_FAKE_PEP Pep,
+	IN PTOUCH_FAKE_REQUEST Request
+)
+{
+	if (ReadAcquire(&Request->Completed))
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&Pep->Lock);
+
+	while (!ReadAcquire(&Request->Completed))
+	{
+		pthread_cond_wait(&Pep->RequestDone, &Pep->Lock);
+	}
+
+	pthread_mutex_unlock(&Pep->Lock);
+}
+
+NTSTATUS
+TchFakePepSetPStates(
+	IN PTOUCH_FAKE_PEP Pep,
+	IN const TOUCH_POWER_PSTATE_VECTOR* Target,
+	IN ULONG Cause
+)
+/*++
+
+Routine Description:
+
+	Runs a transition through the core and waits for its outcome, also
+	when the PEP leaves it pending.
+
+Arguments:
+
+	Pep - Simulated PEP
+	Target - P-state per set
+	Cause - Cause of the transition
+
+Return Value:
+
+	Final status of the transition
+
+--*/
+{
+	TOUCH_FAKE_REQUEST request;
+	NTSTATUS status;
+
+	request.Completed = 0;
+	request.Status = STATUS_PENDING;
+
+	status = TchCoreSetPStates(&Pep->Core, Target, &request, Cause, 0);
+
+	if (status == STATUS_PENDING)
+	{
+		TchFakePepWaitRequest(Pep, &request);
+		status = request.Status;
+	}
+
+	return status;
+}
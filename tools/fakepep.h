@@ -0,0 +1,189 @@
+// Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+#pragma once
+
+#include <pthread.h>
+#include <core.h>
+
+//
+// Simulated PEP backing the power core off-target, see fakepep.c. It
+// speaks the same PEP_PSTATE_RESOURCE_NODE_V2 / STATE_RESULT_TYPE_V2
+// protocol as the real one, with configurable latency and failures.
+//
+
+#include <private/pep.h>
+
+typedef enum _TOUCH_FAKE_LATENCY_DISTRIBUTION
+{
+    FakeLatencyFixed = 0,
+    FakeLatencyUniform,
+    FakeLatencyExponential
+} TOUCH_FAKE_LATENCY_DISTRIBUTION;
+
+typedef struct _TOUCH_FAKE_PEP_CONFIG
+{
+    //
+    // Passed on to the core, 0 waits forever for a confirmation
+    //
+    ULONG TransitionTimeoutMs;
+
+    //
+    // How long the PEP takes to reach a P-state. Fixed uses MeanUs,
+    // Uniform draws from [MinUs, MaxUs], Exponential has mean MeanUs on
+    // top of MinUs. A MaxUs of 0 leaves Fixed and Exponential unbounded.
+    //
+    TOUCH_FAKE_LATENCY_DISTRIBUTION Distribution;
+    ULONG MinUs;
+    ULONG MeanUs;
+    ULONG MaxUs;
+
+    //
+    // Requests answered synchronously spend their latency inside
+    // PoFxPowerControl if set, otherwise they return at once
+    //
+    BOOLEAN SyncLatency;
+
+    //
+    // Share of requests, in percent, answered with STATUS_WAIT_1 or
+    // STATUS_WAIT_3 and confirmed once their latency has elapsed, and
+    // share of those whose confirmation never comes
+    //
+    ULONG Wait1Percent;
+    ULONG Wait3Percent;
+    ULONG DropPercent;
+
+    //
+    // Share of requests, in percent, PoFxPowerControl fails with
+    // STATUS_NOT_SUPPORTED and STATUS_DEVICE_NOT_READY
+    //
+    ULONG NotSupportedPercent;
+    ULONG DeviceNotReadyPercent;
+
+    //
+    // What PoFxRegisterDevice returns
+    //
+    NTSTATUS RegisterStatus;
+
+    ULONGLONG Seed;
+} TOUCH_FAKE_PEP_CONFIG, *PTOUCH_FAKE_PEP_CONFIG;
+
+//
+// PEP buffers of a transition slot, as the driver keeps them
+//
+typedef struct _TOUCH_FAKE_PEP_SLOT
+{
+    PEP_PSTATE_RESOURCE_NODE_V2 Node;
+    PStateSetRequestSt MorePStateData[TOUCH_POWER_MAX_PSTATE_SETS - 1];
+    STATE_RESULT_TYPE_V2 Result;
+} TOUCH_FAKE_PEP_SLOT, *PTOUCH_FAKE_PEP_SLOT;
+
+//
+// Confirmation the PEP owes for a transition it answered pending,
+// delivered once Due has passed, even if the driver gave up on the
+// transition in the meantime. A Due of 0 marks a free entry.
+//
+#define TOUCH_FAKE_MAX_CONFIRMATIONS      (TOUCH_POWER_MAX_TRANSITIONS * 4)
+
+typedef struct _TOUCH_FAKE_CONFIRMATION
+{
+    LONGLONG Due;
+    PVOID UserData;
+    ULONG Count;
+    PStateSetRequestSt PStateData[TOUCH_POWER_MAX_PSTATE_SETS];
+} TOUCH_FAKE_CONFIRMATION, *PTOUCH_FAKE_CONFIRMATION;
+
+//
+// Request handed to the core, completed through CompleteRequest
+//
+typedef struct _TOUCH_FAKE_REQUEST
+{
+    volatile LONG Completed;
+    volatile LONG Status;
+} TOUCH_FAKE_REQUEST, *PTOUCH_FAKE_REQUEST;
+
+typedef struct _TOUCH_FAKE_PEP
+{
+    TOUCH_POWER_CORE Core;
+    TOUCH_FAKE_PEP_CONFIG Config;
+    TOUCH_FAKE_PEP_SLOT Slots[TOUCH_POWER_MAX_TRANSITIONS];
+
+    //
+    // P-state per set as last reached by the PEP
+    //
+    volatile LONG PStates[TOUCH_POWER_MAX_PSTATE_SETS];
+
+    volatile LONG64 RandomState;
+
+    //
+    // Timer thread delivering confirmations and watchdogs, and waiters
+    // on pending requests. Lock protects Confirmations, WatchdogDue
+    // (0 when disarmed, per transition slot) and Stop. Due times are in
+    // TchPlatQueryTicks units.
+    //
+    pthread_t Thread;
+    pthread_mutex_t Lock;
+    pthread_cond_t EventChanged;
+    pthread_cond_t RequestDone;
+    TOUCH_FAKE_CONFIRMATION Confirmations[TOUCH_FAKE_MAX_CONFIRMATIONS];
+    LONGLONG WatchdogDue[TOUCH_POWER_MAX_TRANSITIONS];
+    BOOLEAN Stop;
+
+    //
+    // What the PEP has been through so far
+    //
+    volatile LONG Registered;
+    volatile LONG PowerControlCalls;
+    volatile LONG Wait1Results;
+    volatile LONG Wait3Results;
+    volatile LONG NotSupportedResults;
+    volatile LONG DeviceNotReadyResults;
+    volatile LONG ConfirmedResults;
+    volatile LONG DroppedConfirmations;
+    volatile LONG Timeouts;
+    volatile LONG Commits;
+    volatile LONG StateChanges;
+    volatile LONG PowerOns;
+    volatile LONG Completions;
+} TOUCH_FAKE_PEP, *PTOUCH_FAKE_PEP;
+
+extern const TOUCH_POWER_CORE_BACKEND TchFakePepBackend;
+
+VOID
+TchFakePepDefaultConfig(
+    OUT PTOUCH_FAKE_PEP_CONFIG Config
+);
+
+NTSTATUS
+TchFakePepInitialize(
+    OUT PTOUCH_FAKE_PEP Pep,
+    IN const TOUCH_FAKE_PEP_CONFIG* Config
+);
+
+VOID
+TchFakePepCleanup(
+    IN PTOUCH_FAKE_PEP Pep
+);
+
+NTSTATUS
+TchFakePepPowerControl(
+    IN PTOUCH_FAKE_PEP Pep,
+    IN LPCGUID PowerControlCode,
+    IN PVOID InBuffer,
+    IN SIZE_T InBufferSize,
+    OUT PVOID OutBuffer,
+    IN SIZE_T OutBufferSize,
+    OUT SIZE_T* BytesReturned
+);
+
+VOID
+TchFakePepWaitRequest(
+    IN PTOUCH_FAKE_PEP Pep,
+    IN PTOUCH_FAKE_REQUEST Request
+);
+
+NTSTATUS
+TchFakePepSetPStates(
+    IN PTOUCH_FAKE_PEP Pep,
+    IN const TOUCH_POWER_PSTATE_VECTOR* Target,
+    IN ULONG Cause
+);
@@ -0,0 +1,1495 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		replay.c
+
+	Abstract:
+
+		Trace replay and power policy evaluator. Recorded power requests
+		and display/input events are replayed against the power core
+		under a virtual clock, with a deterministic PEP whose on and off
+		latencies come from the command line. Every run of the same
+		trace and policy gives the same result.
+
+		A trace is either a flight recorder dump as returned by
+		IOCTL_TOUCH_POWER_RECORDER, or a text file with one event per
+		line:
+
+			<time in ms> toggle <0|1>    client power request
+			<time in ms> input           user touch
+			<time in ms> display <0|1|2> console display off, on or dimmed
+			<time in ms> monitor <0|1>   monitor power off or on
+			<time in ms> end             end of the trace
+
+		From a flight recorder dump, client requests, votes and
+		schedules become toggles and component activations become input;
+		transitions the driver's own policy made are left out, as they
+		are what is being evaluated.
+
+		Policies combine the idle timeout and coalescing window of the
+		driver, the settings of its hysteresis stage (policy.c, which
+		runs here as is) and display gating. The display and monitor
+		events are fed to the driver's display gate (display.c) the way
+		the power setting notifications are. Power-on is never delayed.
+		Settings a policy leaves out take the driver's defaults. For
+		each policy the tool reports the energy spent (residency times
+		per-state power, plus a cost per transition) and the latency
+		input saw waiting for the digitizer to come back on, summed over
+		all traces.
+
+	Environment:
+
+		User mode
+
+	Revision History:
+
+--*/
+
+#define INITGUID
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <core.h>
+#include <policy.h>
+#include <display.h>
+#include <defaults.h>
+#include <power.h>
+
+#define TOUCH_REPLAY_MAX_POLICIES       16
+
+typedef enum _TOUCH_REPLAY_EVENT_TYPE
+{
+	ReplayEventToggle = 0,
+	ReplayEventInput,
+	ReplayEventDisplay,
+	ReplayEventMonitor,
+	ReplayEventEnd
+} TOUCH_REPLAY_EVENT_TYPE;
+
+typedef struct _TOUCH_REPLAY_EVENT
+{
+	LONGLONG Time;
+	ULONG Type;
+	ULONG Value;
+	ULONG Order;
+} TOUCH_REPLAY_EVENT, *PTOUCH_REPLAY_EVENT;
+
+typedef struct _TOUCH_REPLAY_TRACE
+{
+	const char* Path;
+	PTOUCH_REPLAY_EVENT Events;
+	ULONG Count;
+	ULONG Capacity;
+} TOUCH_REPLAY_TRACE, *PTOUCH_REPLAY_TRACE;
+
+//
+// Policy under evaluation. Times are in milliseconds, 0 disables.
+//
+typedef struct _TOUCH_REPLAY_POLICY
+{
+	char Name[32];
+
+	//
+	// As IdleTimeoutMs and CoalesceWindowMs of the driver
+	//
+	ULONG IdleTimeoutMs;
+	ULONG CoalesceWindowMs;
+
+	//
+	// Settings of the driver's hysteresis policy stage
+	//
+	TOUCH_POWER_POLICY_CONFIG Hysteresis;
+
+	//
+	// Settings of the driver's display gate
+	//
+	TOUCH_POWER_DISPLAY_CONFIG Display;
+} TOUCH_REPLAY_POLICY, *PTOUCH_REPLAY_POLICY;
+
+//
+// Platform the traces are replayed on
+//
+typedef struct _TOUCH_REPLAY_MODEL
+{
+	ULONG OnLatencyUs;
+	ULONG OffLatencyUs;
+	ULONG TransitionTimeoutMs;
+	double OnMw;
+	double OffMw;
+	double TransitionUj;
+
+	//
+	// Start with the digitizer in a state the driver does not know, as
+	// at boot, rather than off
+	//
+	BOOLEAN StartUnknown;
+} TOUCH_REPLAY_MODEL, *PTOUCH_REPLAY_MODEL;
+
+typedef struct _TOUCH_REPLAY_RESULT
+{
+	LONGLONG Duration;
+	LONGLONG Residency[2];
+	ULONGLONG Transitions;
+	ULONGLONG IdlePowerDowns;
+	ULONGLONG Inputs;
+	ULONGLONG IgnoredInputs;
+	ULONGLONG UnservedInputs;
+	ULONGLONG OffsHeld;
+	ULONGLONG OffsSuppressed;
+	ULONGLONG Thrashes;
+
+	LONGLONG* Latencies;
+	ULONGLONG LatencyCount;
+	ULONGLONG LatencyCapacity;
+} TOUCH_REPLAY_RESULT, *PTOUCH_REPLAY_RESULT;
+
+typedef struct _TOUCH_REPLAY_SIM
+{
+	TOUCH_POWER_CORE Core;
+	const TOUCH_REPLAY_POLICY* Policy;
+	const TOUCH_REPLAY_MODEL* Model;
+	PTOUCH_REPLAY_RESULT Result;
+	TOUCH_POWER_POLICY Stage;
+	TOUCH_POWER_DISPLAY Display;
+
+	//
+	// Virtual timers, absolute times in ns, 0 when disarmed. A
+	// confirmation carries the tag of its transition and the P-state of
+	// set 0 the PEP reaches with it.
+	//
+	LONGLONG ConfirmDue[TOUCH_POWER_MAX_TRANSITIONS];
+	PVOID ConfirmUserData[TOUCH_POWER_MAX_TRANSITIONS];
+	LONG ConfirmPState[TOUCH_POWER_MAX_TRANSITIONS];
+	LONGLONG WatchdogDue[TOUCH_POWER_MAX_TRANSITIONS];
+	LONGLONG WindowDue;
+	LONGLONG IdleDue;
+	LONGLONG PolicyDue;
+	LONGLONG DisplayDue;
+
+	//
+	// Policy inputs
+	//
+	BOOLEAN ClientOn;
+	BOOLEAN WindowClientOn;
+	BOOLEAN Idle;
+	BOOLEAN InFlight;
+
+	//
+	// Residency of the power gate and input waiting for it to open
+	//
+	LONG PState;
+	LONGLONG PStateSince;
+	LONGLONG* Waiting;
+	ULONG WaitingCount;
+	ULONG WaitingCapacity;
+} TOUCH_REPLAY_SIM, *PTOUCH_REPLAY_SIM;
+
+//
+// The virtual clock the core reads, see coreplat.h
+//
+static LONGLONG TchReplayNow;
+
+LONGLONG
+TchPlatQueryTicks(
+	VOID
+)
+{
+	return TchReplayNow;
+}
+
+static VOID*
+TchReplayGrow(
+	IN VOID* Array,
+	IN OUT ULONGLONG* Capacity,
+	IN SIZE_T ElementSize
+)
+{
+	ULONGLONG capacity = (*Capacity != 0) ? *Capacity * 2 : 64;
+	VOID* array;
+
+	array = realloc(Array, (SIZE_T)capacity * ElementSize);
+	if (array == NULL)
+	{
+		fprintf(stderr, "replay: out of memory\n");
+		exit(2);
+	}
+
+	*Capacity = capacity;
+
+	return array;
+}
+
+static VOID
+TchReplayAddEvent(
+	IN OUT PTOUCH_REPLAY_TRACE Trace,
+	IN LONGLONG Time,
+	IN ULONG Type,
+	IN ULONG Value
+)
+{
+	ULONGLONG capacity = Trace->Capacity;
+
+	if (Trace->Count == Trace->Capacity)
+	{
+		Trace->Events = TchReplayGrow(Trace->Events, &capacity, sizeof(TOUCH_REPLAY_EVENT));
+		Trace->Capacity = (ULONG)capacity;
+	}
+
+	Trace->Events[Trace->Count].Time = Time;
+	Trace->Events[Trace->Count].Type = Type;
+	Trace->Events[Trace->Count].Value = Value;
+	Trace->Events[Trace->Count].Order = Trace->Count;
+	Trace->Count++;
+}
+
+static int
+TchReplayCompareEvents(
+	const void* Left,
+	const void* Right
+)
+{
+	const TOUCH_REPLAY_EVENT* left = (const TOUCH_REPLAY_EVENT*)Left;
+	const TOUCH_REPLAY_EVENT* right = (const TOUCH_REPLAY_EVENT*)Right;
+
+	if (left->Time != right->Time)
+	{
+		return (left->Time < right->Time) ? -1 : 1;
+	}
+
+	return (left->Order < right->Order) ? -1 : (left->Order > right->Order);
+}
+
+static BOOLEAN
+TchReplayLoadRecorder(
+	IN const unsigned char* Data,
+	IN SIZE_T Size,
+	IN OUT PTOUCH_REPLAY_TRACE Trace
+)
+/*++
+
+Routine Description:
+
+	Turns a flight recorder dump into trace events. Records carry the
+	time their transition settled; the request is placed LatencyUs
+	earlier.
+
+Return Value:
+
+	FALSE if Data is not a flight recorder dump
+
+--*/
+{
+	const TOUCH_POWER_RECORDER_DUMP* dump = (const TOUCH_POWER_RECORDER_DUMP*)Data;
+	const TOUCH_POWER_RECORD* record;
+	LONGLONG origin = 0;
+	LONGLONG time;
+	ULONG i;
+
+	if (Size < (SIZE_T)FIELD_OFFSET(TOUCH_POWER_RECORDER_DUMP, Records) ||
+		dump->Size != Size ||
+		dump->Count > (Size - FIELD_OFFSET(TOUCH_POWER_RECORDER_DUMP, Records)) / sizeof(TOUCH_POWER_RECORD))
+	{
+		return FALSE;
+	}
+
+	for (i = 0; i < dump->Count; i++)
+	{
+		record = &dump->Records[i];
+
+		if (record->Sequence == 0)
+		{
+			continue;
+		}
+
+		time = (LONGLONG)record->Timestamp * 100 - (LONGLONG)record->LatencyUs * 1000;
+
+		if (Trace->Count == 0)
+		{
+			origin = time;
+		}
+
+		time = (time > origin) ? time - origin : 0;
+
+		switch (record->Cause)
+		{
+		case TouchPowerCauseRequest:
+		case TouchPowerCauseBatch:
+		case TouchPowerCauseVote:
+		case TouchPowerCauseSchedule:
+			if (record->RequestedPState != TOUCH_POWER_RECORD_NO_PSTATE)
+			{
+				TchReplayAddEvent(
+					Trace,
+					time,
+					ReplayEventToggle,
+					record->RequestedPState != TOUCH_POWER_PSTATE_OFF);
+			}
+			break;
+
+		case TouchPowerCauseComponentActive:
+			TchReplayAddEvent(Trace, time, ReplayEventInput, 0);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
+static BOOLEAN
+TchReplayLoadText(
+	IN char* Text,
+	IN OUT PTOUCH_REPLAY_TRACE Trace
+)
+{
+	char* line;
+	char* next;
+	char event[16];
+	double timeMs;
+	ULONG value;
+	ULONG number = 0;
+	int fields;
+
+	for (line = Text; line != NULL; line = next)
+	{
+		next = strchr(line, '\n');
+		if (next != NULL)
+		{
+			*next++ = '\0';
+		}
+
+		number++;
+
+		while (*line == ' ' || *line == '\t')
+		{
+			line++;
+		}
+
+		if (*line == '\0' || *line == '#' || *line == '\r')
+		{
+			continue;
+		}
+
+		value = 0;
+		fields = sscanf(line, "%lf %15s %u", &timeMs, event, &value);
+
+		if (fields < 2 || timeMs < 0)
+		{
+			fprintf(stderr, "replay: %s:%u: malformed event\n", Trace->Path, number);
+			return FALSE;
+		}
+
+		if (strcmp(event, "toggle") == 0 && fields == 3)
+		{
+			TchReplayAddEvent(Trace, (LONGLONG)(timeMs * 1e6), ReplayEventToggle, value != 0);
+		}
+		else if (strcmp(event, "input") == 0)
+		{
+			TchReplayAddEvent(Trace, (LONGLONG)(timeMs * 1e6), ReplayEventInput, 0);
+		}
+		else if (strcmp(event, "display") == 0 && fields == 3)
+		{
+			TchReplayAddEvent(Trace, (LONGLONG)(timeMs * 1e6), ReplayEventDisplay, value);
+		}
+		else if (strcmp(event, "monitor") == 0 && fields == 3)
+		{
+			TchReplayAddEvent(Trace, (LONGLONG)(timeMs * 1e6), ReplayEventMonitor, value != 0);
+		}
+		else if (strcmp(event, "end") == 0)
+		{
+			TchReplayAddEvent(Trace, (LONGLONG)(timeMs * 1e6), ReplayEventEnd, 0);
+		}
+		else
+		{
+			fprintf(stderr, "replay: %s:%u: unknown event %s\n", Trace->Path, number, event);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static BOOLEAN
+TchReplayLoad(
+	IN const char* Path,
+	OUT PTOUCH_REPLAY_TRACE Trace
+)
+{
+	unsigned char* data;
+	BOOLEAN loaded;
+	FILE* file;
+	long size;
+
+	memset(Trace, 0, sizeof(*Trace));
+	Trace->Path = Path;
+
+	file = fopen(Path, "rb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "replay: cannot open %s\n", Path);
+		return FALSE;
+	}
+
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	data = malloc((SIZE_T)size + 1);
+	if (data == NULL || fread(data, 1, (SIZE_T)size, file) != (SIZE_T)size)
+	{
+		fprintf(stderr, "replay: cannot read %s\n", Path);
+		fclose(file);
+		free(data);
+		return FALSE;
+	}
+
+	fclose(file);
+	data[size] = '\0';
+
+	loaded = TchReplayLoadRecorder(data, (SIZE_T)size, Trace);
+	if (!loaded)
+	{
+		loaded = TchReplayLoadText((char*)data, Trace);
+	}
+
+	free(data);
+
+	if (loaded)
+	{
+		qsort(Trace->Events, Trace->Count, sizeof(TOUCH_REPLAY_EVENT), TchReplayCompareEvents);
+	}
+
+	return loaded;
+}
+
+static VOID
+TchReplayRecordLatency(
+	IN PTOUCH_REPLAY_SIM Sim,
+	IN LONGLONG Latency
+)
+{
+	PTOUCH_REPLAY_RESULT result = Sim->Result;
+
+	if (result->LatencyCount == result->LatencyCapacity)
+	{
+		result->Latencies = TchReplayGrow(result->Latencies, &result->LatencyCapacity, sizeof(LONGLONG));
+	}
+
+	result->Latencies[result->LatencyCount++] = Latency;
+}
+
+static BOOLEAN
+TchReplayIsOn(
+	IN PTOUCH_REPLAY_SIM Sim
+)
+{
+	return ReadNoFence(&Sim->Core.PStateCache[0]) == TOUCH_POWER_PSTATE_ON;
+}
+
+static BOOLEAN
+TchReplayWantsOn(
+	IN PTOUCH_REPLAY_SIM Sim
+)
+{
+	return Sim->ClientOn &&
+		!Sim->Idle &&
+		!Sim->Display.Gated;
+}
+
+static VOID
+TchReplayReevaluate(
+	IN PTOUCH_REPLAY_SIM Sim
+);
+
+static VOID
+TchReplayTransitionDone(
+	IN PTOUCH_REPLAY_SIM Sim
+)
+{
+	Sim->InFlight = FALSE;
+
+	TchReplayReevaluate(Sim);
+}
+
+static VOID
+TchReplayIssue(
+	IN PTOUCH_REPLAY_SIM Sim,
+	IN BOOLEAN On,
+	IN ULONG Cause
+)
+{
+	TOUCH_POWER_PSTATE_VECTOR target;
+	NTSTATUS status;
+
+	TchCoreVectorFromState(On, &target);
+
+	if (TchCoreElide(&Sim->Core, &target))
+	{
+		return;
+	}
+
+	Sim->InFlight = TRUE;
+	Sim->Result->Transitions++;
+
+	if (Cause == TouchPowerCauseIdleTimeout)
+	{
+		Sim->Result->IdlePowerDowns++;
+	}
+
+	status = TchCoreSetPStates(&Sim->Core, &target, Sim, Cause, 0);
+	if (status != STATUS_PENDING)
+	{
+		TchReplayTransitionDone(Sim);
+	}
+}
+
+static VOID
+TchReplayReevaluate(
+	IN PTOUCH_REPLAY_SIM Sim
+)
+/*++
+
+Routine Description:
+
+	Moves the digitizer towards what the policy wants. Power-on goes
+	out at once; power-off goes past the hysteresis stage as in the
+	driver. The display gate applies its delay before it gates the
+	digitizer at all.
+
+--*/
+{
+	LONGLONG due;
+	BOOLEAN wantsOn;
+
+	if (Sim->InFlight)
+	{
+		return;
+	}
+
+	wantsOn = TchReplayWantsOn(Sim);
+
+	Sim->PolicyDue = 0;
+
+	if (wantsOn)
+	{
+		//
+		// Drops a power-off the stage is holding back
+		//
+		TchPolicyAdmit(&Sim->Stage, TRUE);
+
+		if (!TchReplayIsOn(Sim))
+		{
+			TchReplayIssue(Sim, TRUE, TouchPowerCauseRequest);
+		}
+
+		return;
+	}
+
+	if (ReadNoFence(&Sim->Core.PStateCache[0]) == TOUCH_POWER_PSTATE_OFF)
+	{
+		return;
+	}
+
+	//
+	// The stage works in 100ns units of the virtual clock
+	//
+	due = (LONGLONG)TchPolicyAdmit(&Sim->Stage, FALSE) * 100;
+
+	if (due != 0)
+	{
+		Sim->PolicyDue = (due > TchReplayNow) ? due : TchReplayNow + 1;
+		return;
+	}
+
+	TchReplayIssue(
+		Sim,
+		FALSE,
+		Sim->Idle ? TouchPowerCauseIdleTimeout : TouchPowerCauseRequest);
+}
+
+static VOID
+TchReplayReachPState(
+	IN PTOUCH_REPLAY_SIM Sim,
+	IN LONG PState
+)
+/*++
+
+Routine Description:
+
+	Accounts for the power gate reaching PState, whether the core saw
+	it happen or only the PEP did.
+
+--*/
+{
+	ULONG i;
+
+	if (PState == TOUCH_POWER_NO_TARGET || PState == Sim->PState)
+	{
+		return;
+	}
+
+	Sim->Result->Residency[Sim->PState != TOUCH_POWER_PSTATE_OFF] += TchReplayNow - Sim->PStateSince;
+	Sim->PState = PState;
+	Sim->PStateSince = TchReplayNow;
+
+	TchPolicyCommitted(&Sim->Stage, PState != TOUCH_POWER_PSTATE_OFF);
+
+	if (PState == TOUCH_POWER_PSTATE_OFF)
+	{
+		return;
+	}
+
+	for (i = 0; i < Sim->WaitingCount; i++)
+	{
+		TchReplayRecordLatency(Sim, TchReplayNow - Sim->Waiting[i]);
+	}
+
+	Sim->WaitingCount = 0;
+}
+
+static VOID
+TchReplayConfirm(
+	IN PTOUCH_REPLAY_SIM Sim,
+	IN ULONG Index
+)
+/*++
+
+Routine Description:
+
+	Delivers the confirmation the PEP owes for the transition slot
+	Index. The PEP carries the transition out even if the core no
+	longer waits for it.
+
+--*/
+{
+	if (TchCoreConfirm(&Sim->Core, Sim->ConfirmUserData[Index], STATUS_SUCCESS) == STATUS_NOT_FOUND)
+	{
+		TchReplayReachPState(Sim, Sim->ConfirmPState[Index]);
+	}
+}
+
+static NTSTATUS
+TchReplayBackendRegisterDevice(
+	IN PVOID Context
+)
+{
+	UNREFERENCED_PARAMETER(Context);
+
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+TchReplayBackendPowerControl(
+	IN PVOID Context,
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot,
+	IN const TOUCH_POWER_PSTATE_ENTRY* Entries,
+	IN ULONG Count,
+	OUT NTSTATUS* PepStatus
+)
+{
+	PTOUCH_REPLAY_SIM sim = (PTOUCH_REPLAY_SIM)Context;
+	ULONG latencyUs = sim->Model->OffLatencyUs;
+	LONG pState = TOUCH_POWER_NO_TARGET;
+	ULONG i;
+
+	for (i = 0; i < Count; i++)
+	{
+		if (Entries[i].SetIndex == 0)
+		{
+			pState = (LONG)Entries[i].PStateIndex;
+
+			if (Entries[i].PStateIndex != TOUCH_POWER_PSTATE_OFF)
+			{
+				latencyUs = sim->Model->OnLatencyUs;
+			}
+		}
+	}
+
+	//
+	// The PEP finishes a transition the watchdog gave up on before it
+	// takes the next one for the slot
+	//
+	if (sim->ConfirmDue[Slot->Index] != 0)
+	{
+		sim->ConfirmDue[Slot->Index] = 0;
+		TchReplayConfirm(sim, Slot->Index);
+	}
+
+	if (latencyUs == 0)
+	{
+		*PepStatus = STATUS_SUCCESS;
+		return STATUS_SUCCESS;
+	}
+
+	sim->ConfirmDue[Slot->Index] = TchReplayNow + (LONGLONG)latencyUs * 1000;
+	sim->ConfirmUserData[Slot->Index] = Slot->UserData;
+	sim->ConfirmPState[Slot->Index] = pState;
+	*PepStatus = STATUS_WAIT_1;
+
+	return STATUS_SUCCESS;
+}
+
+static VOID
+TchReplayBackendStartWatchdog(
+	IN PVOID Context,
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot,
+	IN ULONG TimeoutMs
+)
+{
+	PTOUCH_REPLAY_SIM sim = (PTOUCH_REPLAY_SIM)Context;
+
+	sim->WatchdogDue[Slot->Index] = TchReplayNow + (LONGLONG)TimeoutMs * 1000000;
+}
+
+static VOID
+TchReplayBackendStopWatchdog(
+	IN PVOID Context,
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot
+)
+{
+	PTOUCH_REPLAY_SIM sim = (PTOUCH_REPLAY_SIM)Context;
+
+	sim->WatchdogDue[Slot->Index] = 0;
+}
+
+static VOID
+TchReplayBackendTransitionCommitted(
+	IN PVOID Context,
+	IN PTOUCH_POWER_TRANSITION_SLOT Slot,
+	IN NTSTATUS Status,
+	IN BOOLEAN StateChanged
+)
+{
+	UNREFERENCED_PARAMETER(StateChanged);
+
+	if (NT_SUCCESS(Status))
+	{
+		TchReplayReachPState((PTOUCH_REPLAY_SIM)Context, Slot->Target.PStates[0]);
+	}
+}
+
+static VOID
+TchReplayBackendCompleteRequest(
+	IN PVOID Context,
+	IN PVOID Request,
+	IN NTSTATUS Status
+)
+{
+	UNREFERENCED_PARAMETER(Request);
+	UNREFERENCED_PARAMETER(Status);
+
+	TchReplayTransitionDone((PTOUCH_REPLAY_SIM)Context);
+}
+
+static const TOUCH_POWER_CORE_BACKEND TchReplayBackend =
+{
+	TchReplayBackendRegisterDevice,
+	TchReplayBackendPowerControl,
+	TchReplayBackendStartWatchdog,
+	TchReplayBackendStopWatchdog,
+	TchReplayBackendTransitionCommitted,
+	TchReplayBackendCompleteRequest
+};
+
+static VOID
+TchReplayActive(
+	IN PTOUCH_REPLAY_SIM Sim
+)
+{
+	Sim->Idle = FALSE;
+
+	if (Sim->Policy->IdleTimeoutMs != 0)
+	{
+		Sim->IdleDue = TchReplayNow + (LONGLONG)Sim->Policy->IdleTimeoutMs * 1000000;
+	}
+}
+
+static VOID
+TchReplaySetClient(
+	IN PTOUCH_REPLAY_SIM Sim,
+	IN BOOLEAN On
+)
+{
+	//
+	// A client asking for touch holds an active reference in the
+	// driver, which restarts the idle timeout as input does
+	//
+	if (On && !Sim->ClientOn)
+	{
+		TchReplayActive(Sim);
+	}
+
+	Sim->ClientOn = On;
+	TchReplayReevaluate(Sim);
+}
+
+static VOID
+TchReplayOnInput(
+	IN PTOUCH_REPLAY_SIM Sim
+)
+{
+	ULONGLONG capacity;
+
+	if (!Sim->ClientOn || (Sim->Policy->Display.Enabled && !Sim->Display.On))
+	{
+		//
+		// Nobody wants touch right now, the input goes nowhere
+		//
+		Sim->Result->IgnoredInputs++;
+		return;
+	}
+
+	Sim->Result->Inputs++;
+	TchReplayActive(Sim);
+
+	if (TchReplayIsOn(Sim) && !Sim->InFlight)
+	{
+		TchReplayRecordLatency(Sim, 0);
+	}
+	else
+	{
+		if (Sim->WaitingCount == Sim->WaitingCapacity)
+		{
+			capacity = Sim->WaitingCapacity;
+			Sim->Waiting = TchReplayGrow(Sim->Waiting, &capacity, sizeof(LONGLONG));
+			Sim->WaitingCapacity = (ULONG)capacity;
+		}
+
+		Sim->Waiting[Sim->WaitingCount++] = TchReplayNow;
+	}
+
+	TchReplayReevaluate(Sim);
+}
+
+static VOID
+TchReplayOnDisplay(
+	IN PTOUCH_REPLAY_SIM Sim,
+	IN TOUCH_POWER_DISPLAY_SOURCE Source,
+	IN ULONG State
+)
+/*++
+
+Routine Description:
+
+	Plays the part of the driver's power setting callback: hands the
+	display state to the display gate and carries out what it decided.
+	A display coming back that the gate does not power the digitizer on
+	with leaves it off until the client asks again, as in the driver.
+
+--*/
+{
+	ULONGLONG due;
+	BOOLEAN gated = Sim->Display.Gated;
+
+	switch (TchDisplayNotify(&Sim->Display, Source, State, &due))
+	{
+	case TouchPowerDisplayPowerOff:
+		TchDisplayGate(&Sim->Display, TchCoreGetState(&Sim->Core), FALSE);
+		break;
+
+	case TouchPowerDisplayPowerOn:
+		break;
+
+	case TouchPowerDisplayArm:
+		//
+		// The gate works in 100ns units of the virtual clock
+		//
+		Sim->DisplayDue = (LONGLONG)due * 100;
+		break;
+
+	case TouchPowerDisplayDisarm:
+		Sim->DisplayDue = 0;
+		break;
+
+	default:
+		if (gated && !Sim->Display.Gated)
+		{
+			Sim->ClientOn = FALSE;
+		}
+		break;
+	}
+
+	TchReplayReevaluate(Sim);
+}
+
+static VOID
+TchReplayOnEvent(
+	IN PTOUCH_REPLAY_SIM Sim,
+	IN const TOUCH_REPLAY_EVENT* Event
+)
+{
+	switch (Event->Type)
+	{
+	case ReplayEventToggle:
+		if (Sim->Policy->CoalesceWindowMs == 0)
+		{
+			TchReplaySetClient(Sim, (BOOLEAN)Event->Value);
+			break;
+		}
+
+		//
+		// The first toggle of a burst opens the window, the last one
+		// before it closes wins
+		//
+		Sim->WindowClientOn = (BOOLEAN)Event->Value;
+		if (Sim->WindowDue == 0)
+		{
+			Sim->WindowDue = TchReplayNow + (LONGLONG)Sim->Policy->CoalesceWindowMs * 1000000;
+		}
+		break;
+
+	case ReplayEventInput:
+		TchReplayOnInput(Sim);
+		break;
+
+	case ReplayEventDisplay:
+	case ReplayEventMonitor:
+		TchReplayOnDisplay(
+			Sim,
+			(Event->Type == ReplayEventDisplay) ? TouchPowerDisplayConsole : TouchPowerDisplayMonitor,
+			Event->Value);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static BOOLEAN
+TchReplayRunTimer(
+	IN PTOUCH_REPLAY_SIM Sim,
+	IN LONGLONG Limit
+)
+/*++
+
+Routine Description:
+
+	Advances the virtual clock to the earliest timer due no later than
+	Limit and fires it.
+
+Return Value:
+
+	FALSE if no timer is due by Limit
+
+--*/
+{
+	LONGLONG* timers[2 * TOUCH_POWER_MAX_TRANSITIONS + 4];
+	LONGLONG* earliest = NULL;
+	ULONG count = 0;
+	ULONG index;
+	ULONG i;
+
+	for (i = 0; i < TOUCH_POWER_MAX_TRANSITIONS; i++)
+	{
+		timers[count++] = &Sim->ConfirmDue[i];
+		timers[count++] = &Sim->WatchdogDue[i];
+	}
+
+	timers[count++] = &Sim->WindowDue;
+	timers[count++] = &Sim->IdleDue;
+	timers[count++] = &Sim->PolicyDue;
+	timers[count++] = &Sim->DisplayDue;
+
+	for (i = 0; i < count; i++)
+	{
+		if (*timers[i] != 0 && *timers[i] <= Limit &&
+			(earliest == NULL || *timers[i] < *earliest))
+		{
+			earliest = timers[i];
+		}
+	}
+
+	if (earliest == NULL)
+	{
+		return FALSE;
+	}
+
+	TchReplayNow = *earliest;
+	*earliest = 0;
+
+	if (earliest >= &Sim->ConfirmDue[0] && earliest < &Sim->ConfirmDue[TOUCH_POWER_MAX_TRANSITIONS])
+	{
+		TchReplayConfirm(Sim, (ULONG)(earliest - &Sim->ConfirmDue[0]));
+	}
+	else if (earliest >= &Sim->WatchdogDue[0] && earliest < &Sim->WatchdogDue[TOUCH_POWER_MAX_TRANSITIONS])
+	{
+		index = (ULONG)(earliest - &Sim->WatchdogDue[0]);
+		TchCoreOnWatchdog(&Sim->Core, &Sim->Core.Slots[index]);
+	}
+	else if (earliest == &Sim->WindowDue)
+	{
+		TchReplaySetClient(Sim, Sim->WindowClientOn);
+	}
+	else if (earliest == &Sim->IdleDue)
+	{
+		Sim->Idle = TRUE;
+		TchReplayReevaluate(Sim);
+	}
+	else if (earliest == &Sim->DisplayDue)
+	{
+		if (TchDisplayExpire(&Sim->Display))
+		{
+			TchDisplayGate(&Sim->Display, TchCoreGetState(&Sim->Core), FALSE);
+		}
+
+		TchReplayReevaluate(Sim);
+	}
+	else
+	{
+		TchReplayReevaluate(Sim);
+	}
+
+	return TRUE;
+}
+
+static VOID
+TchReplayRun(
+	IN const TOUCH_REPLAY_TRACE* Trace,
+	IN const TOUCH_REPLAY_POLICY* Policy,
+	IN const TOUCH_REPLAY_MODEL* Model,
+	IN OUT PTOUCH_REPLAY_RESULT Result
+)
+/*++
+
+Routine Description:
+
+	Replays one trace under one policy and adds the outcome to Result.
+	The digitizer starts off with the display on and the client not
+	having asked for touch yet. With StartUnknown the driver does not
+	know the state the digitizer starts in and takes it for on, as it
+	does at boot.
+
+--*/
+{
+	static TOUCH_REPLAY_SIM sim;
+	LONGLONG end = 0;
+	ULONG i;
+
+	free(sim.Waiting);
+	memset(&sim, 0, sizeof(sim));
+
+	TchReplayNow = 0;
+
+	sim.Policy = Policy;
+	sim.Model = Model;
+	sim.Result = Result;
+	sim.PState = TOUCH_POWER_PSTATE_OFF;
+
+	TchCoreInitialize(&sim.Core, &TchReplayBackend, &sim, Model->TransitionTimeoutMs);
+
+	//
+	// Unless asked to start out like the driver at boot, the simulation
+	// knows where the digitizer starts
+	//
+	if (Model->StartUnknown)
+	{
+		sim.PState = TOUCH_POWER_PSTATE_ON;
+		sim.ClientOn = TRUE;
+	}
+	else
+	{
+		sim.Core.PowerState = TOUCH_POWER_STATE_PACK(0, 0, 0);
+		sim.Core.PStateCache[0] = TOUCH_POWER_PSTATE_OFF;
+	}
+	TchPolicyInitialize(&sim.Stage, &TchPolicyHysteresis, &Policy->Hysteresis);
+	TchDisplayInitialize(&sim.Display, &Policy->Display);
+
+	if (Policy->IdleTimeoutMs != 0)
+	{
+		sim.IdleDue = (LONGLONG)Policy->IdleTimeoutMs * 1000000;
+	}
+
+	for (i = 0; i < Trace->Count; i++)
+	{
+		while (TchReplayRunTimer(&sim, Trace->Events[i].Time))
+		{
+		}
+
+		TchReplayNow = Trace->Events[i].Time;
+		end = TchReplayNow;
+
+		if (Trace->Events[i].Type == ReplayEventEnd)
+		{
+			break;
+		}
+
+		TchReplayOnEvent(&sim, &Trace->Events[i]);
+	}
+
+	//
+	// Let whatever the last events set off play out within the trace
+	//
+	while (TchReplayRunTimer(&sim, end))
+	{
+	}
+
+	TchReplayNow = end;
+
+	Result->Residency[sim.PState != TOUCH_POWER_PSTATE_OFF] += end - sim.PStateSince;
+	Result->Duration += end;
+	Result->UnservedInputs += sim.WaitingCount;
+	Result->OffsHeld += (ULONGLONG)sim.Stage.OffsHeld;
+	Result->OffsSuppressed += (ULONGLONG)sim.Stage.OffsSuppressed;
+	Result->Thrashes += (ULONGLONG)sim.Stage.Thrashes;
+}
+
+static int
+TchReplayCompareLatencies(
+	const void* Left,
+	const void* Right
+)
+{
+	LONGLONG left = *(const LONGLONG*)Left;
+	LONGLONG right = *(const LONGLONG*)Right;
+
+	return (left > right) - (left < right);
+}
+
+static double
+TchReplayPercentileMs(
+	IN const TOUCH_REPLAY_RESULT* Result,
+	IN double Percentile
+)
+{
+	ULONGLONG index;
+
+	if (Result->LatencyCount == 0)
+	{
+		return 0;
+	}
+
+	index = (ULONGLONG)(Percentile / 100.0 * (double)(Result->LatencyCount - 1) + 0.5);
+
+	return (double)Result->Latencies[index] / 1e6;
+}
+
+static VOID
+TchReplayReport(
+	IN const TOUCH_REPLAY_POLICY* Policy,
+	IN const TOUCH_REPLAY_MODEL* Model,
+	IN PTOUCH_REPLAY_RESULT Result,
+	IN BOOLEAN Json,
+	IN BOOLEAN Last
+)
+{
+	double seconds = (double)Result->Duration / 1e9;
+	double energyMj;
+	double meanMs = 0;
+	ULONGLONG i;
+
+	energyMj =
+		(double)Result->Residency[1] / 1e9 * Model->OnMw +
+		(double)Result->Residency[0] / 1e9 * Model->OffMw +
+		(double)Result->Transitions * Model->TransitionUj / 1000.0;
+
+	qsort(Result->Latencies, (SIZE_T)Result->LatencyCount, sizeof(LONGLONG), TchReplayCompareLatencies);
+
+	for (i = 0; i < Result->LatencyCount; i++)
+	{
+		meanMs += (double)Result->Latencies[i] / 1e6;
+	}
+
+	if (Result->LatencyCount != 0)
+	{
+		meanMs /= (double)Result->LatencyCount;
+	}
+
+	if (Json)
+	{
+		printf("    {\"policy\": \"%s\", \"idle_timeout_ms\": %u, \"coalesce_window_ms\": %u, "
+			"\"min_on_ms\": %u, \"min_off_ms\": %u, \"off_delay_ms\": %u, \"display_gating\": %s, "
+			"\"display_off_delay_ms\": %u, "
+			"\"duration_s\": %.3f, \"energy_mj\": %.3f, \"average_mw\": %.4f, \"on_percent\": %.3f, "
+			"\"transitions\": %llu, \"idle_power_downs\": %llu, \"inputs\": %llu, \"ignored_inputs\": %llu, "
+			"\"unserved_inputs\": %llu, \"offs_held\": %llu, \"offs_suppressed\": %llu, \"thrash_events\": %llu, "
+			"\"wake_latency_ms\": {\"mean\": %.3f, \"p50\": %.3f, \"p95\": %.3f, "
+			"\"p99\": %.3f, \"max\": %.3f}}%s\n",
+			Policy->Name,
+			Policy->IdleTimeoutMs,
+			Policy->CoalesceWindowMs,
+			Policy->Hysteresis.MinOnMs,
+			Policy->Hysteresis.MinOffMs,
+			Policy->Hysteresis.OffDelayMs,
+			Policy->Display.Enabled ? "true" : "false",
+			Policy->Display.OffDelayMs,
+			seconds,
+			energyMj,
+			(seconds > 0) ? energyMj / seconds : 0.0,
+			(Result->Duration != 0) ? 100.0 * (double)Result->Residency[1] / (double)Result->Duration : 0.0,
+			(unsigned long long)Result->Transitions,
+			(unsigned long long)Result->IdlePowerDowns,
+			(unsigned long long)Result->Inputs,
+			(unsigned long long)Result->IgnoredInputs,
+			(unsigned long long)Result->UnservedInputs,
+			(unsigned long long)Result->OffsHeld,
+			(unsigned long long)Result->OffsSuppressed,
+			(unsigned long long)Result->Thrashes,
+			meanMs,
+			TchReplayPercentileMs(Result, 50),
+			TchReplayPercentileMs(Result, 95),
+			TchReplayPercentileMs(Result, 99),
+			TchReplayPercentileMs(Result, 100),
+			Last ? "" : ",");
+
+		return;
+	}
+
+	printf("%-16s %12.3f %10.4f %6.2f%% %8llu %8llu %8llu %8.3f %8.3f %8.3f %8.3f %8llu\n",
+		Policy->Name,
+		energyMj,
+		(seconds > 0) ? energyMj / seconds : 0.0,
+		(Result->Duration != 0) ? 100.0 * (double)Result->Residency[1] / (double)Result->Duration : 0.0,
+		(unsigned long long)Result->Transitions,
+		(unsigned long long)Result->Thrashes,
+		(unsigned long long)Result->Inputs,
+		meanMs,
+		TchReplayPercentileMs(Result, 50),
+		TchReplayPercentileMs(Result, 99),
+		TchReplayPercentileMs(Result, 100),
+		(unsigned long long)Result->UnservedInputs);
+}
+
+static BOOLEAN
+TchReplayParsePolicy(
+	IN const char* Spec,
+	OUT PTOUCH_REPLAY_POLICY Policy
+)
+/*++
+
+Routine Description:
+
+	Parses a policy given as comma separated key=value pairs: name,
+	idle, coalesce, min-on, min-off, off-delay (milliseconds), display
+	(0 or 1) and display-delay (milliseconds). Keys left out keep the
+	driver's defaults.
+
+--*/
+{
+	char buffer[256];
+	char* pair;
+	char* value;
+	char* save = NULL;
+	ULONG number;
+
+	memset(Policy, 0, sizeof(*Policy));
+	Policy->IdleTimeoutMs = TOUCH_POWER_DEFAULT_IDLE_TIMEOUT_MS;
+	Policy->CoalesceWindowMs = TOUCH_POWER_DEFAULT_COALESCE_WINDOW_MS;
+	Policy->Hysteresis.MinOnMs = TOUCH_POWER_DEFAULT_MIN_ON_MS;
+	Policy->Hysteresis.MinOffMs = TOUCH_POWER_DEFAULT_MIN_OFF_MS;
+	Policy->Hysteresis.OffDelayMs = TOUCH_POWER_DEFAULT_OFF_DELAY_MS;
+	Policy->Display.Enabled = TOUCH_POWER_DEFAULT_DISPLAY_GATING;
+	Policy->Display.OffDelayMs = TOUCH_POWER_DEFAULT_DISPLAY_OFF_DELAY_MS;
+	snprintf(Policy->Name, sizeof(Policy->Name), "%s", Spec);
+	snprintf(buffer, sizeof(buffer), "%s", Spec);
+
+	for (pair = strtok_r(buffer, ",", &save); pair != NULL; pair = strtok_r(NULL, ",", &save))
+	{
+		value = strchr(pair, '=');
+		if (value == NULL)
+		{
+			return FALSE;
+		}
+
+		*value++ = '\0';
+		number = (ULONG)strtoul(value, NULL, 0);
+
+		if (strcmp(pair, "name") == 0)
+		{
+			snprintf(Policy->Name, sizeof(Policy->Name), "%s", value);
+		}
+		else if (strcmp(pair, "idle") == 0)
+		{
+			Policy->IdleTimeoutMs = number;
+		}
+		else if (strcmp(pair, "coalesce") == 0)
+		{
+			Policy->CoalesceWindowMs = number;
+		}
+		else if (strcmp(pair, "min-on") == 0)
+		{
+			Policy->Hysteresis.MinOnMs = number;
+		}
+		else if (strcmp(pair, "min-off") == 0)
+		{
+			Policy->Hysteresis.MinOffMs = number;
+		}
+		else if (strcmp(pair, "off-delay") == 0)
+		{
+			Policy->Hysteresis.OffDelayMs = number;
+		}
+		else if (strcmp(pair, "display") == 0)
+		{
+			Policy->Display.Enabled = (number != 0);
+		}
+		else if (strcmp(pair, "display-delay") == 0)
+		{
+			Policy->Display.OffDelayMs = number;
+		}
+		else
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static VOID
+TchReplayUsage(
+	VOID
+)
+{
+	fprintf(stderr,
+		"usage: touchpower_replay [options] trace...\n"
+		"  --policy SPEC          policy to evaluate, may be repeated; SPEC is a\n"
+		"                         comma separated list of name=, idle=, coalesce=,\n"
+		"                         min-on=, min-off=, off-delay=, display=0|1,\n"
+		"                         display-delay=\n"
+		"                         (times in ms); keys left out and the default\n"
+		"                         policy take the driver's defaults\n"
+		"  --on-latency-us US     PEP power-on latency (default 30000)\n"
+		"  --off-latency-us US    PEP power-off latency (default 2000)\n"
+		"  --on-mw MW             digitizer power while on (default 25)\n"
+		"  --off-mw MW            digitizer power while off (default 0)\n"
+		"  --transition-uj UJ     energy per transition (default 0)\n"
+		"  --start-unknown        start with the digitizer state unknown to the\n"
+		"                         driver, as at boot, instead of off\n"
+		"  --json                 write results as JSON\n");
+}
+
+int
+main(
+	int argc,
+	char** argv
+)
+{
+	static TOUCH_REPLAY_POLICY policies[TOUCH_REPLAY_MAX_POLICIES];
+	static TOUCH_REPLAY_RESULT results[TOUCH_REPLAY_MAX_POLICIES];
+	TOUCH_REPLAY_MODEL model;
+	TOUCH_REPLAY_TRACE trace;
+	ULONG policyCount = 0;
+	ULONG traceCount = 0;
+	BOOLEAN json = FALSE;
+	ULONG p;
+	int i;
+
+	memset(&model, 0, sizeof(model));
+	model.OnLatencyUs = 30000;
+	model.OffLatencyUs = 2000;
+	model.TransitionTimeoutMs = TOUCH_POWER_DEFAULT_TRANSITION_TIMEOUT_MS;
+	model.OnMw = 25;
+	model.OffMw = 0;
+	model.TransitionUj = 0;
+
+	for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] == '-'; i++)
+	{
+		if (strcmp(argv[i], "--json") == 0)
+		{
+			json = TRUE;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--start-unknown") == 0)
+		{
+			model.StartUnknown = TRUE;
+			continue;
+		}
+
+		if (i + 1 >= argc)
+		{
+			TchReplayUsage();
+			return 2;
+		}
+
+		if (strcmp(argv[i], "--policy") == 0)
+		{
+			if (policyCount == TOUCH_REPLAY_MAX_POLICIES ||
+				!TchReplayParsePolicy(argv[++i], &policies[policyCount]))
+			{
+				TchReplayUsage();
+				return 2;
+			}
+
+			policyCount++;
+		}
+		else if (strcmp(argv[i], "--on-latency-us") == 0)
+		{
+			model.OnLatencyUs = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--off-latency-us") == 0)
+		{
+			model.OffLatencyUs = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--on-mw") == 0)
+		{
+			model.OnMw = strtod(argv[++i], NULL);
+		}
+		else if (strcmp(argv[i], "--off-mw") == 0)
+		{
+			model.OffMw = strtod(argv[++i], NULL);
+		}
+		else if (strcmp(argv[i], "--transition-uj") == 0)
+		{
+			model.TransitionUj = strtod(argv[++i], NULL);
+		}
+		else
+		{
+			TchReplayUsage();
+			return 2;
+		}
+	}
+
+	if (i >= argc)
+	{
+		TchReplayUsage();
+		return 2;
+	}
+
+	if (policyCount == 0)
+	{
+		TchReplayParsePolicy("name=driver", &policies[policyCount++]);
+	}
+
+	for (; i < argc; i++)
+	{
+		if (!TchReplayLoad(argv[i], &trace))
+		{
+			return 2;
+		}
+
+		for (p = 0; p < policyCount; p++)
+		{
+			TchReplayRun(&trace, &policies[p], &model, &results[p]);
+		}
+
+		free(trace.Events);
+		traceCount++;
+	}
+
+	if (json)
+	{
+		printf("{\n  \"traces\": %u,\n  \"policies\": [\n", traceCount);
+	}
+	else
+	{
+		printf("%u traces\n", traceCount);
+		printf("policy              energy_mj avg_mw       on%%  transns   thrash   inputs  wake_ms      p50      p99      max unserved\n");
+	}
+
+	for (p = 0; p < policyCount; p++)
+	{
+		TchReplayReport(&policies[p], &model, &results[p], json, p + 1 == policyCount);
+		free(results[p].Latencies);
+	}
+
+	if (json)
+	{
+		printf("  ]\n}\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,663 @@
+/*++
+	Copyright (c) LumiaWoA authors. All Rights Reserved.
+
+	Module Name:
+
+		stress.c
+
+	Abstract:
+
+		Contention stress harness for the power core. The test queue of
+		the driver dispatches in parallel, so toggles, state queries and
+		P-state changes from many clients reach the core at the same
+		time. This runs 1 to --max-threads workers against the
+		simulated PEP with randomized operations and think times.
+
+		Workers are paused at regular intervals, and the core and the
+		PEP are checked once every operation has finished:
+
+		- no transition owns the state machine, a P-state set or a slot
+		- the cached P-states and the digitizer state match what the PEP
+		  last reached
+		- every transition was committed once, every pending one was
+		  completed once, and the number of state changes agrees with
+		  the final state
+
+		Throughput, busy rejections and slot exhaustion are reported per
+		thread count. Besides wall-clock throughput, throughput is given
+		net of the time workers spent in think time, which would
+		otherwise dominate the scaling figure. The process fails if any
+		check did.
+
+	Environment:
+
+		User mode
+
+	Revision History:
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include "fakepep.h"
+
+#define TOUCH_STRESS_MAX_THREADS        64
+
+//
+// IOCTL_TOUCH_POWER_RESET does not reach the power logic, a P-state
+// change of the scan rate set stands in for the third kind of request
+//
+#define TOUCH_STRESS_SCAN_SET           1
+#define TOUCH_STRESS_SCAN_PSTATES       3
+
+typedef struct __attribute__((aligned(64))) _TOUCH_STRESS_WORKER
+{
+	pthread_t Thread;
+	PTOUCH_FAKE_PEP Pep;
+	struct _TOUCH_STRESS_RUN* Run;
+	ULONGLONG Random;
+
+	ULONGLONG Ops;
+	ULONGLONG Toggles;
+	ULONGLONG ScanChanges;
+	ULONGLONG Queries;
+	ULONGLONG Elided;
+	ULONGLONG Busy;
+	ULONGLONG Exhausted;
+	ULONGLONG Pending;
+	ULONGLONG Committed;
+	ULONGLONG Failed;
+	ULONGLONG BadStates;
+	ULONGLONG ThinkNs;
+} TOUCH_STRESS_WORKER, *PTOUCH_STRESS_WORKER;
+
+typedef struct _TOUCH_STRESS_RUN
+{
+	volatile LONG Start;
+	volatile LONG Stop;
+
+	//
+	// Workers announce themselves in InFlight for the duration of an
+	// operation and hold off while Pause is set
+	//
+	volatile LONG Pause;
+	volatile LONG InFlight;
+
+	ULONG ThinkUs;
+	ULONG Checks;
+	ULONG Violations;
+} TOUCH_STRESS_RUN, *PTOUCH_STRESS_RUN;
+
+static ULONGLONG
+TchStressRandom(
+	IN OUT PULONGLONG State
+)
+{
+	ULONGLONG x = *State;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*State = x;
+
+	return x;
+}
+
+static VOID
+TchStressThink(
+	IN PTOUCH_STRESS_WORKER Worker
+)
+{
+	struct timespec delay;
+	LONGLONG start;
+	ULONG us;
+
+	if (Worker->Run->ThinkUs == 0)
+	{
+		return;
+	}
+
+	start = TchPlatQueryTicks();
+	us = (ULONG)(TchStressRandom(&Worker->Random) % (Worker->Run->ThinkUs + 1));
+
+	if (us == 0)
+	{
+		sched_yield();
+	}
+	else
+	{
+		delay.tv_sec = 0;
+		delay.tv_nsec = (long)us * 1000;
+		nanosleep(&delay, NULL);
+	}
+
+	Worker->ThinkNs += (ULONGLONG)(TchPlatQueryTicks() - start);
+}
+
+static VOID
+TchStressTransition(
+	IN PTOUCH_STRESS_WORKER Worker,
+	IN OUT PTOUCH_POWER_PSTATE_VECTOR Target
+)
+{
+	TOUCH_FAKE_REQUEST request;
+	NTSTATUS status;
+
+	if (TchCoreElide(&Worker->Pep->Core, Target))
+	{
+		Worker->Elided++;
+		return;
+	}
+
+	request.Completed = 0;
+	request.Status = STATUS_PENDING;
+
+	status = TchCoreSetPStates(&Worker->Pep->Core, Target, &request, 1, 0);
+
+	switch (status)
+	{
+	case STATUS_DEVICE_BUSY:
+		Worker->Busy++;
+		return;
+
+	case STATUS_INSUFFICIENT_RESOURCES:
+		Worker->Exhausted++;
+		return;
+
+	case STATUS_PENDING:
+		Worker->Pending++;
+		TchFakePepWaitRequest(Worker->Pep, &request);
+		status = request.Status;
+		break;
+
+	default:
+		break;
+	}
+
+	Worker->Committed++;
+
+	if (!NT_SUCCESS(status))
+	{
+		Worker->Failed++;
+	}
+}
+
+static void*
+TchStressWorker(
+	IN void* Context
+)
+{
+	PTOUCH_STRESS_WORKER worker = (PTOUCH_STRESS_WORKER)Context;
+	PTOUCH_STRESS_RUN run = worker->Run;
+	TOUCH_POWER_PSTATE_VECTOR target;
+	ULONG i;
+	ULONG draw;
+	DWORD state;
+
+	while (!ReadAcquire(&run->Start))
+	{
+		sched_yield();
+	}
+
+	while (!ReadNoFence(&run->Stop))
+	{
+		InterlockedIncrement(&run->InFlight);
+
+		if (ReadAcquire(&run->Pause))
+		{
+			InterlockedDecrement(&run->InFlight);
+			sched_yield();
+			continue;
+		}
+
+		draw = (ULONG)(TchStressRandom(&worker->Random) % 100);
+
+		if (draw < 45)
+		{
+			//
+			// IOCTL_TOUCH_POWER_TOGGLE, to a random state so that
+			// transitions to the current state are part of the mix
+			//
+			TchCoreVectorFromState((DWORD)(TchStressRandom(&worker->Random) & 1), &target);
+			TchStressTransition(worker, &target);
+			worker->Toggles++;
+		}
+		else if (draw < 90)
+		{
+			//
+			// IOCTL_TOUCH_POWER_STATE
+			//
+			state = TchCoreGetState(&worker->Pep->Core);
+			if (state > 1 && state != TOUCH_POWER_STATE_UNKNOWN)
+			{
+				worker->BadStates++;
+			}
+
+			worker->Queries++;
+		}
+		else
+		{
+			for (i = 0; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+			{
+				target.PStates[i] = TOUCH_POWER_NO_TARGET;
+			}
+
+			target.PStates[TOUCH_STRESS_SCAN_SET] =
+				(LONG)(TchStressRandom(&worker->Random) % TOUCH_STRESS_SCAN_PSTATES);
+
+			TchStressTransition(worker, &target);
+			worker->ScanChanges++;
+		}
+
+		worker->Ops++;
+
+		InterlockedDecrement(&run->InFlight);
+
+		TchStressThink(worker);
+	}
+
+	return NULL;
+}
+
+static VOID
+TchStressViolation(
+	IN PTOUCH_STRESS_RUN Run,
+	IN const char* Message,
+	IN LONG Expected,
+	IN LONG Actual
+)
+{
+	Run->Violations++;
+
+	if (Run->Violations <= 20)
+	{
+		fprintf(stderr, "stress: %s (expected %d, got %d)\n", Message, Expected, Actual);
+	}
+}
+
+static VOID
+TchStressCheck(
+	IN PTOUCH_FAKE_PEP Pep,
+	IN PTOUCH_STRESS_RUN Run,
+	IN PTOUCH_STRESS_WORKER Workers,
+	IN ULONG Threads
+)
+/*++
+
+Routine Description:
+
+	Verifies the invariants of the core against the simulated PEP. Must
+	be called with every worker paused outside of an operation.
+
+--*/
+{
+	LONG powerState = ReadAcquire(&Pep->Core.PowerState);
+	ULONGLONG committed = 0;
+	ULONGLONG pending = 0;
+	ULONGLONG badStates = 0;
+	LONG cached;
+	LONG reached;
+	LONG current;
+	LONG powerOns;
+	LONG powerOffs;
+	ULONG i;
+
+	Run->Checks++;
+
+	if (TOUCH_POWER_STATE_BUSY(powerState))
+	{
+		TchStressViolation(Run, "state machine claimed while idle", 0, powerState);
+	}
+
+	if (ReadAcquire(&Pep->Core.SlotMask) != 0)
+	{
+		TchStressViolation(Run, "transition slot in use while idle", 0, ReadAcquire(&Pep->Core.SlotMask));
+	}
+
+	if (ReadAcquire(&Pep->Core.SetMask) != 0)
+	{
+		TchStressViolation(Run, "P-state set claimed while idle", 0, ReadAcquire(&Pep->Core.SetMask));
+	}
+
+	for (i = 0; i < TOUCH_POWER_MAX_PSTATE_SETS; i++)
+	{
+		cached = ReadAcquire(&Pep->Core.PStateCache[i]);
+		reached = ReadAcquire(&Pep->PStates[i]);
+
+		//
+		// A set a timed-out transition targeted is unknown until the
+		// next transition reaches it
+		//
+		if (cached != reached && cached != TOUCH_POWER_NO_TARGET)
+		{
+			TchStressViolation(Run, "cached P-state differs from the PEP", reached, cached);
+		}
+	}
+
+	current = (LONG)TOUCH_POWER_STATE_CURRENT(powerState);
+	powerOns = ReadAcquire(&Pep->PowerOns);
+	powerOffs = ReadAcquire(&Pep->StateChanges) - powerOns;
+
+	if (current == TOUCH_POWER_STATE_UNKNOWN)
+	{
+		if (powerOns + powerOffs != 0 && ReadAcquire(&Pep->Timeouts) == 0)
+		{
+			TchStressViolation(Run, "state unknown after a state change", 0, powerOns + powerOffs);
+		}
+	}
+	else if (current != (ReadAcquire(&Pep->PStates[0]) != TOUCH_POWER_PSTATE_OFF))
+	{
+		TchStressViolation(
+			Run,
+			"digitizer state differs from the PEP power gate",
+			ReadAcquire(&Pep->PStates[0]) != TOUCH_POWER_PSTATE_OFF,
+			current);
+	}
+
+	//
+	// The digitizer starts in an unknown state and every state change
+	// after the first flips it, so the last direction taken can be at
+	// most one change ahead of the other. A timed-out transition leaves
+	// the state unknown again, after which this no longer holds.
+	//
+	if (ReadAcquire(&Pep->Timeouts) == 0 &&
+		((current == 1 && (powerOns - powerOffs < 0 || powerOns - powerOffs > 1)) ||
+		(current == 0 && (powerOffs - powerOns < 0 || powerOffs - powerOns > 1))))
+	{
+		TchStressViolation(
+			Run,
+			"state changes do not add up to the current state",
+			powerOns - powerOffs,
+			current);
+	}
+
+	for (i = 0; i < Threads; i++)
+	{
+		committed += Workers[i].Committed;
+		pending += Workers[i].Pending;
+		badStates += Workers[i].BadStates;
+	}
+
+	if ((ULONGLONG)ReadAcquire(&Pep->Commits) != committed)
+	{
+		TchStressViolation(Run, "transitions lost or committed twice", (LONG)committed, ReadAcquire(&Pep->Commits));
+	}
+
+	if ((ULONGLONG)ReadAcquire(&Pep->Completions) != pending)
+	{
+		TchStressViolation(Run, "pending requests lost or completed twice", (LONG)pending, ReadAcquire(&Pep->Completions));
+	}
+
+	if (badStates != 0)
+	{
+		TchStressViolation(Run, "state query returned an invalid state", 0, (LONG)badStates);
+	}
+}
+
+static VOID
+TchStressQuiesce(
+	IN PTOUCH_STRESS_RUN Run
+)
+{
+	InterlockedExchange(&Run->Pause, 1);
+
+	while (ReadAcquire(&Run->InFlight) != 0)
+	{
+		sched_yield();
+	}
+}
+
+static int
+TchStressRun(
+	IN const TOUCH_FAKE_PEP_CONFIG* Config,
+	IN ULONG Threads,
+	IN ULONG DurationMs,
+	IN ULONG CheckMs,
+	IN ULONG ThinkUs,
+	IN ULONGLONG Seed,
+	IN double BaseOpsPerSec,
+	OUT double* OpsPerSec
+)
+{
+	static TOUCH_STRESS_WORKER workers[TOUCH_STRESS_MAX_THREADS];
+	static TOUCH_FAKE_PEP pep;
+	TOUCH_STRESS_RUN run;
+	TOUCH_STRESS_WORKER total;
+	struct timespec interval;
+	LONGLONG start, end, deadline;
+	double busyNs;
+	ULONG i;
+
+	memset(&run, 0, sizeof(run));
+	run.ThinkUs = ThinkUs;
+
+	if (!NT_SUCCESS(TchFakePepInitialize(&pep, Config)))
+	{
+		fprintf(stderr, "stress: cannot start the simulated PEP\n");
+		return -1;
+	}
+
+	for (i = 0; i < Threads; i++)
+	{
+		memset(&workers[i], 0, sizeof(workers[i]));
+		workers[i].Pep = &pep;
+		workers[i].Run = &run;
+		workers[i].Random = Seed * 0x9E3779B97F4A7C15ULL + i + 1;
+
+		if (pthread_create(&workers[i].Thread, NULL, TchStressWorker, &workers[i]) != 0)
+		{
+			fprintf(stderr, "stress: cannot start worker %u\n", i);
+			Threads = i;
+			break;
+		}
+	}
+
+	interval.tv_sec = CheckMs / 1000;
+	interval.tv_nsec = (long)(CheckMs % 1000) * 1000000;
+
+	start = TchPlatQueryTicks();
+	deadline = start + (LONGLONG)DurationMs * 1000000;
+
+	InterlockedExchange(&run.Start, 1);
+
+	while (TchPlatQueryTicks() < deadline)
+	{
+		nanosleep(&interval, NULL);
+
+		TchStressQuiesce(&run);
+		TchStressCheck(&pep, &run, workers, Threads);
+		InterlockedExchange(&run.Pause, 0);
+	}
+
+	InterlockedExchange(&run.Stop, 1);
+
+	for (i = 0; i < Threads; i++)
+	{
+		pthread_join(workers[i].Thread, NULL);
+	}
+
+	end = TchPlatQueryTicks();
+
+	TchStressCheck(&pep, &run, workers, Threads);
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < Threads; i++)
+	{
+		total.Ops += workers[i].Ops;
+		total.Toggles += workers[i].Toggles;
+		total.ScanChanges += workers[i].ScanChanges;
+		total.Queries += workers[i].Queries;
+		total.Elided += workers[i].Elided;
+		total.Busy += workers[i].Busy;
+		total.Exhausted += workers[i].Exhausted;
+		total.Pending += workers[i].Pending;
+		total.Failed += workers[i].Failed;
+		total.ThinkNs += workers[i].ThinkNs;
+	}
+
+	//
+	// Net throughput counts the time the workers were not thinking,
+	// averaged over the workers
+	//
+	busyNs = ((double)(end - start) * Threads - (double)total.ThinkNs) / Threads;
+	*OpsPerSec = (double)total.Ops * 1e9 / ((busyNs > 0) ? busyNs : 1.0);
+
+	printf("%7u %12.0f %12.0f %7.2fx %9llu %9llu %8llu %7.1f%% %9llu %8llu %8llu %7u %10u\n",
+		Threads,
+		(double)total.Ops * 1e9 / (double)(end - start),
+		*OpsPerSec,
+		(BaseOpsPerSec > 0) ? *OpsPerSec / BaseOpsPerSec : 1.0,
+		(unsigned long long)(total.Toggles + total.ScanChanges),
+		(unsigned long long)total.Queries,
+		(unsigned long long)total.Elided,
+		(total.Toggles + total.ScanChanges != 0) ?
+			100.0 * (double)total.Busy / (double)(total.Toggles + total.ScanChanges) : 0.0,
+		(unsigned long long)total.Exhausted,
+		(unsigned long long)total.Pending,
+		(unsigned long long)total.Failed,
+		run.Checks,
+		run.Violations);
+
+	TchFakePepCleanup(&pep);
+
+	return (run.Violations != 0) ? 1 : 0;
+}
+
+static VOID
+TchStressUsage(
+	VOID
+)
+{
+	fprintf(stderr,
+		"usage: touchpower_stress [options]\n"
+		"  --min-threads N     first thread count (default 1)\n"
+		"  --max-threads N     last thread count, doubling (default 64)\n"
+		"  --duration-ms MS    run time per thread count (default 500)\n"
+		"  --check-ms MS       interval between invariant checks (default 20)\n"
+		"  --think-us US       longest random pause between operations (default 20)\n"
+		"  --latency-us US     mean PEP latency, exponential (default 20)\n"
+		"  --pending PCT       share of transitions the PEP leaves pending (default 30)\n"
+		"  --drop PCT          share of pending ones never confirmed (default 0)\n"
+		"  --fail PCT          share of PoFxPowerControl failures (default 2)\n"
+		"  --seed N            random seed (default 1)\n");
+}
+
+int
+main(
+	int argc,
+	char** argv
+)
+{
+	TOUCH_FAKE_PEP_CONFIG config;
+	ULONG minThreads = 1;
+	ULONG maxThreads = TOUCH_STRESS_MAX_THREADS;
+	ULONG durationMs = 500;
+	ULONG checkMs = 20;
+	ULONG thinkUs = 20;
+	ULONG pending = 30;
+	ULONG fail = 2;
+	ULONGLONG seed = 1;
+	double baseOpsPerSec = 0;
+	double opsPerSec;
+	ULONG threads;
+	int failed = 0;
+	int result;
+	int i;
+
+	TchFakePepDefaultConfig(&config);
+
+	config.TransitionTimeoutMs = 50;
+	config.Distribution = FakeLatencyExponential;
+	config.MeanUs = 20;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (i + 1 >= argc)
+		{
+			TchStressUsage();
+			return 2;
+		}
+
+		if (strcmp(argv[i], "--min-threads") == 0)
+		{
+			minThreads = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--max-threads") == 0)
+		{
+			maxThreads = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--duration-ms") == 0)
+		{
+			durationMs = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--check-ms") == 0)
+		{
+			checkMs = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--think-us") == 0)
+		{
+			thinkUs = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--latency-us") == 0)
+		{
+			config.MeanUs = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--pending") == 0)
+		{
+			pending = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--drop") == 0)
+		{
+			config.DropPercent = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--fail") == 0)
+		{
+			fail = (ULONG)strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--seed") == 0)
+		{
+			seed = strtoull(argv[++i], NULL, 0);
+		}
+		else
+		{
+			TchStressUsage();
+			return 2;
+		}
+	}
+
+	if (minThreads == 0 || maxThreads < minThreads || maxThreads > TOUCH_STRESS_MAX_THREADS ||
+		checkMs == 0 || pending > 100 || fail > 100)
+	{
+		TchStressUsage();
+		return 2;
+	}
+
+	config.Wait1Percent = pending / 2;
+	config.Wait3Percent = pending - pending / 2;
+	config.NotSupportedPercent = fail / 2;
+	config.DeviceNotReadyPercent = fail - fail / 2;
+	config.Seed = seed;
+
+	printf("threads        ops/s    net ops/s scaling transitns   queries   elided    busy exhausted  pending   failed  checks violations\n");
+
+	for (threads = minThreads; threads <= maxThreads; threads *= 2)
+	{
+		result = TchStressRun(&config, threads, durationMs, checkMs, thinkUs, seed, baseOpsPerSec, &opsPerSec);
+		if (result < 0)
+		{
+			return 2;
+		}
+
+		if (baseOpsPerSec == 0)
+		{
+			baseOpsPerSec = opsPerSec;
+		}
+
+		failed |= result;
+	}
+
+	return failed;
+}